@@ -21,4 +21,15 @@
       cp -r MP1/src/echo $out/bin
     '';
   };
+  echoload = pkgs.stdenv.mkDerivation {
+    name = "echoload";
+    src = ../.;
+    buildPhase = ''
+      make -C MP1/src echoload
+    '';
+    installPhase = ''
+      mkdir -p $out/bin
+      cp -r MP1/src/echoload $out/bin
+    '';
+  };
 }
@@ -0,0 +1,344 @@
+// load generator for the tcp echo server
+// opens many concurrent connections, sends fixed size messages at a
+// controlled rate and prints throughput and latency as JSON
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "tcp/client.hpp"
+#include "tcp/error.hpp"
+#include "tcp/event_loop.hpp"
+#include "tcp/histogram.hpp"
+
+using namespace tcp;
+
+typedef std::chrono::steady_clock Clock;
+
+#define CONNECT_TIMEOUT std::chrono::seconds(5)
+
+struct Options {
+  const char *server;
+  int port;
+  unsigned int connections;
+  unsigned int threads;
+  // requests per second over all connections, 0 sends as fast as the
+  // server answers
+  double rate;
+  size_t message_size;
+  // requests in flight per connection
+  unsigned int pipeline;
+  unsigned int duration_s;
+};
+
+struct Connection {
+  std::unique_ptr<Client> client;
+  // when each request in flight was due, oldest first
+  std::deque<Clock::time_point> in_flight;
+  // bytes of the oldest response received so far
+  size_t received;
+  bool failed;
+};
+
+// one event loop and its share of the connections
+class Worker {
+ private:
+  const Options &options;
+  unsigned int num_connections;
+  double rate;
+  std::vector<Connection> connections;
+  EventLoop loop;
+  std::vector<char> message;
+  // next connection to try for a rate limited request
+  size_t next;
+  // when the next rate limited request is due, requests wait here while
+  // every connection is full, so their latency counts the wait
+  Clock::time_point next_due;
+  Clock::duration interval;
+
+ public:
+  Histogram latency;
+  unsigned long requests;
+  unsigned long errors;
+  unsigned long connect_errors;
+
+  Worker(const Options &options, unsigned int num_connections, double rate)
+      : options(options),
+        num_connections(num_connections),
+        rate(rate),
+        connections(),
+        loop(),
+        message(options.message_size, 'x'),
+        next(0),
+        next_due(),
+        interval(),
+        latency{},
+        requests(0),
+        errors(0),
+        connect_errors(0) {
+    message.back() = '\n';
+  }
+
+  void connect_all();
+  void run(Clock::time_point start, Clock::time_point deadline);
+
+ private:
+  bool full(const Connection &connection) const {
+    return connection.failed ||
+           connection.in_flight.size() >= options.pipeline;
+  }
+  void send(Connection &connection, Clock::time_point due);
+  void issue(Clock::time_point now);
+  void receive(Connection &connection);
+  void fail(Connection &connection);
+};
+
+void Worker::connect_all() {
+  connections.resize(num_connections);
+  for (Connection &connection : connections) {
+    connection.received = 0;
+    connection.failed = false;
+    try {
+      connection.client = std::unique_ptr<Client>(
+          new Client(options.server, options.port, CONNECT_TIMEOUT));
+    } catch (ConnectionError &e) {
+      connection.failed = true;
+      connect_errors++;
+      continue;
+    }
+    int fd = connection.client->get_fd();
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    Connection *c = &connection;
+    loop.add(fd, EPOLLIN | EPOLLOUT, [this, c](uint32_t events) {
+      if ((events & EPOLLOUT) && !c->failed && c->client->flush() < 0) {
+        fail(*c);
+      }
+      if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        receive(*c);
+      }
+    });
+  }
+}
+
+void Worker::send(Connection &connection, Clock::time_point due) {
+  if (connection.client->send(message.data(), message.size()) < 0) {
+    fail(connection);
+    return;
+  }
+  connection.in_flight.push_back(due);
+}
+
+// send what is due, a full connection passes its turn to the next one
+void Worker::issue(Clock::time_point now) {
+  if (rate <= 0) {
+    for (Connection &connection : connections) {
+      while (!full(connection)) {
+        send(connection, now);
+      }
+    }
+    return;
+  }
+  while (next_due <= now) {
+    size_t tried = 0;
+    while (tried < connections.size() && full(connections[next])) {
+      next = (next + 1) % connections.size();
+      tried++;
+    }
+    if (tried == connections.size()) {
+      return;
+    }
+    send(connections[next], next_due);
+    next = (next + 1) % connections.size();
+    next_due += interval;
+  }
+}
+
+void Worker::receive(Connection &connection) {
+  char buffer[65536];
+  while (!connection.failed) {
+    ssize_t n = connection.client->read(buffer, sizeof(buffer));
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (n <= 0) {
+      fail(connection);
+      return;
+    }
+
+    // every message_size bytes answer the oldest request
+    connection.received += n;
+    auto now = Clock::now();
+    while (connection.received >= options.message_size &&
+           !connection.in_flight.empty()) {
+      connection.received -= options.message_size;
+      latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         now - connection.in_flight.front())
+                         .count());
+      connection.in_flight.pop_front();
+      requests++;
+    }
+  }
+  issue(Clock::now());
+}
+
+void Worker::fail(Connection &connection) {
+  if (connection.failed) {
+    return;
+  }
+  connection.failed = true;
+  errors++;
+  loop.remove(connection.client->get_fd());
+}
+
+void Worker::run(Clock::time_point start, Clock::time_point deadline) {
+  if (rate > 0) {
+    interval = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(1 / rate));
+    next_due = start;
+  }
+
+  issue(start);
+  for (auto now = start; now < deadline; now = Clock::now()) {
+    // the loop has ms resolution, rate limited requests are sent late by
+    // at most that much (and the latency counts it)
+    auto left =
+        std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now);
+    long timeout = std::min(rate > 0 ? 1L : 100L, (long)left.count() + 1);
+    if (loop.poll(timeout) < 0 && errno != EINTR) {
+      perror("EventLoop poll");
+      return;
+    }
+    issue(Clock::now());
+  }
+}
+
+void usage(const char *progname) {
+  fprintf(stderr,
+          "Usage: %s [-c connections] [-t threads] [-r requests/s] "
+          "[-s message size] [-p pipeline depth] [-d seconds] "
+          "<server> <port>\n",
+          progname);
+  exit(EXIT_FAILURE);
+}
+
+// positive integer option
+unsigned long number(const char *arg, const char *progname) {
+  char *end;
+  unsigned long value = strtoul(arg, &end, 10);
+  if (*arg == '\0' || *end != '\0' || value == 0) {
+    usage(progname);
+  }
+  return value;
+}
+
+// thousands of connections need more descriptors than the usual soft limit
+void raise_fd_limit() {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+      limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  Options options = {nullptr, 0, 100, 4, 0, 64, 1, 5};
+  int opt;
+  while ((opt = getopt(argc, argv, "c:t:r:s:p:d:")) != -1) {
+    switch (opt) {
+      case 'c':
+        options.connections = number(optarg, argv[0]);
+        break;
+      case 't':
+        options.threads = number(optarg, argv[0]);
+        break;
+      case 'r':
+        options.rate = atof(optarg);
+        break;
+      case 's':
+        options.message_size = number(optarg, argv[0]);
+        break;
+      case 'p':
+        options.pipeline = number(optarg, argv[0]);
+        break;
+      case 'd':
+        options.duration_s = number(optarg, argv[0]);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (argc - optind != 2) {
+    usage(argv[0]);
+  }
+  options.server = argv[optind];
+  options.port = atoi(argv[optind + 1]);
+  options.threads = std::min(options.threads, options.connections);
+  raise_fd_limit();
+
+  // spread connections and rate evenly over the workers
+  std::vector<std::unique_ptr<Worker>> workers;
+  for (unsigned int i = 0; i < options.threads; i++) {
+    unsigned int share = options.connections / options.threads +
+                         (i < options.connections % options.threads ? 1 : 0);
+    workers.emplace_back(
+        new Worker(options, share, options.rate / options.threads));
+  }
+
+  // connections are opened before the clock starts
+  std::vector<std::thread> threads;
+  for (auto &worker : workers) {
+    threads.emplace_back(&Worker::connect_all, worker.get());
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  threads.clear();
+
+  auto start = Clock::now();
+  auto deadline = start + std::chrono::seconds(options.duration_s);
+  for (auto &worker : workers) {
+    threads.emplace_back(&Worker::run, worker.get(), start, deadline);
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  double elapsed =
+      std::chrono::duration<double>(Clock::now() - start).count();
+
+  HistogramSnapshot latency;
+  unsigned long requests = 0, errors = 0, connect_errors = 0;
+  for (auto &worker : workers) {
+    latency.add(worker->latency);
+    requests += worker->requests;
+    errors += worker->errors;
+    connect_errors += worker->connect_errors;
+  }
+  Percentiles percentiles = latency.percentiles();
+
+  printf("{\"server\": \"%s\", \"port\": %d, \"connections\": %u, "
+         "\"threads\": %u, \"rate\": %.1f, \"message_size\": %zu, "
+         "\"pipeline\": %u, \"duration_s\": %.3f, ",
+         options.server, options.port, options.connections, options.threads,
+         options.rate, options.message_size, options.pipeline, elapsed);
+  printf("\"requests\": %lu, \"errors\": %lu, \"connect_errors\": %lu, "
+         "\"requests_per_s\": %.1f, \"bytes_per_s\": %.1f, ",
+         requests, errors, connect_errors, requests / elapsed,
+         2.0 * requests * options.message_size / elapsed);
+  printf("\"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, "
+         "\"max\": %.1f}}\n",
+         percentiles.p50 / 1e3, percentiles.p99 / 1e3,
+         percentiles.p999 / 1e3, percentiles.max / 1e3);
+  return errors == 0 && connect_errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,15 +1,22 @@
 // tcp echo server
 // support multiple clients
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "tcp/server.hpp"
 
 using namespace tcp;
 
 void usage(const char *progname) {
-  fprintf(stderr, "Usage: %s <port>\n", progname);
+  fprintf(stderr,
+          "Usage: %s [-m fork|thread|pool|event|prefork|io_uring] "
+          "[-c max_clients] [-w pool or prefork workers] [-a acceptors] "
+          "<port>\n",
+          progname);
   exit(EXIT_FAILURE);
 }
 
@@ -35,13 +42,80 @@ void echo_handler(Client *client, void *) {
   }
 }
 
+// echo whatever is readable, the loop flushes what the socket did not take
+bool echo_event_handler(Client *client, uint32_t events, void *) {
+  if (!(events & Readable)) {
+    return true;
+  }
+  char buffer[256];
+  while (true) {
+    ssize_t bytes_read = client->read(buffer, sizeof(buffer));
+    if (bytes_read < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+
+    // EOF
+    if (bytes_read == 0) {
+      return false;
+    }
+
+    if (client->send(buffer, bytes_read) < 0) {
+      perror("send");
+      return false;
+    }
+  }
+}
+
 int main(int argc, char *argv[]) {
-  if (argc != 2) {
+  const char *mode = "fork";
+  int max_clients = 0;
+  int workers = 4;
+  int acceptors = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "m:c:w:a:")) != -1) {
+    if (opt == 'm') {
+      mode = optarg;
+    } else if (opt == 'c' && atoi(optarg) > 0) {
+      max_clients = atoi(optarg);
+    } else if (opt == 'w' && atoi(optarg) > 0) {
+      workers = atoi(optarg);
+    } else if (opt == 'a' && atoi(optarg) > 0) {
+      acceptors = atoi(optarg);
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (argc - optind != 1) {
     usage(argv[0]);
   }
 
-  int port = atoi(argv[1]);
+  int port = atoi(argv[optind]);
 
   Server server;
-  server.set_port(port).add_handler(echo_handler).exec();
+  server.set_port(port);
+  // room for load tests, the library defaults suit a handful of clients
+  if (max_clients > 0) {
+    server.set_max_clients(max_clients).set_backlog(max_clients);
+  }
+  // SO_REUSEPORT listeners, the kernel spreads connections over them
+  server.set_acceptor_shards(acceptors);
+  if (strcmp(mode, "fork") == 0) {
+    server.add_handler(echo_handler);
+  } else if (strcmp(mode, "thread") == 0) {
+    server.use_threads().add_handler(echo_handler);
+  } else if (strcmp(mode, "pool") == 0) {
+    // each worker thread serves one client at a time
+    server.use_thread_pool(workers).add_handler(echo_handler);
+  } else if (strcmp(mode, "event") == 0) {
+    server.use_event_loop().add_event_handler(echo_event_handler);
+  } else if (strcmp(mode, "prefork") == 0) {
+    // each worker serves one client at a time
+    server.use_prefork(workers).add_handler(echo_handler);
+  } else if (strcmp(mode, "io_uring") == 0) {
+    server.use_event_loop().use_io_uring().add_event_handler(
+        echo_event_handler);
+  } else {
+    usage(argv[0]);
+  }
+  server.exec();
 }
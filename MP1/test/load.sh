@@ -0,0 +1,104 @@
+#!/usr/bin/env bash
+
+port=2001
+passed=0
+
+# connections of the high connection run, 0 skips it
+high_connections=${LOAD_CONNECTIONS:-2000}
+
+# build the project
+make -C ../src/ &> /dev/null
+
+server_PID=
+
+# start the server with the given options and wait for it to listen
+start_server() {
+    ../src/echos "$@" $port &> /dev/null &
+    server_PID=$!
+    sleep 1
+}
+
+# stop only the server this script started, a prefork server drains its
+# workers on SIGTERM
+# io_uring releases the listener after the process exits, so wait (up to
+# 5s) for the port to close before the next server binds it
+stop_server() {
+    if [ -n "$server_PID" ]; then
+        kill $server_PID &> /dev/null
+        wait $server_PID &> /dev/null
+        server_PID=
+        for _ in $(seq 50); do
+            (exec 3<> /dev/tcp/127.0.0.1/$port) 2> /dev/null || break
+            sleep 0.1
+        done
+    fi
+}
+
+trap stop_server EXIT
+
+# run the loader against the running server, the loader fails on any
+# connection error
+check_load() {
+    local name=$1
+    shift
+    if ! ../src/echoload "$@" 127.0.0.1 $port > load.json; then
+        echo "Load test failed in $name mode!"
+        cat load.json
+        passed=1
+    elif ! grep -q '"requests": [1-9]' load.json; then
+        echo "No requests answered in $name mode!"
+        passed=1
+    fi
+}
+
+# mode name, then the server's options
+modes=(
+    "fork:-m fork"
+    "thread:-m thread"
+    "pool:-m pool -w 100"
+    "event:-m event"
+    "reuseport:-m event -a 4"
+    "prefork:-m prefork -w 100"
+    "io_uring:-m io_uring"
+)
+
+for entry in "${modes[@]}"; do
+    name=${entry%%:*}
+    read -r -a options <<< "${entry#*:}"
+
+    start_server "${options[@]}" -c 200
+
+    # pipelined clients
+    check_load "$name" -c 100 -t 2 -p 4 -s 128 -d 1
+
+    stop_server
+done
+
+# thousands of connections, the client and the server each hold one
+# descriptor per connection
+if [ "$high_connections" -gt 0 ]; then
+    needed=$((high_connections + 64))
+    hard=$(ulimit -Hn)
+    if [ "$hard" != unlimited ] && [ "$hard" -lt $needed ]; then
+        echo "Skipping $high_connections connections, the hard descriptor" \
+             "limit is $hard"
+    else
+        if [ "$(ulimit -n)" != unlimited ] && [ "$(ulimit -n)" -lt $needed ]; then
+            ulimit -n $needed
+        fi
+        start_server -m event -a 4 -c $((high_connections + 100))
+        check_load "$high_connections connection" -c $high_connections -t 4 \
+            -p 1 -s 64 -d 2
+        stop_server
+    fi
+fi
+
+rm -f load.json
+
+if [ $passed -eq 0 ]; then
+    echo "Load test passed!"
+else
+    echo "Load test failed!"
+fi
+
+exit $passed
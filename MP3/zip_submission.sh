@@ -8,13 +8,15 @@ make -C .. clean
 mkdir -p mp$MP\_$team_id
 rm -rf mp$MP\_$team_id/*
 
-LIBS="../libudp ../libtftp"
+LIBS="../libudp ../libtftp ../libtcp ../libdns"
 
 cp -r ./test_cases_report_9.pdf README.md src/* $LIBS mp$MP\_$team_id/
 
-# go through src/makefile and change ../../libudp to libudp and ../../libtftp to libtftp
+# go through src/makefile and change the ../../lib* paths to lib*
 sed -i 's/..\/..\/libudp/libudp/g' mp$MP\_$team_id/makefile
 sed -i 's/..\/..\/libtftp/libtftp/g' mp$MP\_$team_id/makefile
+sed -i 's/..\/..\/libtcp/libtcp/g' mp$MP\_$team_id/makefile
+sed -i 's/..\/..\/libdns/libdns/g' mp$MP\_$team_id/makefile
 
 zip -r mp$MP\_$team_id.zip mp$MP\_$team_id
 
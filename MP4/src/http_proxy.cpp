@@ -2,6 +2,7 @@
 
 #include <csignal>
 #include <iostream>
+#include <memory>
 #include <mutex>
 #include <tuple>
 #include <unordered_map>
@@ -10,6 +11,8 @@
 #include "http/constants.hpp"
 #include "http/message.hpp"
 #include "tcp/client.hpp"
+#include "tcp/connection_pool.hpp"
+#include "tcp/error.hpp"
 #include "tcp/server.hpp"
 
 using namespace http;
@@ -22,12 +25,18 @@ void usage(const char* progname) {
 
 typedef time_t ExpirationTime;
 typedef time_t LastUsedTime;
-typedef std::tuple<LastUsedTime, ExpirationTime, std::unique_ptr<Message>>
+// handlers keep serving a response after dropping the lock, even if the
+// entry is evicted meanwhile
+typedef std::tuple<LastUsedTime, ExpirationTime, std::shared_ptr<Message>>
     CacheEntry;
 typedef std::unordered_map<size_t, CacheEntry> Cache;
 
+// global so the SIGUSR1 handler can print it
 Cache cache;
+// the handler threads share the cache
 std::mutex cache_mutex;
+// ms before an upstream that does not answer gets a 502
+#define UPSTREAM_CONNECT_TIMEOUT 3000
 
 std::pair<std::string, std::string> get_host_and_path_from_uri(
     const std::string& uri) {
@@ -70,8 +79,6 @@ int main(int argc, char* argv[]) {
 
   print_welcome_message(ip, port);
 
-  auto extra_data = std::make_tuple(&cache, &cache_mutex);
-
   // on user1 interrupt, print a summary of the cache
   signal(SIGUSR1, [](int) {
     std::cerr << "Cache summary:" << std::endl;
@@ -83,31 +90,25 @@ int main(int argc, char* argv[]) {
     }
   });
 
+  // upstream connections are kept alive and shared by the handler threads
+  tcp::ConnectionPool upstream_pool;
+  upstream_pool.set_connect_timeout(UPSTREAM_CONNECT_TIMEOUT);
+
   tcp::Server server;
   server.set_ip_addr(ip)
       .set_port(port)
       .use_threads()  // use threads to handle multiple clients instead of
                       // forking -- new feature in MP4
-      .add_handler_extra_data(&extra_data)
-      .add_handler([](tcp::Client* client, void* extra_data) {
-        auto [cache, cache_mutex] =
-            *static_cast<std::tuple<Cache*, std::mutex*>*>(extra_data);
+      .add_handler([cache = &cache, cache_mutex = &cache_mutex,
+                    &upstream_pool](tcp::Client* client) {
+        // large responses go out without copying them into the socket
+        // (unix sockets and kernels without SO_ZEROCOPY just copy)
+        client->set_zerocopy();
+
         // read in the http request from the client (get request ends with
         // 2CRLFs)
         std::string request_str;
-        char buffer[1024];
-        while (true) {
-          size_t bytes_read = client->read(buffer, sizeof(buffer));
-          if (bytes_read == 0) {
-            break;
-          }
-          request_str.append(buffer, bytes_read);
-          if (request_str.size() >= 4 &&
-              request_str.substr(request_str.size() - 4) ==
-                  std::string(CRLF) + std::string(CRLF)) {
-            break;
-          }
-        }
+        client->read_until(request_str, std::string(CRLF) + std::string(CRLF));
         http::Message request(request_str);
 
         auto now = time(nullptr);
@@ -131,21 +132,29 @@ int main(int argc, char* argv[]) {
 
         // check if the uri is in the cache
         auto hash = std::hash<std::string>{}(uri);
-        auto it = cache->find(hash);
+        std::shared_ptr<Message> cached;
+        ExpirationTime expiration_time = 0;
+        {
+          std::lock_guard<std::mutex> guard(*cache_mutex);
+          auto it = cache->find(hash);
+          if (it != cache->end()) {
+            expiration_time = std::get<1>(it->second);
+            cached = std::get<2>(it->second);
+            if (now < expiration_time) {
+              // update the last used time
+              std::get<0>(it->second) = now;
+            }
+          }
+        }
         // if an entry exists in the cache and it is not expired
-        if (it != cache->end()) {
-          auto& entry = it->second;
-          auto expiration_time = std::get<1>(entry);
+        if (cached) {
           // if the entry is not expired
           if (now < expiration_time) {
             std::cerr << "Cache hit for " << uri << std::endl;
             std::cerr << "Re-send the response" << std::endl;
             std::cerr << "Expires in " << expiration_time - now << " seconds"
                       << std::endl;
-            // update the last used time
-            std::get<0>(entry) = now;
-            auto response_str = std::get<2>(entry)->to_string();
-            client->writen((void*)response_str.c_str(), response_str.size());
+            cached->write_to(*client);
             return;
           }
           // stale cache entry -- make a conditional get
@@ -163,27 +172,39 @@ int main(int argc, char* argv[]) {
         }
 
         // create a client to the server
-        http::Client http_client(host, port);
+        http::Client http_client(host, port, &upstream_pool);
         // get the response from the server
-        auto response = http_client.get(path, std::move(additional_headers));
+        std::unique_ptr<Message> response;
+        try {
+          response = http_client.get(path, std::move(additional_headers));
+        } catch (tcp::ConnectionError& e) {
+          // an unreachable server must not hold the handler for long
+          std::cerr << "Upstream connect failed: " << e.what() << std::endl;
+          Message(StatusCode(StatusCodeEnum::BAD_GATEWAY)).write_to(*client);
+          return;
+        }
 
         auto status_code = response->get_status_code();
         std::cerr << "Response status: " << status_code.to_string()
                   << std::endl;
 
         // check if the response is a 304 Not Modified
-        if (status_code.get_code() == StatusCodeEnum::NOT_MODIFIED) {
+        if (status_code.get_code() == StatusCodeEnum::NOT_MODIFIED && cached) {
           std::cerr << "Serving from cache" << std::endl;
-          auto& entry = cache->at(hash);
-          // update the last used time
-          std::get<0>(entry) = now;
+          {
+            std::lock_guard<std::mutex> guard(*cache_mutex);
+            auto it = cache->find(hash);
+            if (it != cache->end()) {
+              // update the last used time
+              std::get<0>(it->second) = now;
+            }
+          }
           // write the response back to the client
-          auto response_str = std::get<2>(entry)->to_string();
-          client->writen((void*)response_str.c_str(), response_str.size());
+          cached->write_to(*client);
           return;
         }
 
-        auto expiration_time = now;  // default to not caching
+        expiration_time = now;  // default to not caching
 
         // check for Expires header
         auto expires_header = response->get_header("Expires");
@@ -225,9 +246,9 @@ int main(int argc, char* argv[]) {
         }
 
         // write the response back to the client
-        auto response_str = response->to_string();
-        client->writen((void*)response_str.c_str(), response_str.size());
+        response->write_to(*client);
 
+        std::lock_guard<std::mutex> guard(*cache_mutex);
         // if cache has 11 entries, remove the oldest one
         if (cache->size() >= 10) {
           std::cerr << "Cache is full, removing oldest entry" << std::endl;
@@ -145,19 +145,7 @@ int main(int argc, char* argv[]) {
       .use_threads()
       .add_handler([](tcp::Client* client, void*) {
         std::string request_str;
-        char buffer[1024];
-        while (true) {
-          size_t bytes_read = client->read(buffer, sizeof(buffer));
-          if (bytes_read == 0) {
-            break;
-          }
-          request_str.append(buffer, bytes_read);
-          if (request_str.size() >= 4 &&
-              request_str.substr(request_str.size() - 4) ==
-                  std::string(CRLF) + std::string(CRLF)) {
-            break;
-          }
-        }
+        client->read_until(request_str, std::string(CRLF) + std::string(CRLF));
         http::Message request(request_str);
         auto uri = request.get_uri();
         std::cerr << "Request for " << uri << std::endl;
@@ -174,8 +162,7 @@ int main(int argc, char* argv[]) {
               std::cout << "304" << std::endl;
               auto response = std::make_unique<http::Message>(
                   StatusCode(StatusCodeEnum::NOT_MODIFIED));
-              auto response_str = response->to_string();
-              client->writen((void*)response_str.c_str(), response_str.size());
+              response->write_to(*client);
               return;
             } else {
               goto normal_response;
@@ -183,8 +170,7 @@ int main(int argc, char* argv[]) {
           } else {
           normal_response:
             auto response = route->second();
-            auto response_str = response->to_string();
-            client->writen((void*)response_str.c_str(), response_str.size());
+            response->write_to(*client);
           }
         }
         // 404 if the route is not found
@@ -192,8 +178,7 @@ int main(int argc, char* argv[]) {
           std::cout << "404" << std::endl;
           auto response = std::make_unique<http::Message>(
               StatusCode(StatusCodeEnum::NOT_FOUND));
-          auto response_str = response->to_string();
-          client->writen((void*)response_str.c_str(), response_str.size());
+          response->write_to(*client);
         }
       })
       .exec();
@@ -0,0 +1,17 @@
+#ifndef _DNS_ERROR_HPP_
+#define _DNS_ERROR_HPP_
+
+#include <stdexcept>
+
+namespace dns {
+
+class ConfigurationError : public std::runtime_error {
+ public:
+  ConfigurationError(const std::string& what_arg)
+      : std::runtime_error(what_arg) {}
+  ConfigurationError(const char* what_arg) : std::runtime_error(what_arg) {}
+};
+
+}  // namespace dns
+
+#endif
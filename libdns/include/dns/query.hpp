@@ -0,0 +1,49 @@
+#ifndef _DNS_QUERY_HPP_
+#define _DNS_QUERY_HPP_
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace dns {
+
+// largest response accepted over UDP (EDNS0 is not used)
+#define DNS_MAX_UDP_SIZE 512
+
+enum record_type : uint16_t { A = 1, CNAME = 5, SOA = 6, AAAA = 28 };
+
+enum response_code : uint8_t {
+  NoError = 0,
+  FormatError = 1,
+  ServerFailure = 2,
+  NameError = 3,
+  NotImplemented = 4,
+  Refused = 5
+};
+
+struct Answer {
+  uint16_t id;
+  uint8_t rcode;
+  bool truncated;
+  // A records come back v4-mapped
+  std::vector<struct in6_addr> addresses;
+  // lowest TTL of the addresses, or the negative TTL from the SOA record
+  // (0 if the response carried neither)
+  uint32_t ttl;
+};
+
+// encode a recursive query for name into buffer
+// returns the packet length (0 if name is not a valid domain name)
+size_t build_query(uint16_t id, const std::string& name, record_type type,
+                   uint8_t* buffer, size_t buffer_len);
+
+// decode a response (false if the packet is malformed)
+bool parse_response(const uint8_t* packet, size_t len, record_type type,
+                    Answer& answer);
+
+}  // namespace dns
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef _DNS_RESOLVER_HPP_
+#define _DNS_RESOLVER_HPP_
+
+#include <netinet/in.h>
+#include <time.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace dns {
+
+// error is a getaddrinfo code (EAI_*, print it with gai_strerror), 0 on
+// success
+typedef std::function<void(int error,
+                           const std::vector<struct in6_addr>& addresses)>
+    ResolveCallback;
+
+// caching stub resolver
+// names are looked up in the hosts file, then asked of the nameservers
+// (A and AAAA), answers are cached for their TTL and failures for the
+// negative TTL
+// IPv4 addresses come back v4-mapped, after the IPv6 ones
+class Resolver {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+ private:
+  struct CacheEntry {
+    int error;
+    std::vector<struct in6_addr> addresses;
+    Clock::time_point expires;
+  };
+
+  // operational data
+  std::mutex lock;
+  std::unordered_map<std::string, CacheEntry> cache;
+  std::unordered_map<std::string, std::vector<struct in6_addr>> hosts;
+  struct timespec hosts_mtime;
+  Clock::time_point hosts_checked;
+  bool nameservers_loaded;
+  // async lookups in flight, later callers for the same name wait on them
+  std::unordered_map<std::string, std::vector<ResolveCallback>> pending;
+  std::deque<std::string> jobs;
+  std::condition_variable jobs_ready;
+  std::vector<std::thread> workers;
+  bool stopping;
+  std::atomic<unsigned long> hits;
+  std::atomic<unsigned long> misses;
+
+  // configuration data
+  std::string hosts_file;
+  std::vector<struct sockaddr_in6> nameservers;
+  unsigned int num_threads;
+  unsigned int timeout_ms;
+  unsigned int attempts;
+  unsigned int negative_ttl;
+
+ public:
+  Resolver();
+  ~Resolver();
+  Resolver(const Resolver&) = delete;
+  Resolver& operator=(const Resolver&) = delete;
+
+  // resolver shared by tcp::Client and udp::Client
+  static Resolver& get_default();
+
+  // resolver configuration
+  // /etc/hosts by default, "" disables it
+  Resolver& set_hosts_file(const std::string& path);
+  // replaces the nameservers from /etc/resolv.conf
+  Resolver& add_nameserver(const char* ip_addr, int port_no = 53);
+  // threads that serve resolve_async (started on first use)
+  Resolver& set_threads(unsigned int num_threads);
+  // wait per query attempt, and attempts per nameserver
+  Resolver& set_timeout(unsigned int ms, unsigned int attempts = 2);
+  // how long failed lookups are cached when the server gives no SOA
+  Resolver& set_negative_ttl(unsigned int seconds);
+
+  // blocking lookup on the calling thread, returns the error
+  // (EAI_AGAIN if deadline passes first, the system resolver fallback is
+  // only started before it)
+  int resolve(const std::string& name, std::vector<struct in6_addr>& addresses,
+              Clock::time_point deadline = Clock::time_point::max());
+
+  // non-blocking lookup, callback runs on a resolver thread (or right away
+  // if the answer is already known)
+  void resolve_async(const std::string& name, ResolveCallback callback);
+
+  // answer from literals, the hosts file or the cache without any I/O
+  // (false if the name has to be looked up)
+  bool resolve_cached(const std::string& name, int& error,
+                      std::vector<struct in6_addr>& addresses);
+
+  // forget every cached answer
+  void clear_cache();
+
+  // lookups answered from the cache / sent to the nameservers
+  unsigned long get_hits() const { return hits; }
+  unsigned long get_misses() const { return misses; }
+
+ private:
+  bool answer_locally(const std::string& name, int& error,
+                      std::vector<struct in6_addr>& addresses);
+  int lookup(const std::string& name, std::vector<struct in6_addr>& addresses,
+             unsigned int& ttl, Clock::time_point deadline);
+  int query_nameservers(const std::string& name,
+                        std::vector<struct in6_addr>& addresses,
+                        unsigned int& ttl, Clock::time_point deadline);
+  int query_system(const std::string& name,
+                   std::vector<struct in6_addr>& addresses);
+  void store(const std::string& name, int error,
+             const std::vector<struct in6_addr>& addresses, unsigned int ttl);
+  void load_hosts();
+  void load_nameservers();
+  void start_workers();
+  void worker_loop();
+};
+
+}  // namespace dns
+
+#endif
@@ -0,0 +1,163 @@
+#include "dns/query.hpp"
+
+#include <string.h>
+
+namespace dns {
+
+#define HEADER_SIZE 12
+#define FLAG_RESPONSE 0x8000
+#define FLAG_TRUNCATED 0x0200
+#define FLAG_RECURSION_DESIRED 0x0100
+#define CLASS_IN 1
+
+static uint16_t get16(const uint8_t* p) { return (p[0] << 8) | p[1]; }
+
+static uint32_t get32(const uint8_t* p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put16(uint8_t* p, uint16_t value) {
+  p[0] = value >> 8;
+  p[1] = value & 0xff;
+}
+
+size_t build_query(uint16_t id, const std::string& name, record_type type,
+                   uint8_t* buffer, size_t buffer_len) {
+  // labels are at most 63 bytes, the encoded name at most 255
+  if (name.empty() || name.size() > 253 ||
+      buffer_len < HEADER_SIZE + name.size() + 2 + 4) {
+    return 0;
+  }
+
+  memset(buffer, 0, HEADER_SIZE);
+  put16(buffer, id);
+  put16(buffer + 2, FLAG_RECURSION_DESIRED);
+  put16(buffer + 4, 1);  // one question
+
+  uint8_t* p = buffer + HEADER_SIZE;
+  size_t start = 0;
+  while (start < name.size()) {
+    size_t end = name.find('.', start);
+    if (end == std::string::npos) {
+      end = name.size();
+    }
+    size_t label_len = end - start;
+    if (label_len == 0 || label_len > 63) {
+      return 0;
+    }
+    *p++ = label_len;
+    memcpy(p, name.data() + start, label_len);
+    p += label_len;
+    start = end + 1;
+  }
+  *p++ = 0;
+  put16(p, type);
+  put16(p + 2, CLASS_IN);
+  p += 4;
+  return p - buffer;
+}
+
+// offset just past the (possibly compressed) name at offset (0 if malformed)
+static size_t skip_name(const uint8_t* packet, size_t len, size_t offset) {
+  while (offset < len) {
+    uint8_t label_len = packet[offset];
+    if ((label_len & 0xc0) == 0xc0) {
+      // a pointer always ends the name
+      return offset + 2 <= len ? offset + 2 : 0;
+    }
+    if (label_len == 0) {
+      return offset + 1;
+    }
+    offset += 1 + label_len;
+  }
+  return 0;
+}
+
+bool parse_response(const uint8_t* packet, size_t len, record_type type,
+                    Answer& answer) {
+  if (len < HEADER_SIZE) {
+    return false;
+  }
+  uint16_t flags = get16(packet + 2);
+  if (!(flags & FLAG_RESPONSE)) {
+    return false;
+  }
+  answer.id = get16(packet);
+  answer.rcode = flags & 0x0f;
+  answer.truncated = flags & FLAG_TRUNCATED;
+  answer.addresses.clear();
+  answer.ttl = 0;
+
+  uint16_t num_questions = get16(packet + 4);
+  uint16_t num_answers = get16(packet + 6);
+  uint16_t num_authority = get16(packet + 8);
+
+  size_t offset = HEADER_SIZE;
+  for (uint16_t i = 0; i < num_questions; i++) {
+    offset = skip_name(packet, len, offset);
+    if (offset == 0 || offset + 4 > len) {
+      return false;
+    }
+    offset += 4;
+  }
+
+  bool have_ttl = false;
+  uint32_t negative_ttl = 0;
+  for (uint32_t i = 0; i < (uint32_t)num_answers + num_authority; i++) {
+    offset = skip_name(packet, len, offset);
+    if (offset == 0 || offset + 10 > len) {
+      return false;
+    }
+    uint16_t rtype = get16(packet + offset);
+    uint16_t rclass = get16(packet + offset + 2);
+    uint32_t ttl = get32(packet + offset + 4);
+    uint16_t rdlength = get16(packet + offset + 8);
+    offset += 10;
+    if (offset + rdlength > len) {
+      return false;
+    }
+    const uint8_t* rdata = packet + offset;
+    offset += rdlength;
+    if (rclass != CLASS_IN) {
+      continue;
+    }
+
+    if (i < num_answers) {
+      // CNAME chains are followed by the recursive server, the addresses
+      // at the end of them are all we need
+      struct in6_addr addr;
+      if (type == A && rtype == A && rdlength == 4) {
+        memset(&addr, 0, sizeof(addr));
+        addr.s6_addr[10] = 0xff;
+        addr.s6_addr[11] = 0xff;
+        memcpy(&addr.s6_addr[12], rdata, 4);
+      } else if (type == AAAA && rtype == AAAA && rdlength == 16) {
+        memcpy(&addr, rdata, 16);
+      } else {
+        continue;
+      }
+      answer.addresses.push_back(addr);
+      if (!have_ttl || ttl < answer.ttl) {
+        answer.ttl = ttl;
+        have_ttl = true;
+      }
+    } else if (rtype == SOA) {
+      // negative answers live for min(SOA TTL, SOA minimum), RFC 2308
+      size_t soa = skip_name(packet, len, rdata - packet);
+      soa = soa ? skip_name(packet, len, soa) : 0;
+      if (soa == 0 || soa + 20 > (size_t)(rdata - packet) + rdlength) {
+        continue;
+      }
+      uint32_t minimum = get32(packet + soa + 16);
+      negative_ttl = ttl < minimum ? ttl : minimum;
+    }
+  }
+
+  if (!have_ttl) {
+    answer.ttl = negative_ttl;
+  }
+  return true;
+}
+
+}  // namespace dns
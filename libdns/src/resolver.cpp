@@ -0,0 +1,577 @@
+#include "dns/resolver.hpp"
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <random>
+
+#include "dns/error.hpp"
+#include "dns/query.hpp"
+
+namespace dns {
+
+#define HOSTS_FILE "/etc/hosts"
+#define RESOLV_CONF "/etc/resolv.conf"
+// system resolver answers carry no TTL
+#define FALLBACK_TTL 30
+#define MAX_CACHE_ENTRIES 4096
+
+// lowercase, without the trailing root dot
+static std::string normalize(const std::string& name) {
+  std::string key = name;
+  if (!key.empty() && key.back() == '.') {
+    key.pop_back();
+  }
+  for (auto& c : key) {
+    c = tolower((unsigned char)c);
+  }
+  return key;
+}
+
+// parse an IPv4 (stored v4-mapped) or IPv6 literal
+static bool parse_address(const char* text, struct in6_addr& addr) {
+  struct in_addr addr4;
+  if (inet_pton(AF_INET, text, &addr4) == 1) {
+    memset(&addr, 0, sizeof(addr));
+    addr.s6_addr[10] = 0xff;
+    addr.s6_addr[11] = 0xff;
+    memcpy(&addr.s6_addr[12], &addr4, sizeof(addr4));
+    return true;
+  }
+  return inet_pton(AF_INET6, text, &addr) == 1;
+}
+
+// IPv6 addresses first, keeping the order within each family
+static void order_addresses(std::vector<struct in6_addr>& addresses) {
+  std::stable_partition(
+      addresses.begin(), addresses.end(),
+      [](const struct in6_addr& addr) { return !IN6_IS_ADDR_V4MAPPED(&addr); });
+}
+
+Resolver::Resolver()
+    : lock(),
+      cache(),
+      hosts(),
+      hosts_mtime{0, 0},
+      hosts_checked(),
+      nameservers_loaded(false),
+      pending(),
+      jobs(),
+      jobs_ready(),
+      workers(),
+      stopping(false),
+      hits(0),
+      misses(0),
+      hosts_file(HOSTS_FILE),
+      nameservers(),
+      num_threads(2),
+      timeout_ms(1000),
+      attempts(2),
+      negative_ttl(5) {}
+
+Resolver::~Resolver() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  jobs_ready.notify_all();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+Resolver& Resolver::get_default() {
+  // never destroyed, forked children exit without its threads
+  static Resolver* resolver = new Resolver();
+  return *resolver;
+}
+
+Resolver& Resolver::set_hosts_file(const std::string& path) {
+  std::lock_guard<std::mutex> guard(lock);
+  hosts_file = path;
+  hosts.clear();
+  hosts_mtime = {0, 0};
+  hosts_checked = Clock::time_point();
+  return *this;
+}
+
+Resolver& Resolver::add_nameserver(const char* ip_addr, int port_no) {
+  struct sockaddr_in6 addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin6_family = AF_INET6;
+  addr.sin6_port = htons(port_no);
+  if (ip_addr == nullptr || !parse_address(ip_addr, addr.sin6_addr)) {
+    throw ConfigurationError("Invalid nameserver address");
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  if (!nameservers_loaded) {
+    nameservers.clear();
+    nameservers_loaded = true;
+  }
+  nameservers.push_back(addr);
+  return *this;
+}
+
+Resolver& Resolver::set_threads(unsigned int num_threads) {
+  if (num_threads == 0) {
+    throw ConfigurationError("Resolver needs at least one thread");
+  }
+  std::lock_guard<std::mutex> guard(lock);
+  if (!workers.empty()) {
+    throw ConfigurationError("Cannot set threads while resolver is running");
+  }
+  this->num_threads = num_threads;
+  return *this;
+}
+
+Resolver& Resolver::set_timeout(unsigned int ms, unsigned int attempts) {
+  if (ms == 0 || attempts == 0) {
+    throw ConfigurationError("Timeout and attempts must be positive");
+  }
+  std::lock_guard<std::mutex> guard(lock);
+  timeout_ms = ms;
+  this->attempts = attempts;
+  return *this;
+}
+
+Resolver& Resolver::set_negative_ttl(unsigned int seconds) {
+  std::lock_guard<std::mutex> guard(lock);
+  negative_ttl = seconds;
+  return *this;
+}
+
+int Resolver::resolve(const std::string& name,
+                      std::vector<struct in6_addr>& addresses,
+                      Clock::time_point deadline) {
+  std::string key = normalize(name);
+  int error;
+  if (answer_locally(key, error, addresses)) {
+    return error;
+  }
+
+  unsigned int ttl = 0;
+  error = lookup(key, addresses, ttl, deadline);
+  store(key, error, addresses, ttl);
+  return error;
+}
+
+void Resolver::resolve_async(const std::string& name,
+                             ResolveCallback callback) {
+  std::string key = normalize(name);
+  int error;
+  std::vector<struct in6_addr> addresses;
+  if (answer_locally(key, error, addresses)) {
+    callback(error, addresses);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    auto& waiting = pending[key];
+    waiting.push_back(std::move(callback));
+    if (waiting.size() > 1) {
+      // already being looked up
+      return;
+    }
+    jobs.push_back(key);
+    start_workers();
+  }
+  jobs_ready.notify_one();
+}
+
+bool Resolver::resolve_cached(const std::string& name, int& error,
+                              std::vector<struct in6_addr>& addresses) {
+  return answer_locally(normalize(name), error, addresses);
+}
+
+void Resolver::clear_cache() {
+  std::lock_guard<std::mutex> guard(lock);
+  cache.clear();
+}
+
+bool Resolver::answer_locally(const std::string& name, int& error,
+                              std::vector<struct in6_addr>& addresses) {
+  addresses.clear();
+  struct in6_addr addr;
+  if (parse_address(name.c_str(), addr)) {
+    addresses.push_back(addr);
+    error = 0;
+    return true;
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  load_hosts();
+  auto host = hosts.find(name);
+  if (host != hosts.end()) {
+    addresses = host->second;
+    error = 0;
+    return true;
+  }
+
+  auto it = cache.find(name);
+  if (it == cache.end()) {
+    return false;
+  }
+  if (Clock::now() >= it->second.expires) {
+    cache.erase(it);
+    return false;
+  }
+  hits++;
+  error = it->second.error;
+  addresses = it->second.addresses;
+  return true;
+}
+
+int Resolver::lookup(const std::string& name,
+                     std::vector<struct in6_addr>& addresses,
+                     unsigned int& ttl, Clock::time_point deadline) {
+  misses++;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    load_nameservers();
+  }
+
+  int error = query_nameservers(name, addresses, ttl, deadline);
+  if (error == EAI_AGAIN && Clock::now() < deadline) {
+    // no usable answer (no servers, timeouts, truncation), let the system
+    // resolver have a go
+    error = query_system(name, addresses);
+    std::lock_guard<std::mutex> guard(lock);
+    ttl = error == 0 ? FALLBACK_TTL : negative_ttl;
+  }
+  return error;
+}
+
+int Resolver::query_nameservers(const std::string& name,
+                                std::vector<struct in6_addr>& addresses,
+                                unsigned int& ttl,
+                                Clock::time_point deadline) {
+  std::vector<struct sockaddr_in6> servers;
+  unsigned int wait_ms;
+  unsigned int num_attempts;
+  unsigned int default_negative_ttl;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    servers = nameservers;
+    wait_ms = timeout_ms;
+    num_attempts = attempts;
+    default_negative_ttl = negative_ttl;
+  }
+
+  static thread_local std::mt19937 random_ids(std::random_device{}());
+  const record_type types[2] = {AAAA, A};
+
+  for (unsigned int attempt = 0; attempt < num_attempts; attempt++) {
+    for (auto& server : servers) {
+      if (Clock::now() >= deadline) {
+        return EAI_AGAIN;
+      }
+      int sock_fd = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+      if (sock_fd < 0) {
+        perror("DNSResolver socket");
+        return EAI_SYSTEM;
+      }
+      // connected, so only this server's replies (and errors) come back
+      if (connect(sock_fd, (struct sockaddr*)&server, sizeof(server)) < 0) {
+        close(sock_fd);
+        continue;
+      }
+
+      uint16_t ids[2];
+      bool sent = true;
+      for (int i = 0; i < 2; i++) {
+        uint8_t query[DNS_MAX_UDP_SIZE];
+        ids[i] = random_ids();
+        size_t len = build_query(ids[i], name, types[i], query, sizeof(query));
+        if (len == 0) {
+          // not a name DNS can carry (too long, or an oversized label)
+          close(sock_fd);
+          ttl = default_negative_ttl;
+          return EAI_NONAME;
+        }
+        if (send(sock_fd, query, len, 0) < 0) {
+          sent = false;
+        }
+      }
+
+      Answer answers[2];
+      bool answered[2] = {false, false};
+      auto give_up = std::min(
+          deadline, Clock::now() + std::chrono::milliseconds(wait_ms));
+      while (sent && !(answered[0] && answered[1])) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            give_up - Clock::now());
+        if (left.count() <= 0) {
+          break;
+        }
+        struct pollfd pfd = {sock_fd, POLLIN, 0};
+        int ret = poll(&pfd, 1, left.count());
+        if (ret < 0 && errno == EINTR) {
+          continue;
+        }
+        if (ret <= 0) {
+          break;
+        }
+
+        uint8_t packet[DNS_MAX_UDP_SIZE];
+        ssize_t n = recv(sock_fd, packet, sizeof(packet), 0);
+        if (n < 0) {
+          // nothing listening there
+          break;
+        }
+        if (n < 2) {
+          continue;
+        }
+        uint16_t id = (packet[0] << 8) | packet[1];
+        for (int i = 0; i < 2; i++) {
+          if (!answered[i] && id == ids[i] &&
+              parse_response(packet, n, types[i], answers[i])) {
+            answered[i] = true;
+          }
+        }
+      }
+      close(sock_fd);
+
+      if (!answered[0] && !answered[1]) {
+        continue;
+      }
+      bool usable = true;
+      for (int i = 0; i < 2; i++) {
+        if (!answered[i]) {
+          continue;
+        }
+        if (answers[i].truncated) {
+          // the system resolver can retry over TCP
+          return EAI_AGAIN;
+        }
+        if (answers[i].rcode == NameError) {
+          addresses.clear();
+          ttl = answers[i].ttl ? answers[i].ttl : default_negative_ttl;
+          return EAI_NONAME;
+        }
+        if (answers[i].rcode != NoError) {
+          usable = false;
+        }
+      }
+      if (!usable) {
+        continue;
+      }
+
+      // AAAA answers first, then A
+      addresses.clear();
+      bool have_ttl = false;
+      unsigned int negative = 0;
+      for (int i = 0; i < 2; i++) {
+        if (!answered[i]) {
+          continue;
+        }
+        if (answers[i].addresses.empty()) {
+          negative = answers[i].ttl;
+          continue;
+        }
+        addresses.insert(addresses.end(), answers[i].addresses.begin(),
+                         answers[i].addresses.end());
+        if (!have_ttl || answers[i].ttl < ttl) {
+          ttl = answers[i].ttl;
+          have_ttl = true;
+        }
+      }
+      if (addresses.empty()) {
+        if (!answered[0] || !answered[1]) {
+          // no data for one type says nothing about the one without an
+          // answer, ask again rather than cache a missing name
+          continue;
+        }
+        ttl = negative ? negative : default_negative_ttl;
+        return EAI_NONAME;
+      }
+      return 0;
+    }
+  }
+  return EAI_AGAIN;
+}
+
+int Resolver::query_system(const std::string& name,
+                           std::vector<struct in6_addr>& addresses) {
+  struct addrinfo hints;
+  struct addrinfo* result;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET6;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_V4MAPPED | AI_ALL;
+
+  addresses.clear();
+  int s = getaddrinfo(name.c_str(), nullptr, &hints, &result);
+  if (s != 0) {
+    return s;
+  }
+  for (auto ai = result; ai != nullptr; ai = ai->ai_next) {
+    auto& addr = ((struct sockaddr_in6*)ai->ai_addr)->sin6_addr;
+    bool seen = false;
+    for (auto& known : addresses) {
+      seen = seen || memcmp(&known, &addr, sizeof(addr)) == 0;
+    }
+    if (!seen) {
+      addresses.push_back(addr);
+    }
+  }
+  freeaddrinfo(result);
+  order_addresses(addresses);
+  return 0;
+}
+
+void Resolver::store(const std::string& name, int error,
+                     const std::vector<struct in6_addr>& addresses,
+                     unsigned int ttl) {
+  // temporary failures are worth retrying right away
+  if (error == EAI_AGAIN || error == EAI_SYSTEM || ttl == 0) {
+    return;
+  }
+
+  auto now = Clock::now();
+  std::lock_guard<std::mutex> guard(lock);
+  if (cache.size() >= MAX_CACHE_ENTRIES) {
+    for (auto it = cache.begin(); it != cache.end();) {
+      it = now >= it->second.expires ? cache.erase(it) : std::next(it);
+    }
+    if (cache.size() >= MAX_CACHE_ENTRIES) {
+      cache.erase(cache.begin());
+    }
+  }
+  cache[name] = {error, addresses, now + std::chrono::seconds(ttl)};
+}
+
+// (re)read the hosts file if it changed, at most once a second
+void Resolver::load_hosts() {
+  auto now = Clock::now();
+  if (now - hosts_checked < std::chrono::seconds(1)) {
+    return;
+  }
+  hosts_checked = now;
+
+  struct stat st;
+  if (hosts_file.empty() || stat(hosts_file.c_str(), &st) < 0) {
+    hosts.clear();
+    hosts_mtime = {0, 0};
+    return;
+  }
+  if (st.st_mtim.tv_sec == hosts_mtime.tv_sec &&
+      st.st_mtim.tv_nsec == hosts_mtime.tv_nsec) {
+    return;
+  }
+  hosts_mtime = st.st_mtim;
+  hosts.clear();
+
+  FILE* file = fopen(hosts_file.c_str(), "r");
+  if (file == nullptr) {
+    perror("DNSResolver fopen");
+    return;
+  }
+  char* line = nullptr;
+  size_t line_len = 0;
+  while (getline(&line, &line_len, file) >= 0) {
+    char* comment = strchr(line, '#');
+    if (comment != nullptr) {
+      *comment = '\0';
+    }
+    char* saveptr;
+    char* token = strtok_r(line, " \t\r\n", &saveptr);
+    struct in6_addr addr;
+    if (token == nullptr || !parse_address(token, addr)) {
+      continue;
+    }
+    while ((token = strtok_r(nullptr, " \t\r\n", &saveptr)) != nullptr) {
+      hosts[normalize(token)].push_back(addr);
+    }
+  }
+  free(line);
+  fclose(file);
+
+  for (auto& host : hosts) {
+    order_addresses(host.second);
+  }
+}
+
+// nameservers from resolv.conf, unless some were configured
+void Resolver::load_nameservers() {
+  if (nameservers_loaded) {
+    return;
+  }
+  nameservers_loaded = true;
+
+  FILE* file = fopen(RESOLV_CONF, "r");
+  if (file == nullptr) {
+    return;
+  }
+  char* line = nullptr;
+  size_t line_len = 0;
+  while (getline(&line, &line_len, file) >= 0) {
+    char* saveptr;
+    char* keyword = strtok_r(line, " \t\r\n", &saveptr);
+    if (keyword == nullptr || strcmp(keyword, "nameserver") != 0) {
+      continue;
+    }
+    char* ip_addr = strtok_r(nullptr, " \t\r\n", &saveptr);
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_port = htons(53);
+    if (ip_addr != nullptr && parse_address(ip_addr, addr.sin6_addr)) {
+      nameservers.push_back(addr);
+    }
+  }
+  free(line);
+  fclose(file);
+}
+
+// called with the lock held
+void Resolver::start_workers() {
+  while (workers.size() < num_threads) {
+    workers.emplace_back([this]() { worker_loop(); });
+  }
+}
+
+void Resolver::worker_loop() {
+  while (true) {
+    std::string name;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      jobs_ready.wait(guard, [this]() { return stopping || !jobs.empty(); });
+      if (jobs.empty()) {
+        return;
+      }
+      name = std::move(jobs.front());
+      jobs.pop_front();
+    }
+
+    std::vector<struct in6_addr> addresses;
+    unsigned int ttl = 0;
+    int error = lookup(name, addresses, ttl, Clock::time_point::max());
+    store(name, error, addresses, ttl);
+
+    std::vector<ResolveCallback> callbacks;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      auto it = pending.find(name);
+      if (it != pending.end()) {
+        callbacks = std::move(it->second);
+        pending.erase(it);
+      }
+    }
+    for (auto& callback : callbacks) {
+      callback(error, addresses);
+    }
+  }
+}
+
+}  // namespace dns
@@ -0,0 +1,306 @@
+#include "dns/resolver.hpp"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "dns/query.hpp"
+
+using namespace dns;
+
+int failures = 0;
+
+void expect(bool ok, const char* what) {
+  if (!ok) {
+    std::cerr << "Failed: " << what << std::endl;
+    failures++;
+  }
+}
+
+bool has_address(const std::vector<struct in6_addr>& addresses,
+                 const char* text) {
+  std::string expected = text;
+  for (auto& addr : addresses) {
+    char buf[INET6_ADDRSTRLEN];
+    if (IN6_IS_ADDR_V4MAPPED(&addr)) {
+      inet_ntop(AF_INET, &addr.s6_addr[12], buf, sizeof(buf));
+    } else {
+      inet_ntop(AF_INET6, &addr, buf, sizeof(buf));
+    }
+    if (expected == buf) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// tiny authoritative server for example.test on a loopback UDP port
+//   short.example.test  A 192.0.2.1, AAAA 2001:db8::1, TTL 1
+//   long.example.test   A 192.0.2.2, TTL 300
+//   partial.example.test  AAAA 2001:db8::2, TTL 60, the first AAAA query
+//                         gets no reply
+//   silent.example.test   never answered
+//   anything else       NXDOMAIN, SOA minimum 2
+class FakeNameserver {
+ private:
+  int sock_fd;
+  std::thread thread;
+  bool dropped_partial;
+
+ public:
+  std::atomic<int> queries;
+  int port;
+
+  FakeNameserver() : dropped_partial(false), queries(0) {
+    sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(sock_fd, (struct sockaddr*)&addr, sizeof(addr));
+    socklen_t addr_len = sizeof(addr);
+    getsockname(sock_fd, (struct sockaddr*)&addr, &addr_len);
+    port = ntohs(addr.sin_port);
+    thread = std::thread([this]() { serve(); });
+  }
+
+  ~FakeNameserver() {
+    shutdown(sock_fd, SHUT_RDWR);
+    thread.join();
+    close(sock_fd);
+  }
+
+ private:
+  void serve() {
+    uint8_t packet[DNS_MAX_UDP_SIZE];
+    struct sockaddr_in6 peer;
+    socklen_t peer_len = sizeof(peer);
+    ssize_t n;
+    while ((n = recvfrom(sock_fd, packet, sizeof(packet), 0,
+                         (struct sockaddr*)&peer, &peer_len)) > 12) {
+      queries++;
+      size_t len = reply(packet, n);
+      if (len == 0) {
+        continue;
+      }
+      sendto(sock_fd, packet, len, 0, (struct sockaddr*)&peer, peer_len);
+      peer_len = sizeof(peer);
+    }
+  }
+
+  // turn the query in packet into its response (0 to send none)
+  size_t reply(uint8_t* packet, size_t len) {
+    std::string name;
+    size_t offset = 12;
+    while (packet[offset] != 0) {
+      if (!name.empty()) {
+        name += '.';
+      }
+      name.append((char*)packet + offset + 1, packet[offset]);
+      offset += 1 + packet[offset];
+    }
+    uint16_t type = (packet[offset + 1] << 8) | packet[offset + 2];
+    len = offset + 5;
+
+    packet[2] = 0x81;
+    packet[3] = 0x80;
+    packet[6] = packet[7] = packet[8] = packet[9] = 0;
+    if (name == "short.example.test") {
+      packet[7] = 1;
+      if (type == A) {
+        uint8_t addr[4] = {192, 0, 2, 1};
+        len = add_record(packet, len, A, 1, addr, 4);
+      } else {
+        struct in6_addr addr;
+        inet_pton(AF_INET6, "2001:db8::1", &addr);
+        len = add_record(packet, len, AAAA, 1, addr.s6_addr, 16);
+      }
+    } else if (name == "long.example.test") {
+      if (type == A) {
+        packet[7] = 1;
+        uint8_t addr[4] = {192, 0, 2, 2};
+        len = add_record(packet, len, A, 300, addr, 4);
+      }
+    } else if (name == "silent.example.test") {
+      return 0;
+    } else if (name == "partial.example.test") {
+      if (type == AAAA) {
+        if (!dropped_partial) {
+          dropped_partial = true;
+          return 0;
+        }
+        packet[7] = 1;
+        struct in6_addr addr;
+        inet_pton(AF_INET6, "2001:db8::2", &addr);
+        len = add_record(packet, len, AAAA, 60, addr.s6_addr, 16);
+      }
+    } else {
+      packet[3] |= NameError;
+      packet[9] = 1;
+      // root mname and rname, serial, refresh, retry, expire, minimum
+      uint8_t soa[22] = {0};
+      soa[21] = 2;
+      len = add_record(packet, len, SOA, 60, soa, sizeof(soa));
+    }
+    return len;
+  }
+
+  size_t add_record(uint8_t* packet, size_t len, uint16_t type, uint32_t ttl,
+                    const uint8_t* rdata, uint16_t rdlength) {
+    // name points back at the question
+    uint8_t header[12] = {0xc0,
+                          12,
+                          (uint8_t)(type >> 8),
+                          (uint8_t)type,
+                          0,
+                          1,
+                          (uint8_t)(ttl >> 24),
+                          (uint8_t)(ttl >> 16),
+                          (uint8_t)(ttl >> 8),
+                          (uint8_t)ttl,
+                          0,
+                          (uint8_t)rdlength};
+    memcpy(packet + len, header, sizeof(header));
+    memcpy(packet + len + sizeof(header), rdata, rdlength);
+    return len + sizeof(header) + rdlength;
+  }
+};
+
+int main() {
+  char hosts_path[] = "/tmp/resolver-hostsXXXXXX";
+  int hosts_fd = mkstemp(hosts_path);
+  std::string hosts =
+      "# local stub\n"
+      "10.0.0.1 stub.test stub\n"
+      "::2      stub.test\n";
+  if (hosts_fd < 0 || write(hosts_fd, hosts.data(), hosts.size()) < 0) {
+    perror("hosts file");
+    return 1;
+  }
+  close(hosts_fd);
+
+  FakeNameserver nameserver;
+  Resolver resolver;
+  resolver.set_hosts_file(hosts_path)
+      .add_nameserver("127.0.0.1", nameserver.port)
+      .set_timeout(500, 1);
+
+  std::vector<struct in6_addr> addresses;
+  expect(resolver.resolve("192.0.2.7", addresses) == 0 &&
+             has_address(addresses, "192.0.2.7"),
+         "IPv4 literal");
+  expect(resolver.resolve("::1", addresses) == 0 &&
+             has_address(addresses, "::1"),
+         "IPv6 literal");
+
+  expect(resolver.resolve("Stub.Test.", addresses) == 0 &&
+             addresses.size() == 2 && has_address(addresses, "10.0.0.1"),
+         "hosts file entry");
+  expect(!IN6_IS_ADDR_V4MAPPED(&addresses[0]), "IPv6 addresses come first");
+  expect(resolver.resolve("stub", addresses) == 0, "hosts file alias");
+  expect(nameserver.queries == 0, "hosts file answers without queries");
+
+  expect(resolver.resolve("short.example.test", addresses) == 0 &&
+             addresses.size() == 2 && has_address(addresses, "2001:db8::1") &&
+             has_address(addresses, "192.0.2.1"),
+         "A and AAAA records");
+  expect(resolver.resolve("short.example.test", addresses) == 0,
+         "cached answer");
+  expect(nameserver.queries == 2, "cached answer sends no queries");
+  expect(resolver.get_hits() == 1 && resolver.get_misses() == 1,
+         "hit and miss count");
+
+  expect(resolver.resolve("missing.example.test", addresses) == EAI_NONAME,
+         "unknown name fails");
+  expect(resolver.resolve("missing.example.test", addresses) == EAI_NONAME,
+         "failure is cached");
+  expect(nameserver.queries == 4, "negative answer sends no queries");
+
+  // TTL of 1s and negative TTL of 2s run out
+  std::this_thread::sleep_for(std::chrono::milliseconds(2100));
+  expect(resolver.resolve("short.example.test", addresses) == 0,
+         "expired answer is looked up again");
+  expect(resolver.resolve("missing.example.test", addresses) == EAI_NONAME,
+         "expired failure is looked up again");
+  expect(nameserver.queries == 8, "expired entries send new queries");
+
+  // concurrent async lookups of one name share a single query
+  std::promise<int> first;
+  std::promise<size_t> second;
+  resolver.resolve_async("long.example.test",
+                         [&first](int error, const auto&) {
+                           first.set_value(error);
+                         });
+  resolver.resolve_async("long.example.test",
+                         [&second](int, const auto& addresses) {
+                           second.set_value(addresses.size());
+                         });
+  expect(first.get_future().get() == 0, "async lookup");
+  expect(second.get_future().get() == 1, "waiting async lookup");
+  expect(nameserver.queries == 10, "async lookups are merged");
+
+  int error;
+  expect(resolver.resolve_cached("long.example.test", error, addresses) &&
+             error == 0 && has_address(addresses, "192.0.2.2"),
+         "async answer is cached");
+  resolver.clear_cache();
+  expect(!resolver.resolve_cached("long.example.test", error, addresses),
+         "clear_cache forgets answers");
+
+  // an empty A answer alone says nothing about AAAA, the lost query is
+  // sent again instead of the name being taken as missing
+  Resolver retrying;
+  retrying.set_hosts_file(hosts_path)
+      .add_nameserver("127.0.0.1", nameserver.port)
+      .set_timeout(200, 2);
+  expect(retrying.resolve("partial.example.test", addresses) == 0 &&
+             has_address(addresses, "2001:db8::2"),
+         "lost answer is asked for again");
+
+  // a deadline cuts the wait for the nameserver short and skips the
+  // system resolver
+  auto begin = std::chrono::steady_clock::now();
+  expect(resolver.resolve("silent.example.test", addresses,
+                          begin + std::chrono::milliseconds(100)) ==
+             EAI_AGAIN,
+         "lookup past its deadline fails");
+  expect(std::chrono::steady_clock::now() - begin <
+             std::chrono::milliseconds(300),
+         "lookup stops at its deadline");
+  expect(!resolver.resolve_cached("silent.example.test", error, addresses),
+         "timed out lookup is not cached");
+
+  // a label DNS cannot carry fails without a query, for the negative TTL
+  Resolver invalid;
+  invalid.set_hosts_file(hosts_path)
+      .add_nameserver("127.0.0.1", nameserver.port)
+      .set_negative_ttl(1);
+  std::string label(64, 'x');
+  std::string long_name = label + ".example.test";
+  expect(invalid.resolve(long_name, addresses) == EAI_NONAME,
+         "oversized label fails");
+  expect(invalid.resolve(long_name, addresses) == EAI_NONAME &&
+             invalid.get_hits() == 1,
+         "oversized label failure is cached");
+  std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+  expect(invalid.resolve(long_name, addresses) == EAI_NONAME &&
+             invalid.get_misses() == 2,
+         "oversized label failure expires");
+
+  unlink(hosts_path);
+
+  if (failures == 0) {
+    std::cout << "Resolver test passed!" << std::endl;
+  }
+  return failures == 0 ? 0 : 1;
+}
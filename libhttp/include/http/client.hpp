@@ -6,15 +6,26 @@
 #include "http/constants.hpp"
 #include "http/message.hpp"
 
+namespace tcp {
+class ConnectionPool;
+}  // namespace tcp
+
 namespace http {
 
 class Client {
   std::string host;
   int port;
+  tcp::ConnectionPool* pool;
 
  public:
-  Client(const std::string& host) : host(host), port(HTTP_PORT) {}
-  Client(const std::string& host, int port) : host(host), port(port) {}
+  Client(const std::string& host)
+      : host(host), port(HTTP_PORT), pool(nullptr) {}
+  Client(const std::string& host, int port)
+      : host(host), port(port), pool(nullptr) {}
+  // keep connections alive and reuse them through pool
+  Client(const std::string& host, int port, tcp::ConnectionPool* pool)
+      : host(host), port(port), pool(pool) {}
+  // with a pool, throws tcp::ConnectionError if the server can't be reached
   std::unique_ptr<Message> get(const std::string& path,
                                HeaderList&& additional_headers = {});
 };
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <sys/types.h>
+
 #include <memory>
 #include <optional>
 #include <string>
@@ -9,6 +11,10 @@
 #include "http/status-line.hpp"
 #include "http/typedef.hpp"
 
+namespace tcp {
+class Client;
+}  // namespace tcp
+
 namespace http {
 
 class Message {
@@ -31,6 +37,10 @@ class Message {
   Message& set_body(const std::string& body);
 
   const std::string to_string() const;
+  // first line and headers (including the blank line)
+  const std::string head_to_string() const;
+  // send head and body in a single gather write (no concatenation)
+  ssize_t write_to(tcp::Client& client) const;
   const HeaderList& get_headers() const { return headers; }
   const std::optional<std::string>& get_body() const { return body; }
   const StatusCode& get_status_code() const;
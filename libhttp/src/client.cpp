@@ -1,5 +1,9 @@
 #include "http/client.hpp"
 
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+
 #include <iostream>
 #include <memory>
 
@@ -8,21 +12,202 @@
 #include "http/message.hpp"
 #include "http/request-line.hpp"
 #include "tcp/client.hpp"
+#include "tcp/connection_pool.hpp"
 
 namespace http {
 
+// largest body an upstream may send, a bigger one (or chunk-size or
+// Content-Length that does not parse) fails the response instead of being
+// allocated
+#define MAX_BODY_SIZE (64UL << 20)
+// bodies are read in pieces of at most this much
+#define READ_PIECE_SIZE 16384
+// longest chunk-size line, extensions included
+#define MAX_CHUNK_LINE 1024
+
+// value of header name in a lowercased response head ("" if missing)
+static std::string find_header(const std::string& head,
+                               const std::string& name) {
+  std::string key = std::string(CRLF) + name + ":";
+  size_t pos = head.find(key);
+  if (pos == std::string::npos) {
+    return "";
+  }
+  pos += key.size();
+  size_t end = head.find(CRLF, pos);
+  while (pos < end && isspace((unsigned char)head[pos])) {
+    pos++;
+  }
+  while (end > pos && isspace((unsigned char)head[end - 1])) {
+    end--;
+  }
+  return head.substr(pos, end - pos);
+}
+
+// size in base (10 or 16) that is nothing but digits and at most
+// MAX_BODY_SIZE
+static bool parse_size(const std::string& text, int base, size_t& size) {
+  if (text.empty()) {
+    return false;
+  }
+  for (char c : text) {
+    if (base == 16 ? !isxdigit((unsigned char)c) : !isdigit((unsigned char)c)) {
+      return false;
+    }
+  }
+  errno = 0;
+  char* end;
+  unsigned long long value = strtoull(text.c_str(), &end, base);
+  if (errno != 0 || *end != '\0' || value > MAX_BODY_SIZE) {
+    return false;
+  }
+  size = value;
+  return true;
+}
+
+// whether what was appended to response after start ends a line
+static bool ends_with_crlf(const std::string& response, size_t start) {
+  return response.size() >= start + CRLF.size() &&
+         response.compare(response.size() - CRLF.size(), CRLF.size(), CRLF) ==
+             0;
+}
+
+// append len bytes of client to response, false if it ends early
+static bool read_body(tcp::Client& client, std::string& response,
+                      size_t len) {
+  char buffer[READ_PIECE_SIZE];
+  while (len > 0) {
+    size_t piece = len < sizeof(buffer) ? len : sizeof(buffer);
+    ssize_t n = client.read_exact(buffer, piece);
+    if (n > 0) {
+      response.append(buffer, n);
+    }
+    if (n != (ssize_t)piece) {
+      return false;
+    }
+    len -= piece;
+  }
+  return true;
+}
+
+// read one response off client, returns true if the connection can be
+// reused for the next request (the whole response has been read)
+static bool read_response(tcp::Client& client, std::string& response) {
+  std::string end_of_head = std::string(CRLF) + std::string(CRLF);
+  if (client.read_until(response, end_of_head) <= 0 ||
+      response.size() < end_of_head.size() ||
+      response.compare(response.size() - end_of_head.size(),
+                       end_of_head.size(), end_of_head) != 0) {
+    return false;
+  }
+
+  std::string head = response;
+  for (auto& c : head) {
+    c = tolower((unsigned char)c);
+  }
+  bool keep_alive = find_header(head, "connection") != "close";
+
+  // 1xx, 204 and 304 never have a body
+  int status = atoi(head.c_str() + head.find(' ') + 1);
+  if (status / 100 == 1 || status == 204 || status == 304) {
+    return keep_alive;
+  }
+
+  if (find_header(head, "transfer-encoding").find("chunked") !=
+      std::string::npos) {
+    // keep the framing, the message parser gets the raw response
+    size_t body_size = 0;
+    while (true) {
+      size_t line_start = response.size();
+      client.read_until(response, std::string(CRLF), MAX_CHUNK_LINE);
+      if (!ends_with_crlf(response, line_start)) {
+        return false;
+      }
+      // the size ends at the extensions (or the line)
+      std::string line = response.substr(
+          line_start, response.size() - CRLF.size() - line_start);
+      line = line.substr(0, line.find(';'));
+      while (!line.empty() && isspace((unsigned char)line.back())) {
+        line.pop_back();
+      }
+      size_t chunk_size;
+      if (!parse_size(line, 16, chunk_size) ||
+          chunk_size > MAX_BODY_SIZE - body_size) {
+        return false;
+      }
+      if (chunk_size == 0) {
+        break;
+      }
+      body_size += chunk_size;
+      // chunk data and its trailing CRLF
+      size_t data_start = response.size();
+      if (!read_body(client, response, chunk_size + CRLF.size()) ||
+          !ends_with_crlf(response, data_start)) {
+        return false;
+      }
+    }
+    // trailers end with an empty line
+    while (true) {
+      size_t line_start = response.size();
+      if (client.read_until(response, std::string(CRLF)) <= 0) {
+        return false;
+      }
+      if (response.size() - line_start == CRLF.size()) {
+        return keep_alive;
+      }
+    }
+  }
+
+  std::string content_length = find_header(head, "content-length");
+  if (!content_length.empty()) {
+    size_t body_size;
+    if (!parse_size(content_length, 10, body_size)) {
+      return false;
+    }
+    return read_body(client, response, body_size) && keep_alive;
+  }
+
+  // the body runs until the server closes the connection
+  char buffer[1024];
+  while (true) {
+    ssize_t n = client.read(buffer, sizeof(buffer));
+    if (n <= 0) {
+      return false;
+    }
+    response.append(buffer, n);
+  }
+}
+
 std::unique_ptr<Message> Client::get(const std::string& rel_path,
                                      HeaderList&& additional_headers) {
   Message request = Message::GET(rel_path);
   request.add_header(Header::parse_header("Host", host));
-  request.add_header(Header::parse_header("Connection", "close"));
+  request.add_header(Header::parse_header(
+      "Connection", pool != nullptr ? "keep-alive" : "close"));
   for (auto& header : additional_headers) {
     request.add_header(std::move(header));
   }
 
+  if (pool != nullptr) {
+    while (true) {
+      tcp::PooledClient client = pool->acquire(host.c_str(), port);
+      request.write_to(*client);
+
+      std::string response_str;
+      bool reusable = read_response(*client, response_str);
+      if (response_str.empty() && client.reused()) {
+        // the server dropped the idle connection, retry on a new one
+        continue;
+      }
+      if (reusable) {
+        client.release();
+      }
+      return std::make_unique<Message>(response_str);
+    }
+  }
+
   tcp::Client client(host.c_str(), port);
-  std::string request_str = request.to_string();
-  client.writen((void*)request_str.c_str(), request_str.size());
+  request.write_to(client);
 
   std::string response_str;
   char buffer[1024];
@@ -36,4 +221,4 @@ std::unique_ptr<Message> Client::get(const std::string& rel_path,
   return std::make_unique<Message>(response_str);
 }
 
-}  // namespace http
\ No newline at end of file
+}  // namespace http
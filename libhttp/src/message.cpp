@@ -1,5 +1,7 @@
 #include "http/message.hpp"
 
+#include <sys/uio.h>
+
 #include <cassert>
 #include <iostream>
 #include <optional>
@@ -8,6 +10,7 @@
 #include "http/constants.hpp"
 #include "http/header.hpp"
 #include "http/typedef.hpp"
+#include "tcp/client.hpp"
 
 namespace http {
 
@@ -63,7 +66,7 @@ Message& Message::set_body(const std::string& body) {
   return *this;
 }
 
-const std::string Message::to_string() const {
+const std::string Message::head_to_string() const {
   std::string message =
       std::visit([](const auto& first_line) { return first_line.to_string(); },
                  first_line);
@@ -73,12 +76,31 @@ const std::string Message::to_string() const {
     message += CRLF;
   }
   message += CRLF;
+  return message;
+}
+
+const std::string Message::to_string() const {
+  std::string message = head_to_string();
   if (body) {
     message += *body;
   }
   return message;
 }
 
+ssize_t Message::write_to(tcp::Client& client) const {
+  std::string head = head_to_string();
+  struct iovec iov[2];
+  iov[0].iov_base = (void*)head.data();
+  iov[0].iov_len = head.size();
+  int iovcnt = 1;
+  if (body && !body->empty()) {
+    iov[1].iov_base = (void*)body->data();
+    iov[1].iov_len = body->size();
+    iovcnt++;
+  }
+  return client.writev(iov, iovcnt);
+}
+
 const StatusCode& Message::get_status_code() const {
   assert(std::holds_alternative<StatusLine>(first_line));
   return std::get<StatusLine>(first_line).get_code();
@@ -2,17 +2,67 @@
 #define _TCP_CLIENT_HPP_
 
 #include <arpa/inet.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <chrono>
+#include <functional>
+#include <string>
+
+#include "tcp/read_buffer.hpp"
+#include "tcp/send_queue.hpp"
+#include "tcp/socket_options.hpp"
 
 namespace tcp {
 
 class Client {
+ public:
+  // what send() does with a message that would take the send queue past its
+  // high watermark
+  enum overflow_policy { Block, Drop, Disconnect, Queue };
+
  private:
   int sockfd;
   char peer_ip_addr[INET6_ADDRSTRLEN];
+  ReadBuffer read_buffer;
+  // kernel buffer for splice_from (created on first use)
+  int splice_pipe[2];
+
+  // bytes send() accepted but the socket has not taken yet
+  SendQueue send_queue;
+  size_t high_watermark;
+  size_t low_watermark;
+  overflow_policy overflow;
+  // reached the high watermark and not yet drained to the low one
+  bool send_full;
+  // shut down by the Disconnect policy
+  bool send_closed;
+  std::function<void()> on_full;
+  std::function<void()> on_drain;
+
+  // writes of at least this many bytes use MSG_ZEROCOPY (0 when off)
+  size_t zerocopy_threshold;
+  // zero-copy sends issued and completed, the kernel numbers them in order
+  uint32_t zerocopy_sent;
+  uint32_t zerocopy_done;
+
+  // when the client was set up, and when its first byte was written (the
+  // epoch until then)
+  std::chrono::steady_clock::time_point opened;
+  std::chrono::steady_clock::time_point first_write;
 
  public:
-  // connect to server
-  Client(const char* server, int port_no);
+  // connect to server (crashes on error)
+  // a server starting with '/' is the path of a unix domain socket and the
+  // port is ignored
+  // options are set before connecting (fast open sends the SYN with the
+  // first write once the server's cookie is known), they are TCP only
+  Client(const char* server, int port_no,
+         const SocketOptions& options = SocketOptions());
+  // connect to server within timeout, racing its IPv6 and IPv4 addresses
+  // (RFC 8305), throws ConnectionError
+  Client(const char* server, int port_no, std::chrono::milliseconds timeout,
+         const SocketOptions& options = SocketOptions());
   ~Client();
 
   // simple I/O (crashes on error)
@@ -21,9 +71,72 @@ class Client {
   // block until all bytes are written
   ssize_t writen(void* msgbuf, size_t len);
 
+  // gather write, blocks until every buffer is written
+  ssize_t writev(const struct iovec* iov, int iovcnt);
+
+  // zero-copy sends (SO_ZEROCOPY, sets errno on error)
+  // writen() and writev() of at least threshold bytes (64 KiB by default)
+  // let the NIC read the caller's pages instead of copying them, and return
+  // once the kernel has released the pages, so buffers can be reused as
+  // before
+  // turns itself off when the kernel reports that it copied anyway (e.g.
+  // over loopback), 0 turns it off
+  int set_zerocopy(size_t threshold = 64 << 10);
+  bool uses_zerocopy() const { return zerocopy_threshold > 0; }
+
+  // batch small writes into full segments until uncork() (TCP_CORK)
+  // passthrough (sets errno on error)
+  int cork();
+  int uncork();
+
+  // zero-copy transfers, data never enters user space (sets errno on error)
+  // send len bytes of in_fd starting at offset (fewer if the file is shorter)
+  ssize_t send_file(int in_fd, off_t offset, size_t len);
+  // relay up to len bytes from other until it reaches EOF
+  ssize_t splice_from(Client& other, size_t len = SIZE_MAX);
+
   // read a line of text (or up to maxlen - 1 bytes)
   size_t readline(void* msgbuf, size_t maxlen);
 
+  // buffered I/O (sets errno on error)
+  // append everything up to and including delimiter to out (or maxlen bytes,
+  // or the rest of the stream at EOF), returns the number of bytes appended
+  ssize_t read_until(std::string& out, const std::string& delimiter,
+                     size_t maxlen = SIZE_MAX);
+  // read len bytes (fewer only at EOF)
+  ssize_t read_exact(void* msgbuf, size_t len);
+  // bytes already received but not yet consumed
+  // (check this before waiting on get_fd() for more data)
+  size_t buffered() const { return read_buffer.size(); }
+
+  // non-blocking send through a bounded queue (sets errno on error)
+  // writes what the socket takes right away and queues the rest, returns len
+  // once the message is written or queued (messages are never cut)
+  // a message that would take the queue past the high watermark blocks until
+  // it fits, fails with ENOBUFS, shuts the connection down (ECONNRESET) or is
+  // queued anyway depending on the overflow policy
+  // Block waits for the socket on the calling thread, so it is only for
+  // clients that have a thread or process of their own (thread and fork
+  // modes), the event loop server gives its clients Queue
+  // don't mix with writen() while bytes are queued, they would overtake them
+  ssize_t send(const void* msgbuf, size_t len);
+  // write queued bytes without blocking, returns the bytes still queued
+  // (call it whenever the socket turns writable, the event loop server does)
+  ssize_t flush();
+  // bytes waiting in the send queue (dropped when the client is destroyed)
+  size_t queued() const { return send_queue.size(); }
+  // false from reaching the high watermark until drained to the low one
+  bool writable() const { return !send_full; }
+  // 1 MiB / 256 KiB and Block by default
+  void set_send_queue(size_t high_watermark, size_t low_watermark,
+                      overflow_policy policy = Block);
+  // keeps the watermarks
+  void set_overflow_policy(overflow_policy policy);
+  // on_full runs when the queue reaches the high watermark (or a message
+  // overflows it), on_drain when it is back down to the low watermark
+  void set_send_callbacks(std::function<void()> on_full,
+                          std::function<void()> on_drain);
+
   // passthrough I/O (sets errno on error)
   ssize_t write(void* msgbuf, size_t maxlen);
   ssize_t read(void* msgbuf, size_t maxlen);
@@ -31,13 +144,47 @@ class Client {
   // get the file descriptor
   int get_fd() const { return sockfd; }
 
-  // ip address of the peer
+  // ip address of the peer ("unix" for unix domain sockets)
   const char* peer_ip() const { return peer_ip_addr; }
 
+  // session timing, read by the server's latency histograms
+  std::chrono::steady_clock::time_point opened_at() const { return opened; }
+  std::chrono::steady_clock::time_point first_write_at() const {
+    return first_write;
+  }
+
  private:
   // create a channel from an existing socket
   Client(int sockfd, sockaddr_in6 client_addr);
 
+  // open sockfd to the first address of server that answers before deadline
+  void connect_to(const char* server, int port_no,
+                  std::chrono::steady_clock::time_point deadline,
+                  const SocketOptions& options);
+  void connect_unix(const char* path,
+                    std::chrono::steady_clock::time_point deadline);
+
+  // sendmsg with MSG_ZEROCOPY, then wait for the completions
+  ssize_t writev_zerocopy(const struct iovec* iov, int iovcnt);
+  // read completions off the error queue until every send is done
+  int wait_zerocopy();
+
+  // buffer data until delimiter is found, returns the bytes to consume
+  ssize_t buffer_until(const char* delimiter, size_t delimiter_len,
+                       size_t maxlen);
+
+  // the queue reached the high watermark
+  void mark_full();
+
+  // passes n through, noting the first write that sent something
+  ssize_t wrote(ssize_t n) {
+    if (n > 0 && first_write == std::chrono::steady_clock::time_point()) {
+      first_write = std::chrono::steady_clock::now();
+    }
+    return n;
+  }
+
+  friend class AsyncClient;
   friend class Server;
 };
 
@@ -0,0 +1,134 @@
+#ifndef _TCP_CONNECTION_POOL_HPP_
+#define _TCP_CONNECTION_POOL_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "tcp/client.hpp"
+
+namespace tcp {
+
+class ConnectionPool;
+
+// connection checked out of a ConnectionPool
+// closed when it goes out of scope unless it was handed back with release()
+// (must not outlive its pool)
+class PooledClient {
+ private:
+  ConnectionPool* pool;
+  std::string key;
+  std::unique_ptr<Client> client;
+  std::chrono::steady_clock::time_point created;
+  bool was_reused;
+
+ public:
+  PooledClient(PooledClient&& other) = default;
+  PooledClient& operator=(PooledClient&& other) = default;
+  ~PooledClient() = default;
+
+  Client& operator*() const { return *client; }
+  Client* operator->() const { return client.get(); }
+  Client* get() const { return client.get(); }
+
+  // true if the connection served an earlier request (the peer may have
+  // closed it since, so be ready to retry on a fresh one)
+  bool reused() const { return was_reused; }
+
+  // hand the connection back for reuse, only call this once the last
+  // response has been read completely
+  void release();
+
+ private:
+  PooledClient(ConnectionPool* pool, const std::string& key,
+               std::unique_ptr<Client> client,
+               std::chrono::steady_clock::time_point created, bool reused)
+      : pool(pool),
+        key(key),
+        client(std::move(client)),
+        created(created),
+        was_reused(reused) {}
+
+  friend class ConnectionPool;
+};
+
+// thread-safe pool of idle outbound connections keyed by host:port
+class ConnectionPool {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+ private:
+  struct IdleClient {
+    std::unique_ptr<Client> client;
+    Clock::time_point created;
+    Clock::time_point idle_since;
+  };
+
+  // operational data
+  std::mutex lock;
+  std::unordered_map<std::string, std::vector<IdleClient>> idle;
+  std::atomic<unsigned long> hits;
+  std::atomic<unsigned long> misses;
+
+  // configuration data
+  unsigned int max_idle;
+  Clock::duration idle_timeout;
+  Clock::duration max_age;
+  std::chrono::milliseconds connect_timeout;
+  SocketOptions socket_options;
+
+ public:
+  ConnectionPool()
+      : lock(),
+        idle(),
+        hits(0),
+        misses(0),
+        max_idle(8),
+        idle_timeout(std::chrono::seconds(30)),
+        max_age(std::chrono::seconds(300)),
+        connect_timeout(std::chrono::seconds(10)),
+        socket_options() {}
+  ConnectionPool(const ConnectionPool&) = delete;
+  ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+  // pool configuration
+  // idle connections kept per destination
+  ConnectionPool& set_max_idle(unsigned int per_destination);
+  // drop connections idle for longer than this
+  ConnectionPool& set_idle_timeout(unsigned int seconds);
+  // drop connections opened longer ago than this
+  ConnectionPool& set_max_age(unsigned int seconds);
+  // give up on opening a new connection after this
+  ConnectionPool& set_connect_timeout(unsigned int ms);
+  // tuning for new connections
+  ConnectionPool& set_socket_options(const SocketOptions& options);
+
+  // idle, healthy connection to server:port_no, or a new one if there is
+  // none (throws ConnectionError if it can't connect)
+  PooledClient acquire(const char* server, int port_no);
+
+  // close every idle connection
+  void clear();
+
+  // idle connections across all destinations
+  size_t idle_count();
+  // checkouts served by an idle connection / by a new connection
+  unsigned long get_hits() const { return hits; }
+  unsigned long get_misses() const { return misses; }
+
+ private:
+  void put_back(const std::string& key, std::unique_ptr<Client> client,
+                Clock::time_point created);
+  // still connected, nothing unread (peeks without blocking)
+  static bool healthy(const Client& client);
+
+  friend class PooledClient;
+};
+
+}  // namespace tcp
+
+#endif
@@ -0,0 +1,309 @@
+#ifndef _TCP_COROUTINE_HPP_
+#define _TCP_COROUTINE_HPP_
+
+// C++20 coroutine API, everything here runs on an IoContext thread
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "tcp/client.hpp"
+#include "tcp/event_loop.hpp"
+
+namespace tcp {
+
+// shared by every Task promise: resumes the awaiting coroutine when done
+struct TaskPromiseBase {
+  std::coroutine_handle<> continuation;
+  std::exception_ptr exception;
+
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<Promise> coro) noexcept {
+      auto next = coro.promise().continuation;
+      return next ? next : std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+  };
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  FinalAwaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() { exception = std::current_exception(); }
+};
+
+// lazily started coroutine, runs once it is awaited (or spawned)
+// exceptions are rethrown into the awaiting coroutine
+template <typename T = void>
+class Task {
+ public:
+  struct promise_type : TaskPromiseBase {
+    std::optional<T> value;
+
+    Task get_return_object() {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    void return_value(T result) { value.emplace(std::move(result)); }
+  };
+
+  Task(Task&& other) noexcept : coro(std::exchange(other.coro, nullptr)) {}
+  Task& operator=(Task&& other) noexcept {
+    std::swap(coro, other.coro);
+    return *this;
+  }
+  ~Task() {
+    if (coro) {
+      coro.destroy();
+    }
+  }
+
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<> await_suspend(
+      std::coroutine_handle<> awaiting) noexcept {
+    coro.promise().continuation = awaiting;
+    return coro;
+  }
+  T await_resume() {
+    if (coro.promise().exception) {
+      std::rethrow_exception(coro.promise().exception);
+    }
+    return std::move(*coro.promise().value);
+  }
+
+ private:
+  explicit Task(std::coroutine_handle<promise_type> coro) : coro(coro) {}
+
+  std::coroutine_handle<promise_type> coro;
+
+  friend class IoContext;
+};
+
+template <>
+class Task<void> {
+ public:
+  struct promise_type : TaskPromiseBase {
+    Task get_return_object() {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    void return_void() {}
+  };
+
+  Task(Task&& other) noexcept : coro(std::exchange(other.coro, nullptr)) {}
+  Task& operator=(Task&& other) noexcept {
+    std::swap(coro, other.coro);
+    return *this;
+  }
+  ~Task() {
+    if (coro) {
+      coro.destroy();
+    }
+  }
+
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<> await_suspend(
+      std::coroutine_handle<> awaiting) noexcept {
+    coro.promise().continuation = awaiting;
+    return coro;
+  }
+  void await_resume() {
+    if (coro.promise().exception) {
+      std::rethrow_exception(coro.promise().exception);
+    }
+  }
+
+ private:
+  explicit Task(std::coroutine_handle<promise_type> coro) : coro(coro) {}
+
+  std::coroutine_handle<promise_type> coro;
+
+  friend class IoContext;
+};
+
+// pool of event loop threads that coroutines are spawned onto
+class IoContext {
+ public:
+  typedef std::chrono::steady_clock::time_point TimePoint;
+  class RemoteResume;
+
+ private:
+  struct Worker {
+    EventLoop loop;
+    // eventfd that wakes the loop when coroutines are spawned onto it
+    int wake_fd;
+    std::mutex lock;
+    std::vector<std::coroutine_handle<>> spawned;
+    // the loop has exited, nothing may be spawned onto it any more
+    bool stopped;
+    // coroutines other threads are done waiting for
+    std::vector<std::coroutine_handle<>> resumed;
+    std::vector<std::weak_ptr<RemoteResume>> remotes;
+    // frames of spawned coroutines that have not finished yet
+    std::unordered_set<void*> running;
+    std::thread thread;
+
+    explicit Worker(bool use_io_uring)
+        : loop(use_io_uring), wake_fd(-1), stopped(false) {}
+  };
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::atomic<unsigned int> next_worker;
+  std::atomic<bool> stopping;
+
+  // worker of the calling thread
+  static thread_local Worker* current;
+
+ public:
+  explicit IoContext(unsigned int num_threads, bool use_io_uring = false);
+  ~IoContext();
+  IoContext(const IoContext&) = delete;
+  IoContext& operator=(const IoContext&) = delete;
+
+  // run task on one of the loops (round robin), it is destroyed when done
+  void spawn(Task<void> task);
+
+  // stop every loop, coroutines that are still suspended get destroyed
+  void stop();
+
+  // loop of the calling thread (nullptr outside an IoContext)
+  static EventLoop* current_loop();
+  // resume coro on the calling thread's loop once deadline has passed
+  static void resume_at(TimePoint deadline, std::coroutine_handle<> coro);
+  // let another thread resume coro on the calling thread's loop
+  static std::shared_ptr<RemoteResume> resume_remotely(
+      std::coroutine_handle<> coro);
+
+ private:
+  void run(Worker& worker);
+  void run_spawned(Worker& worker);
+  static void wake(Worker& worker);
+
+  struct Detached;
+  static Detached run_detached(Task<void> task);
+};
+
+// non-blocking Client driven by the loop of the IoContext thread that
+// created it (only use it from that thread)
+class AsyncClient {
+ private:
+  std::unique_ptr<Client> client;
+  EventLoop* loop;
+  // edge-triggered readiness seen since the last EAGAIN
+  bool readable;
+  bool writable;
+  // coroutines waiting for readiness
+  std::coroutine_handle<> reader;
+  std::coroutine_handle<> writer;
+  // longest wait for readiness in ms (0 waits forever)
+  unsigned int read_timeout;
+  unsigned int write_timeout;
+
+  // resumes with false if the timeout passes first
+  struct ReadyAwaiter {
+    bool& ready;
+    std::coroutine_handle<>& waiter;
+    EventLoop* loop;
+    unsigned int timeout_ms;
+    bool expired;
+    TimerWheel::TimerId timer;
+
+    bool await_ready() const noexcept { return ready; }
+    void await_suspend(std::coroutine_handle<> coro) {
+      waiter = coro;
+      if (timeout_ms > 0) {
+        timer = loop->add_timer(timeout_ms, [this]() {
+          expired = true;
+          std::exchange(waiter, nullptr).resume();
+        });
+      }
+    }
+    bool await_resume() noexcept {
+      if (timeout_ms > 0) {
+        loop->cancel_timer(timer);
+      }
+      return !expired;
+    }
+  };
+
+ public:
+  ~AsyncClient();
+  AsyncClient(const AsyncClient&) = delete;
+  AsyncClient& operator=(const AsyncClient&) = delete;
+
+  // async I/O, suspends instead of blocking (sets errno on error)
+  // read up to maxlen bytes, 0 at EOF
+  Task<ssize_t> read(void* msgbuf, size_t maxlen);
+  // same as Client::read_until
+  Task<ssize_t> read_until(std::string& out, const std::string& delimiter,
+                           size_t maxlen = SIZE_MAX);
+  // write all len bytes
+  Task<ssize_t> write(const void* msgbuf, size_t len);
+
+  // fail reads (writes) that wait longer than this with ETIMEDOUT
+  void set_timeouts(unsigned int read_ms, unsigned int write_ms) {
+    read_timeout = read_ms;
+    write_timeout = write_ms;
+  }
+
+  // underlying client (its blocking calls fail with EAGAIN)
+  Client& get_client() { return *client; }
+
+  // ip address of the peer
+  const char* peer_ip() const { return client->peer_ip(); }
+
+ private:
+  // wrap a connected non-blocking socket
+  AsyncClient(int sockfd, const struct sockaddr_in6& addr);
+
+  ReadyAwaiter wait_readable() {
+    return {readable, reader, loop, read_timeout, false, 0};
+  }
+  ReadyAwaiter wait_writable() {
+    return {writable, writer, loop, write_timeout, false, 0};
+  }
+  void on_events(uint32_t events);
+
+  friend Task<std::unique_ptr<AsyncClient>> connect(const char* server,
+                                                    int port_no);
+  friend class Server;
+};
+
+// connect to server (or a unix domain socket path) without blocking the loop
+// (nullptr on error, sets errno)
+Task<std::unique_ptr<AsyncClient>> connect(const char* server, int port_no);
+
+// suspend the calling coroutine for duration
+struct SleepAwaiter {
+  IoContext::TimePoint deadline;
+
+  bool await_ready() const noexcept {
+    return std::chrono::steady_clock::now() >= deadline;
+  }
+  void await_suspend(std::coroutine_handle<> coro) const {
+    IoContext::resume_at(deadline, coro);
+  }
+  void await_resume() const noexcept {}
+};
+
+template <typename Rep, typename Period>
+SleepAwaiter sleep_for(std::chrono::duration<Rep, Period> duration) {
+  return {std::chrono::steady_clock::now() +
+          std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+              duration)};
+}
+
+}  // namespace tcp
+
+#endif
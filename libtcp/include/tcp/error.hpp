@@ -12,6 +12,17 @@ class ConfigurationError : public std::runtime_error {
   ConfigurationError(const char* what_arg) : std::runtime_error(what_arg) {}
 };
 
+// connecting to a peer failed, code is the errno of the last attempt
+class ConnectionError : public std::runtime_error {
+ private:
+  int error_code;
+
+ public:
+  ConnectionError(const std::string& what_arg, int code)
+      : std::runtime_error(what_arg), error_code(code) {}
+  int code() const { return error_code; }
+};
+
 }  // namespace tcp
 
 #endif
\ No newline at end of file
@@ -0,0 +1,104 @@
+#ifndef _TCP_EVENT_LOOP_HPP_
+#define _TCP_EVENT_LOOP_HPP_
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "tcp/timer_wheel.hpp"
+
+namespace tcp {
+
+class IoUring;
+
+// edge-triggered readiness loop on epoll or io_uring (multishot poll)
+// every registered fd gets a callback that is run with the ready epoll events
+// and timers run on the same thread, between batches of events
+class EventLoop {
+ public:
+  typedef std::function<void(uint32_t)> EventCallback;
+  // run for every accepted (non-blocking) socket, the address is null when
+  // the backend does not report it
+  typedef std::function<void(int, const struct sockaddr_in6*)> AcceptCallback;
+
+ private:
+  struct Watch {
+    EventCallback callback;
+    AcceptCallback on_accept;
+    uint32_t events;
+    // armed io_uring request (user_data), stale completions are ignored
+    uint64_t request;
+    bool removed;
+  };
+
+  int epoll_fd;
+  std::unique_ptr<IoUring> ring;
+  // heap allocated so a running callback survives its fd being reused
+  std::unordered_map<int, std::unique_ptr<Watch>> watches;
+  uint32_t next_generation;
+
+  // fds removed while dispatching (erased once the batch is done)
+  bool dispatching;
+  std::vector<int> removed;
+  // callbacks replaced while dispatching (one of them may be running)
+  std::vector<std::unique_ptr<Watch>> retired;
+
+  TimerWheel timers;
+
+ public:
+  // io_uring falls back to epoll when the kernel does not support it
+  explicit EventLoop(bool use_io_uring = false);
+  ~EventLoop();
+  EventLoop(const EventLoop&) = delete;
+  EventLoop& operator=(const EventLoop&) = delete;
+
+  // register/update interest in events on fd (EPOLLET is always added)
+  // passthrough (sets errno on error)
+  int add(int fd, uint32_t events, EventCallback callback);
+  int modify(int fd, uint32_t events);
+  int remove(int fd);
+
+  // accept every connection on the non-blocking listening socket fd
+  // (multishot accept on io_uring), remove() stops it
+  int add_acceptor(int fd, AcceptCallback callback);
+
+  // run callback once on this loop after delay_ms (O(1), ms resolution)
+  TimerWheel::TimerId add_timer(uint64_t delay_ms,
+                                TimerWheel::Callback callback) {
+    return timers.add(delay_ms, std::move(callback));
+  }
+  // returns false if the timer already ran or was cancelled
+  bool cancel_timer(TimerWheel::TimerId id) { return timers.cancel(id); }
+
+  // wait up to timeout_ms (-1 waits forever) and run the ready callbacks
+  // and due timers, returns the number of events and timers dispatched
+  // (0 on timeout, -1 on error)
+  int poll(int timeout_ms);
+
+  // number of registered fds
+  size_t size() const { return watches.size() - removed.size(); }
+
+  // true if the loop is running on io_uring
+  bool uses_io_uring() const { return ring != nullptr; }
+
+  // get the epoll file descriptor (-1 on io_uring)
+  int get_fd() const { return epoll_fd; }
+
+ private:
+  Watch& watch(int fd);
+  int poll_epoll(int timeout_ms);
+  int poll_io_uring(int timeout_ms);
+  int arm_poll(int fd, Watch& w);
+  int arm_accept(int fd, Watch& w);
+  int cancel(int fd, const Watch& w);
+  void complete(uint64_t user_data, int32_t res, uint32_t flags);
+  void flush_removed();
+};
+
+}  // namespace tcp
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef _TCP_HISTOGRAM_HPP_
+#define _TCP_HISTOGRAM_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+namespace tcp {
+
+// percentiles of a histogram, in the unit its values were recorded in
+// (each is the top of its bucket, at most 1/8 above the real value)
+struct Percentiles {
+  unsigned long count;
+  unsigned long p50;
+  unsigned long p99;
+  unsigned long p999;
+  unsigned long max;
+};
+
+// log-bucketed histogram in the style of HdrHistogram
+// every power of two is split into 8 linear sub-buckets, so values up to
+// 2^48 (3 days in ns) fit in 368 counters with 3 significant bits
+// recording is one relaxed atomic add, so a histogram can live in shared
+// memory and take values from any number of threads and processes
+struct Histogram {
+  static constexpr unsigned int SUB_BUCKET_BITS = 3;
+  static constexpr unsigned int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+  static constexpr unsigned int MAX_BITS = 48;
+  static constexpr unsigned int BUCKETS =
+      (MAX_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+  std::atomic<unsigned long> counts[BUCKETS];
+
+  // larger values are counted in the last bucket
+  void record(unsigned long value) {
+    counts[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  static unsigned int bucket_of(unsigned long value);
+  // the largest value that lands in bucket
+  static unsigned long bucket_limit(unsigned int bucket);
+};
+
+// histograms (e.g. the per-cpu shards of one) summed up for reading
+class HistogramSnapshot {
+ private:
+  unsigned long counts[Histogram::BUCKETS];
+  unsigned long total;
+
+ public:
+  HistogramSnapshot() : counts(), total(0) {}
+
+  void add(const Histogram& histogram);
+  unsigned long count() const { return total; }
+  // the smallest bucket limit at or above fraction of the values
+  // (0 when empty)
+  unsigned long percentile(double fraction) const;
+  Percentiles percentiles() const;
+};
+
+}  // namespace tcp
+
+#endif
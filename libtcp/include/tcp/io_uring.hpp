@@ -0,0 +1,64 @@
+#ifndef _TCP_IO_URING_HPP_
+#define _TCP_IO_URING_HPP_
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+#include <functional>
+
+namespace tcp {
+
+// minimal io_uring instance driven through the raw syscalls
+class IoUring {
+ private:
+  int ring_fd;
+
+  // submission queue
+  void* sq_ring;
+  size_t sq_ring_size;
+  unsigned int* sq_head;
+  unsigned int* sq_tail;
+  unsigned int* sq_mask;
+  unsigned int* sq_array;
+  unsigned int sq_entries;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+  // entries handed out but not yet published to the kernel
+  unsigned int sqe_tail;
+
+  // completion queue
+  void* cq_ring;
+  size_t cq_ring_size;
+  unsigned int* cq_head;
+  unsigned int* cq_tail;
+  unsigned int* cq_mask;
+  struct io_uring_cqe* cqes;
+
+ public:
+  typedef std::function<void(const struct io_uring_cqe*)> CompletionCallback;
+
+  explicit IoUring(unsigned int entries);
+  ~IoUring();
+  IoUring(const IoUring&) = delete;
+  IoUring& operator=(const IoUring&) = delete;
+
+  // false if the kernel could not give us a usable ring
+  bool ok() const { return ring_fd >= 0; }
+
+  // zeroed submission entry (flushes the queue to the kernel when it is full)
+  struct io_uring_sqe* get_sqe();
+
+  // submit everything queued and wait up to timeout_ms (-1 waits forever)
+  // for a completion, returns 0 on timeout and -1 on error (sets errno)
+  int submit_and_wait(int timeout_ms);
+
+  // run callback on every posted completion, returns how many there were
+  unsigned int reap(const CompletionCallback& callback);
+
+ private:
+  int enter(unsigned int min_complete, unsigned int flags, int timeout_ms);
+};
+
+}  // namespace tcp
+
+#endif
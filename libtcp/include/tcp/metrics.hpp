@@ -0,0 +1,86 @@
+#ifndef _TCP_METRICS_HPP_
+#define _TCP_METRICS_HPP_
+
+#include <atomic>
+#include <chrono>
+
+#include "tcp/client.hpp"
+#include "tcp/metrics_segment.hpp"
+
+namespace tcp {
+
+// totals of a server's counters at one point in time
+struct Metrics {
+  // connections accepted, and the ones closed right away at max_clients
+  unsigned long accepts;
+  unsigned long drops;
+  // connections being served right now
+  unsigned long active;
+  // connections served to the end
+  unsigned long closed;
+  // payload of closed connections, as counted by the kernel (TCP_INFO)
+  unsigned long bytes_in;
+  unsigned long bytes_out;
+  // handler invocations (one per event in the event loop) and the wall
+  // time spent in them
+  unsigned long handler_calls;
+  unsigned long handler_ns;
+  // clients that waited in the admission queue, the ones closed at its
+  // deadline, and the time the admitted ones spent waiting
+  unsigned long queued;
+  unsigned long queue_timeouts;
+  unsigned long queue_ns;
+};
+
+// lock-free server counters, one shard of them per cpu in a
+// MetricsSegment along with the latency histograms
+class MetricsRegistry : public MetricsSegment {
+ public:
+  struct alignas(64) Shard {
+    std::atomic<unsigned long> accepts;
+    std::atomic<unsigned long> drops;
+    // opened - closed per shard, only the sum is meaningful
+    std::atomic<unsigned long> active;
+    std::atomic<unsigned long> closed;
+    std::atomic<unsigned long> bytes_in;
+    std::atomic<unsigned long> bytes_out;
+    std::atomic<unsigned long> handler_calls;
+    std::atomic<unsigned long> handler_ns;
+    std::atomic<unsigned long> queued;
+    std::atomic<unsigned long> queue_timeouts;
+    std::atomic<unsigned long> queue_ns;
+  };
+
+ private:
+  Shard& local() const { return *(Shard*)shard(local_shard()); }
+
+ public:
+  // zeroed counters, one shard per cpu, in anonymous shared memory or in
+  // the POSIX shared memory segment name (shm_open, e.g. "/myserver"), with
+  // histograms for num_slots handlers
+  // returns -1 with errno set on error
+  int create(const char* name = nullptr, unsigned int num_slots = 1);
+  // map the named segment of a running server read only
+  int attach(const char* name);
+
+  Metrics snapshot() const;
+
+  // recording, relaxed atomics on the caller's shard
+  void accepted() const;
+  void dropped() const;
+  void opened() const;
+  // reads the byte counts of the client before it is closed, and records
+  // its session in the histograms of its handler slot
+  void closed(const Client& client, unsigned int slot) const;
+  void handled(std::chrono::steady_clock::duration time) const;
+  void queued() const;
+  void admitted(std::chrono::steady_clock::duration wait) const;
+  void expired() const;
+
+  // read a named segment once, returns -1 with errno set on error
+  static int read(const char* name, Metrics& metrics);
+};
+
+}  // namespace tcp
+
+#endif
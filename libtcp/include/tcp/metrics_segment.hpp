@@ -0,0 +1,156 @@
+#ifndef _TCP_METRICS_SEGMENT_HPP_
+#define _TCP_METRICS_SEGMENT_HPP_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+#include "tcp/histogram.hpp"
+
+namespace tcp {
+
+// how the sessions of one handler went
+struct HandlerLatency {
+  // from the client being set up to it being closed, in ns
+  Percentiles lifetime_ns;
+  // from the client being set up to its first write, in ns (sessions that
+  // wrote something)
+  Percentiles first_byte_ns;
+  // bytes written over the lifetime (sessions that wrote something)
+  Percentiles bytes_per_sec;
+};
+
+// shared memory behind the tcp and udp MetricsRegistry: a header, one shard
+// of counters per cpu, then the latency histograms of every shard
+// writers add to the shard of the cpu they run on, so concurrent threads
+// and processes rarely share a cache line, and readers sum the shards
+// the registries define the counters of a shard, this holds the histograms
+// for every handler slot and for the phases handlers time with ScopedTimer
+// a forked server and its client processes report into the segment of the
+// Server object that started them, and a named segment can be read by
+// other processes
+class MetricsSegment {
+ private:
+  static constexpr unsigned int MAX_PHASES = 16;
+  static constexpr unsigned int PHASE_NAME_SIZE = 32;
+  // lifetime, first byte and bytes per second
+  static constexpr unsigned int SESSION_HISTOGRAMS = 3;
+
+  // claimed by the first process to time a phase of that name
+  struct Phase {
+    // 0 free, 1 being named, 2 named
+    std::atomic<unsigned int> state;
+    char name[PHASE_NAME_SIZE];
+  };
+
+  // segment header followed by the shards, then the histograms of each
+  // shard: SESSION_HISTOGRAMS per handler slot and one per phase
+  struct Header {
+    unsigned int num_shards;
+    unsigned int num_slots;
+    // size of the registry's shard, a reader of another registry's segment
+    // gets EINVAL
+    unsigned int shard_size;
+    Phase phases[MAX_PHASES];
+  };
+
+  void* segment;
+  size_t segment_size;
+  char* shards;
+  size_t shard_size;
+  unsigned int num_shards;
+  Histogram* histograms;
+  unsigned int num_slots;
+  // POSIX shared memory name, unlinked by the process that created it
+  // (not by forked children exiting)
+  std::string name;
+  pid_t owner;
+
+  size_t shard_offset() const;
+  size_t size_of(unsigned int num_shards) const;
+  int map(int fd, bool writable);
+  unsigned int histograms_per_shard() const {
+    return num_slots * SESSION_HISTOGRAMS + MAX_PHASES;
+  }
+  // histogram index of shard within every shard's set
+  HistogramSnapshot merge(unsigned int index) const;
+
+ protected:
+  // zeroed shards of shard_size bytes (a multiple of the cache line), see
+  // create() of the registries
+  int create(const char* name, size_t shard_size, unsigned int num_slots);
+  int attach(const char* name, size_t shard_size);
+
+  unsigned int shard_count() const { return num_shards; }
+  void* shard(unsigned int index) const {
+    return shards + index * shard_size;
+  }
+  unsigned int local_shard() const;
+  // a finished session of the handler in slot, first_byte_ns and
+  // bytes_per_sec are left out when negative
+  void record_session(unsigned int index, unsigned int slot,
+                      unsigned long lifetime_ns, long first_byte_ns,
+                      long bytes_per_sec) const;
+
+ public:
+  MetricsSegment()
+      : segment(nullptr),
+        segment_size(0),
+        shards(nullptr),
+        shard_size(0),
+        num_shards(0),
+        histograms(nullptr),
+        num_slots(0),
+        name(),
+        owner(-1) {}
+  MetricsSegment(const MetricsSegment&) = delete;
+  MetricsSegment& operator=(const MetricsSegment&) = delete;
+  ~MetricsSegment() { destroy(); }
+
+  // unmap (and unlink a created named segment)
+  void destroy();
+  bool ready() const { return shards != nullptr; }
+
+  // the phase called name, named on first use (-1 when all MAX_PHASES are
+  // taken)
+  int phase(const char* name) const;
+  void timed(int phase, std::chrono::steady_clock::duration time) const;
+
+  // histograms summed over the shards
+  HandlerLatency latency(unsigned int slot) const;
+  // count is 0 for a phase that was never timed
+  Percentiles phase_latency(const char* name) const;
+};
+
+// times a phase of a handler until it goes out of scope, e.g.
+//   server.add_handler([&server](Client* client) {
+//     ScopedTimer timer(server.get_registry(), "lookup");
+//     ...
+//   });
+// the first use of a name registers it, later ones find it by name
+class ScopedTimer {
+ private:
+  const MetricsSegment& registry;
+  int phase;
+  std::chrono::steady_clock::time_point start;
+
+ public:
+  ScopedTimer(const MetricsSegment& registry, const char* phase)
+      : registry(registry),
+        phase(registry.phase(phase)),
+        start(std::chrono::steady_clock::now()) {}
+  ScopedTimer(const ScopedTimer&) = delete;
+  ScopedTimer& operator=(const ScopedTimer&) = delete;
+  ~ScopedTimer() {
+    if (phase >= 0) {
+      registry.timed(phase, std::chrono::steady_clock::now() - start);
+    }
+  }
+};
+
+}  // namespace tcp
+
+#endif
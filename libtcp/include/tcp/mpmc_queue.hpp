@@ -0,0 +1,98 @@
+#ifndef _TCP_MPMC_QUEUE_HPP_
+#define _TCP_MPMC_QUEUE_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+
+namespace tcp {
+
+// bounded lock-free multi-producer multi-consumer queue
+// (Dmitry Vyukov's sequence-numbered ring buffer)
+template <typename T>
+class MPMCQueue {
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T data;
+  };
+
+  // keep producers and consumers off each other's cache lines
+  alignas(64) std::unique_ptr<Cell[]> buffer;
+  size_t mask;
+  alignas(64) std::atomic<size_t> enqueue_pos;
+  alignas(64) std::atomic<size_t> dequeue_pos;
+
+ public:
+  // capacity is rounded up to a power of two
+  explicit MPMCQueue(size_t min_capacity)
+      : buffer(), mask(0), enqueue_pos(0), dequeue_pos(0) {
+    size_t capacity = 2;
+    while (capacity < min_capacity) {
+      capacity <<= 1;
+    }
+    buffer.reset(new Cell[capacity]);
+    mask = capacity - 1;
+    for (size_t i = 0; i < capacity; i++) {
+      buffer[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+  MPMCQueue(const MPMCQueue&) = delete;
+  MPMCQueue& operator=(const MPMCQueue&) = delete;
+
+  size_t capacity() const { return mask + 1; }
+
+  // returns false if the queue is full
+  bool try_push(const T& item) {
+    Cell* cell;
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &buffer[pos & mask];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0) {
+        if (enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    cell->data = item;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // returns false if the queue is empty
+  bool try_pop(T& item) {
+    Cell* cell;
+    size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &buffer[pos & mask];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = dequeue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    item = cell->data;
+    cell->sequence.store(pos + mask + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+}  // namespace tcp
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef _TCP_READ_BUFFER_HPP_
+#define _TCP_READ_BUFFER_HPP_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <memory>
+
+namespace tcp {
+
+// receive buffer that lets line/delimiter reads pull in big chunks per
+// syscall instead of one byte at a time
+class ReadBuffer {
+ private:
+  std::unique_ptr<char[]> buffer;
+  size_t capacity;
+  size_t start;
+  size_t end;
+
+ public:
+  static constexpr size_t npos = (size_t)-1;
+
+  // storage is only allocated on the first fill
+  explicit ReadBuffer(size_t initial_capacity = 16384)
+      : buffer(), capacity(initial_capacity), start(0), end(0) {}
+
+  // buffered bytes
+  size_t size() const { return end - start; }
+  bool empty() const { return start == end; }
+  const char* data() const { return buffer.get() + start; }
+
+  // drop n bytes from the front
+  void consume(size_t n);
+
+  // copy up to len buffered bytes into dest and consume them
+  size_t take(void* dest, size_t len);
+
+  // read whatever the fd has (at least 1 byte of space is always available)
+  // passthrough (returns ::read's result)
+  ssize_t fill(int fd);
+
+  // position of delim in the buffered bytes at or after from (or npos)
+  size_t find(const char* delim, size_t delim_len, size_t from = 0) const;
+
+ private:
+  // make room for more data at the end
+  void reserve();
+};
+
+}  // namespace tcp
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef _TCP_SEND_QUEUE_HPP_
+#define _TCP_SEND_QUEUE_HPP_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <deque>
+#include <string>
+
+namespace tcp {
+
+// outbound bytes the socket could not take yet, kept in chunks so a flush
+// can hand many queued messages to the kernel in one gather write
+class SendQueue {
+ private:
+  std::deque<std::string> chunks;
+  // bytes of the front chunk already sent
+  size_t offset;
+  size_t total;
+
+ public:
+  SendQueue() : chunks(), offset(0), total(0) {}
+
+  // queued bytes
+  size_t size() const { return total; }
+  bool empty() const { return total == 0; }
+
+  // copy len bytes to the back of the queue
+  void push(const void* data, size_t len);
+
+  // write as much as fd takes without blocking, returns the bytes written
+  // (-1 with errno set on errors other than EAGAIN)
+  ssize_t flush(int fd);
+
+  // drop everything queued
+  void clear();
+};
+
+}  // namespace tcp
+
+#endif
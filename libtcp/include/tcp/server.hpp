@@ -1,79 +1,356 @@
 #ifndef _TCP_SERVER_HPP_
 #define _TCP_SERVER_HPP_
 
+#include <semaphore.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "tcp/client.hpp"
+#include "tcp/metrics.hpp"
+#include "tcp/mpmc_queue.hpp"
+#include "tcp/socket_options.hpp"
+#include "tcp/timer_wheel.hpp"
 
 namespace tcp {
 
+class AsyncClient;
+class EventLoop;
+class IoContext;
+template <typename T>
+class Task;
+
 typedef void* client_data_ptr_t;
 
-typedef void (*ClientHandlerFunction)(Client*, client_data_ptr_t);
-typedef void (*TimeoutFunction)();
+// readiness events passed to event loop handlers
+enum client_event : uint32_t {
+  Connected = 1 << 0,
+  Readable = 1 << 1,
+  Writable = 1 << 2,
+  Hangup = 1 << 3,
+};
+
+// handlers are type-erased once when they are added, so stateful lambdas
+// and functors work and a dispatch is a single indirect call
+typedef std::function<void(Client*, client_data_ptr_t)> ClientHandlerFunction;
+// called with a non-blocking client every time it becomes ready
+// (edge-triggered: read/write until EAGAIN), return false to close it
+// bytes queued by Client::send() are flushed before Writable is passed on,
+// the client starts out with the Queue overflow policy (send() never blocks
+// the loop, on_full and writable() say when to stop sending)
+// Hangup is the last call: after a half-close (shutdown(SHUT_WR)) the
+// connection closes once the send queue has drained, after a reset or
+// error right away
+typedef std::function<bool(Client*, uint32_t events, client_data_ptr_t)>
+    EventHandlerFunction;
+// coroutine handler, needs tcp/coroutine.hpp (C++20) to define one
+typedef std::function<Task<void>(AsyncClient*, client_data_ptr_t)>
+    CoroutineHandlerFunction;
+typedef std::function<void()> TimeoutFunction;
+
+// what a drain did with the connections that were open when accepting
+// stopped
+struct DrainReport {
+  unsigned long in_flight;
+  // cut off at the deadline (the rest finished on their own)
+  unsigned long aborted;
+  // the listeners went to a replacement server instead of being closed
+  bool handed_off;
+
+  unsigned long completed() const { return in_flight - aborted; }
+};
 
 class Server {
  public:
   class ClientHandler {
    public:
-    enum handle_mode { RoundRobin, Random };
+    // LeastConnections picks the handler with the fewest active sessions
+    // (ties go round robin), PeerHash always gives a client IP the same
+    // handler for cache affinity
+    enum handle_mode { RoundRobin, Random, LeastConnections, PeerHash };
+    // order clients leave the admission queue in: Lifo serves the newest
+    // (whose peers are least likely to have given up) and drops the oldest
+    // when the queue is full, Fifo drops the newcomer instead
+    enum admission_policy { Fifo, Lifo };
 
    private:
+    struct Connection {
+      std::unique_ptr<Client> client;
+      // handlers are fixed while the server runs, so this stays valid
+      const EventHandlerFunction* handler;
+      unsigned int slot;
+      EventLoop* loop;
+      // closes the connection once it has been idle too long
+      TimerWheel::TimerId idle_timer;
+      // done (handler returned false or the peer half-closed), closed once
+      // the send queue has drained
+      bool closing;
+    };
+
+    // accepted socket waiting for a pool worker (sock_fd < 0 stops a worker)
+    struct PendingClient {
+      int sock_fd;
+      struct sockaddr_in6 addr;
+      unsigned int slot;
+    };
+
+    // accepted while max_clients were being served
+    struct WaitingClient {
+      int sock_fd;
+      struct sockaddr_in6 addr;
+      std::chrono::steady_clock::time_point since;
+    };
+
     // operational data
+    // guards the bookkeeping below when several acceptors share the handler
+    std::mutex lock;
+    std::vector<int> listener_fds;
     unsigned int current_handler;
-    std::vector<pid_t> clients;
+    // fork mode: client processes and their handler slots, reaped when
+    // child_fd reports SIGCHLD
+    std::unordered_map<pid_t, unsigned int> clients;
+    int child_fd;
+    std::unordered_map<int, Connection> connections;
+    std::atomic<unsigned int> active_clients;
+    // active sessions per handler slot (shared with forked processes)
+    std::atomic<unsigned long>* slot_sessions;
+    size_t num_slots;
+    std::unique_ptr<MPMCQueue<PendingClient>> pending_clients;
+    sem_t pending_count;
+    std::vector<std::thread> workers;
+    // thread mode: sockets of running handlers, shut down when a drain runs
+    // out of time (and right away for clients that start after that)
+    std::unordered_set<int> client_fds;
+    bool aborting;
+    // admission queue, in arrival order, and the eventfd that wakes the
+    // acceptors when a thread or coroutine frees a slot
+    std::deque<WaitingClient> waiting;
+    int admit_fd;
+    // counters of the current run (shared with forked processes)
+    MetricsRegistry metrics;
 
     // configuration data
     unsigned int max_clients;
     std::vector<ClientHandlerFunction> handlers;
+    std::vector<EventHandlerFunction> event_handlers;
+    std::vector<CoroutineHandlerFunction> coroutine_handlers;
     handle_mode mode;
     bool debug_mode;
     client_data_ptr_t extra_data;
     bool use_thread;
+    unsigned int num_workers;
+    bool event_loop;
+    unsigned int num_io_threads;
+    IoContext* io_context;
+    unsigned int idle_timeout;
+    unsigned int read_timeout;
+    unsigned int write_timeout;
+    unsigned int queue_size;
+    unsigned int queue_timeout;
+    admission_policy queue_policy;
 
     ClientHandler()
-        : current_handler(0),
+        : lock(),
+          listener_fds(),
+          current_handler(0),
           clients(),
+          child_fd(-1),
+          connections(),
+          active_clients(0),
+          slot_sessions(nullptr),
+          num_slots(0),
+          pending_clients(),
+          pending_count(),
+          workers(),
+          client_fds(),
+          aborting(false),
+          waiting(),
+          admit_fd(-1),
+          metrics(),
           max_clients(5),
           handlers(),
+          event_handlers(),
+          coroutine_handlers(),
           mode(RoundRobin),
           debug_mode(false),
           extra_data(nullptr),
-          use_thread(false) {}
+          use_thread(false),
+          num_workers(0),
+          event_loop(false),
+          num_io_threads(0),
+          io_context(nullptr),
+          idle_timeout(0),
+          read_timeout(0),
+          write_timeout(0),
+          queue_size(0),
+          queue_timeout(0),
+          queue_policy(Fifo) {}
     ~ClientHandler();
     void set_max_clients(unsigned int max) { max_clients = max; }
     void add_handler(ClientHandlerFunction handler) {
-      handlers.push_back(handler);
+      handlers.push_back(std::move(handler));
     }
     void set_mode(handle_mode mode) { this->mode = mode; }
     void debug(bool mode) { debug_mode = mode; }
     void set_extra_data(client_data_ptr_t data) { extra_data = data; }
     void use_threads() { use_thread = true; }
+    void use_thread_pool(unsigned int size) {
+      use_thread = true;
+      num_workers = size;
+    }
+    void add_event_handler(EventHandlerFunction handler) {
+      event_handlers.push_back(std::move(handler));
+    }
+    void use_event_loop() { event_loop = true; }
+    void add_coroutine_handler(CoroutineHandlerFunction handler) {
+      coroutine_handlers.push_back(std::move(handler));
+    }
+    void use_coroutines(unsigned int num_threads) {
+      num_io_threads = num_threads;
+    }
+    void set_idle_timeout(unsigned int ms) { idle_timeout = ms; }
+    void set_read_timeout(unsigned int ms) { read_timeout = ms; }
+    void set_write_timeout(unsigned int ms) { write_timeout = ms; }
+    void set_admission_queue(unsigned int size, unsigned int timeout_ms,
+                             admission_policy policy) {
+      queue_size = size;
+      queue_timeout = timeout_ms;
+      queue_policy = policy;
+    }
 
-    void accept(int server_sock_fd);
+    // zeroed session counts for num_slots handlers (-1 on error)
+    int map_sessions(size_t num_slots);
+    // pick the handler slot for a new client and count it as a session
+    unsigned int next_handler(size_t num_handlers,
+                              const struct sockaddr_in6& client_addr);
+    void release_handler(unsigned int slot);
+    // returns the number of sockets accepted
+    unsigned int accept(int server_sock_fd);
+    // all max_clients slots are taken (call with lock held)
+    bool full();
+    // serve the client in a new process, thread or coroutine
+    void start_client(int client_sock_fd,
+                      const struct sockaddr_in6& client_addr);
+
+    // admission queue
+    void open_admission();
+    // a thread or coroutine slot is free
+    void notify_admission();
+    // (call the rest with lock held)
+    // queue a client that found the server full (or drop it)
+    void enqueue(int client_sock_fd, const struct sockaddr_in6& client_addr);
+    // close clients past their deadline and start waiting ones while
+    // slots are free
+    void admit_waiting();
+    // ms until the next waiting client's deadline, -1 if there is none
+    int admission_wait();
+    // returns the number of waiting clients closed
+    unsigned long close_waiting();
+    // take SIGCHLD through child_fd (before any threads are started)
+    void watch_children();
+    void unwatch_children();
     void reap_clients();
     void join_clients();
     void terminate_clients();
     void kill_clients();
+    // clients still being served (processes, threads or coroutines)
+    unsigned long active_count();
+    // give the clients until deadline to finish, then cut them off
+    // returns the number that had to be cut off
+    unsigned long drain_clients(
+        std::chrono::steady_clock::time_point deadline);
+
+    // blocking handlers get read/write deadlines as socket options
+    void set_socket_timeouts(int client_sock_fd);
+
+    // thread mode
+    void run_client(int client_sock_fd, const struct sockaddr_in6& client_addr,
+                    unsigned int slot);
+    void start_workers();
+    void stop_workers();
+    void worker_loop();
+
+    // event loop mode
+    void add_connection(EventLoop& loop, int client_sock_fd,
+                        const struct sockaddr_in6* client_addr);
+    void dispatch(EventLoop& loop, int client_sock_fd, uint32_t events);
+    void arm_idle_timer(EventLoop& loop, int client_sock_fd,
+                        Connection& connection);
+    // close now, or once the send queue has drained
+    void finish_connection(EventLoop& loop, int client_sock_fd,
+                           Connection& connection);
+    void close_connection(EventLoop& loop, int client_sock_fd);
+    // returns the number of connections closed
+    unsigned long close_connections(EventLoop& loop);
+    unsigned long count_connections(EventLoop& loop);
+
+    // coroutine mode
+    Task<void> run_coroutine(int client_sock_fd,
+                             struct sockaddr_in6 client_addr,
+                             unsigned int slot);
 
     friend class Server;
   };
 
  private:
+  // per-shard accept counter (shared with a forked server process)
+  struct AcceptCounter {
+    alignas(64) std::atomic<unsigned long> count;
+  };
+
+  // drain progress (shared with a forked server process)
+  struct DrainState {
+    // grace period asked for by drain(), UINT_MAX for drain_timeout
+    std::atomic<unsigned int> timeout_ms;
+    std::atomic<unsigned long> in_flight;
+    std::atomic<unsigned long> aborted;
+    std::atomic<bool> handed_off;
+    // prefork workers in the middle of a client
+    std::atomic<unsigned int> busy_workers;
+  };
+
   // operational data
   int server_sock_fd;
   ClientHandler client_handler;
   pid_t server_pid;
-  unsigned int timeout_count;
+  AcceptCounter* shard_accepts;
+  unsigned int num_shard_counters;
+  DrainState* drain_state;
+  // eventfd that tells every acceptor to stop (shared with a forked server)
+  int stop_fd;
+  // unix socket replacement servers fetch the listeners from
+  int handoff_fd;
+  // thread mode
+  std::thread server_thread;
 
   // configuration data
   char server_ip_addr[INET6_ADDRSTRLEN];
+  // listen on this AF_UNIX path instead (set_ip_addr("/..."))
+  std::string unix_path;
   unsigned int port_no;
   unsigned int timeout;
   unsigned int max_timeouts;
   unsigned int backlog;
+  unsigned int acceptor_shards;
+  unsigned int prefork_workers;
   bool debug_mode;
   bool use_thread;
+  bool io_uring;
+  SocketOptions socket_options;
+  unsigned int drain_timeout;
+  std::string handoff_path;
+  std::string metrics_name;
   TimeoutFunction timeout_handler;
 
  public:
@@ -81,42 +358,191 @@ class Server {
       : server_sock_fd(-1),
         client_handler(),
         server_pid(-1),
-        timeout_count(0),
+        shard_accepts(nullptr),
+        num_shard_counters(0),
+        drain_state(nullptr),
+        stop_fd(-1),
+        handoff_fd(-1),
+        server_thread(),
         server_ip_addr(""),
+        unix_path(),
         port_no(0),
         timeout(1),
         max_timeouts(0),
         backlog(5),
+        acceptor_shards(1),
+        prefork_workers(0),
         debug_mode(false),
         use_thread(false),
+        io_uring(false),
+        socket_options(),
+        drain_timeout(10000),
+        handoff_path(),
+        metrics_name(),
         timeout_handler(nullptr) {}
   ~Server();
 
   // server configuration
   Server& set_port(unsigned int port_no);
+  // an address starting with '/' is the path of a unix domain socket, which
+  // needs no port (a stale socket file is replaced, the path is removed
+  // when the server stops, socket options and acceptor shards are TCP only)
   Server& set_ip_addr(const char* ip_addr);
   Server& set_timeout(unsigned int seconds);
   Server& set_max_timeouts(unsigned int seconds);
   Server& set_backlog(unsigned int size);
+  // tune the listener, accepted sockets inherit the options
+  // (e.g. SocketOptions::low_latency())
+  Server& set_socket_options(const SocketOptions& options);
+  // accept on n SO_REUSEPORT listeners, each on its own pinned thread
+  Server& set_acceptor_shards(unsigned int num_shards);
   Server& debug(bool mode);
   Server& set_timeout_handler(TimeoutFunction handler);
   Server& use_threads();
+  // hand clients to a fixed number of worker threads
+  Server& use_thread_pool(unsigned int num_workers);
+  // fork long-lived workers up front that accept on the shared listener
+  Server& use_prefork(unsigned int num_workers);
+  // serve every client from a single epoll loop (needs event handlers)
+  Server& use_event_loop();
+  // serve every client as a coroutine on num_threads event loop threads
+  // (needs coroutine handlers)
+  Server& use_coroutines(unsigned int num_threads);
+  // run the event loop (or coroutine loops) on io_uring, epoll is used if
+  // the kernel lacks it
+  Server& use_io_uring();
 
   // client handler configuration
+  // handlers may leave out the trailing extra data argument, e.g.
+  //   server.add_handler([&cache](Client* client) { ... });
   Server& add_handler(ClientHandlerFunction handler);
+  Server& add_event_handler(EventHandlerFunction handler);
+  Server& add_coroutine_handler(CoroutineHandlerFunction handler);
+  template <typename Handler>
+  Server& add_handler(Handler handler);
+  template <typename Handler>
+  Server& add_event_handler(Handler handler);
+  template <typename Handler>
+  Server& add_coroutine_handler(Handler handler);
   Server& set_handler_mode(ClientHandler::handle_mode mode);
   Server& set_max_clients(unsigned int max_clients);
+  // per-connection deadlines in ms (0, the default, disables them)
+  // idle: close connections that see no events for this long (event loop)
+  Server& set_idle_timeout(unsigned int ms);
+  // read/write: fail a read (write) that waits longer than this, with EAGAIN
+  // for blocking handlers (SO_RCVTIMEO/SO_SNDTIMEO) and ETIMEDOUT for
+  // coroutines
+  Server& set_read_timeout(unsigned int ms);
+  Server& set_write_timeout(unsigned int ms);
+  // hold up to size clients that arrive while max_clients are being served
+  // until a slot frees, instead of closing them right away
+  // each waits at most timeout_ms (0 for no limit) before it is closed
+  // (fork, thread and coroutine modes)
+  Server& set_admission_queue(
+      unsigned int size, unsigned int timeout_ms,
+      ClientHandler::admission_policy policy = ClientHandler::Fifo);
   Server& add_handler_extra_data(void* data);
 
+  // graceful shutdown
+  // ms in-flight connections get to finish when the server drains on
+  // SIGTERM or after a handoff (10s by default)
+  Server& set_drain_timeout(unsigned int ms);
+  // zero-downtime restarts: on start, take over the listening sockets of
+  // the server serving handoffs on this unix socket path (or bind new ones
+  // if there is none), then serve them to the next replacement and drain
+  // once it has them (SCM_RIGHTS, the kernel accept queue is never closed)
+  Server& set_handoff_path(const char* path);
+
+  // also publish the counters in the POSIX shared memory segment name
+  // (e.g. "/myserver"), so MetricsRegistry::read() can watch the server
+  // from another process
+  Server& set_metrics_name(const char* name);
+
   // server operation
+  // the pid of the forked server process (this process in thread mode)
   pid_t start();
+  // serve until the server stops, SIGTERM drains it first
   void exec();
+  // stop accepting, give in-flight connections up to timeout_ms to finish,
+  // then cut off the rest and stop the server
+  DrainReport drain(unsigned int timeout_ms);
+  // drain without a grace period, force kills a forked server outright
   void stop(bool force = false);
 
+  // connections accepted by each acceptor shard so far
+  std::vector<unsigned long> get_shard_accept_counts() const;
+  // counters of the running (or last) server, summed over all shards
+  Metrics get_metrics() const;
+  // session latency of the handler added slot-th (in the order of
+  // add_handler, add_coroutine_handler or add_event_handler)
+  HandlerLatency get_latency(unsigned int slot) const;
+  // for ScopedTimer in handlers, valid while the server runs
+  const MetricsRegistry& get_registry() const {
+    return client_handler.metrics;
+  }
+
  private:
+  int open_listener(bool reuse_port);
+  // listeners received from the server on handoff_path (empty if none)
+  std::vector<int> take_over_listeners();
+  int open_handoff_socket();
+  // send the listeners to a replacement server and start draining
+  void hand_off(const std::vector<int>& listener_fds);
+  bool stop_requested() const;
+  std::chrono::steady_clock::time_point drain_deadline() const;
   void run_server();
+  void pin_to_cpu(unsigned int shard);
+  void run_acceptor(int sock_fd, unsigned int shard);
+  void run_event_loop(int sock_fd, unsigned int shard);
+  void run_prefork(const std::vector<int>& listener_fds);
+  pid_t spawn_prefork_worker(const std::vector<int>& listener_fds,
+                             unsigned int worker);
+  void run_prefork_worker(int sock_fd, unsigned int shard);
+  // returns false once the server should stop
+  bool handle_timeout(unsigned int& timeout_count);
 };
 
+template <typename Handler>
+Server& Server::add_handler(Handler handler) {
+  if constexpr (std::is_invocable_v<Handler&, Client*>) {
+    return add_handler(ClientHandlerFunction(
+        [handler = std::move(handler)](Client* client,
+                                       client_data_ptr_t) mutable {
+          handler(client);
+        }));
+  } else {
+    return add_handler(ClientHandlerFunction(std::move(handler)));
+  }
+}
+
+template <typename Handler>
+Server& Server::add_event_handler(Handler handler) {
+  if constexpr (std::is_invocable_v<Handler&, Client*, uint32_t>) {
+    return add_event_handler(EventHandlerFunction(
+        [handler = std::move(handler)](Client* client, uint32_t events,
+                                       client_data_ptr_t) mutable {
+          return handler(client, events);
+        }));
+  } else {
+    return add_event_handler(EventHandlerFunction(std::move(handler)));
+  }
+}
+
+// the handler object lives in the server, so a coroutine lambda may use its
+// captures for as long as it runs
+template <typename Handler>
+Server& Server::add_coroutine_handler(Handler handler) {
+  if constexpr (std::is_invocable_v<Handler&, AsyncClient*>) {
+    return add_coroutine_handler(CoroutineHandlerFunction(
+        [handler = std::move(handler)](AsyncClient* client,
+                                       client_data_ptr_t) mutable {
+          return handler(client);
+        }));
+  } else {
+    return add_coroutine_handler(CoroutineHandlerFunction(std::move(handler)));
+  }
+}
+
 }  // namespace tcp
 
 #endif
\ No newline at end of file
@@ -0,0 +1,59 @@
+#ifndef _TCP_SOCKET_OPTIONS_HPP_
+#define _TCP_SOCKET_OPTIONS_HPP_
+
+namespace tcp {
+
+// socket tuning profile for Server listeners and outbound Clients
+// zero/false leaves an option at the kernel default, so a default
+// constructed profile changes nothing
+// options set on a listener are inherited by the sockets it accepts, so
+// tuning a server costs no syscalls per connection
+struct SocketOptions {
+  // disable Nagle, small writes go out at once (TCP_NODELAY)
+  bool no_delay;
+  // kernel buffer sizes in bytes (SO_SNDBUF/SO_RCVBUF, the kernel doubles
+  // them), set before connect/listen so the window scale can use them
+  int send_buffer;
+  int receive_buffer;
+  // listener: only wake accept once the client sent data, or this many
+  // seconds passed (TCP_DEFER_ACCEPT, client-speaks-first protocols only)
+  int defer_accept;
+  // listener: queue length for TCP Fast Open requests, client: send the
+  // first write with the SYN (TCP_FASTOPEN/TCP_FASTOPEN_CONNECT)
+  int fast_open;
+  // busy poll the device queue for this many us on blocking reads
+  // (SO_BUSY_POLL, values above net.core.busy_read need CAP_NET_ADMIN)
+  int busy_poll;
+  // probe idle connections, and drop them after keep_count failed probes
+  // (SO_KEEPALIVE, TCP_KEEPIDLE/TCP_KEEPINTVL/TCP_KEEPCNT)
+  bool keep_alive;
+  int keep_idle;
+  int keep_interval;
+  int keep_count;
+
+  SocketOptions()
+      : no_delay(false),
+        send_buffer(0),
+        receive_buffer(0),
+        defer_accept(0),
+        fast_open(0),
+        busy_poll(0),
+        keep_alive(false),
+        keep_idle(0),
+        keep_interval(0),
+        keep_count(0) {}
+
+  // request/response traffic (chat, RPC): no Nagle, fast open, busy poll
+  static SocketOptions low_latency();
+  // large transfers (file servers, proxies): big buffers, keepalive
+  static SocketOptions bulk_throughput();
+
+  // set every chosen option on a fresh socket, returns -1 (errno of the
+  // first failure) if any of them was rejected
+  // a listener also gets defer_accept and the fast open queue
+  int apply(int sock_fd, bool listener = false) const;
+};
+
+}  // namespace tcp
+
+#endif
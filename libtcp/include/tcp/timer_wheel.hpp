@@ -0,0 +1,85 @@
+#ifndef _TCP_TIMER_WHEEL_HPP_
+#define _TCP_TIMER_WHEEL_HPP_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <functional>
+#include <vector>
+
+namespace tcp {
+
+// hierarchical timing wheel with millisecond ticks
+// four levels of 64 slots cover ~4.6 hours (longer timers are re-cascaded),
+// add and cancel are O(1) and advancing only visits slots that hold timers
+// not thread-safe, it belongs to the loop that advances it
+class TimerWheel {
+ public:
+  typedef std::chrono::steady_clock Clock;
+  typedef std::function<void()> Callback;
+  // 0 is never a valid id
+  typedef uint64_t TimerId;
+
+ private:
+  static constexpr unsigned int LEVELS = 4;
+  static constexpr unsigned int SLOT_BITS = 6;
+  static constexpr unsigned int SLOTS = 1 << SLOT_BITS;
+  static constexpr uint32_t NONE = UINT32_MAX;
+
+  struct Timer {
+    Callback callback;
+    uint64_t expires;
+    // doubly linked slot list (or free list through next)
+    uint32_t prev;
+    uint32_t next;
+    // bumped on every reuse so stale ids can't cancel a new timer
+    uint32_t generation;
+    uint8_t level;
+    uint8_t slot;
+    bool active;
+  };
+
+  Clock::time_point start;
+  // last tick processed
+  uint64_t now_tick;
+  std::vector<Timer> timers;
+  uint32_t free_list;
+  size_t num_active;
+  uint32_t slots[LEVELS][SLOTS];
+  // non-empty slots of each level
+  uint64_t occupied[LEVELS];
+
+ public:
+  TimerWheel();
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  // run callback once, delay_ms from now
+  TimerId add(uint64_t delay_ms, Callback callback);
+  // returns false if the timer already ran or was cancelled
+  bool cancel(TimerId id);
+
+  // run every timer that is due, returns how many ran
+  // (callbacks may add and cancel timers)
+  size_t advance();
+
+  // ms until advance() may have work (-1 if there are no timers)
+  int next_timeout_ms() const;
+
+  // pending timers
+  size_t size() const { return num_active; }
+  bool empty() const { return num_active == 0; }
+
+ private:
+  uint64_t elapsed_ms() const;
+  uint64_t next_tick() const;
+  void link(uint32_t index);
+  void unlink(uint32_t index);
+  void release(uint32_t index);
+  void cascade(unsigned int level);
+};
+
+}  // namespace tcp
+
+#endif
@@ -1,120 +1,323 @@
 #include "tcp/client.hpp"
 
-#include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <linux/errqueue.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <vector>
+
+#include "dns/resolver.hpp"
+#include "tcp/error.hpp"
+
 namespace tcp {
 
-Client::Client(int sockfd, sockaddr_in6 client_addr) : sockfd(sockfd) {
-  if (inet_ntop(AF_INET6, &client_addr.sin6_addr, peer_ip_addr,
-                sizeof(peer_ip_addr)) == NULL) {
+// head start each address gets before the next one is tried (RFC 8305)
+#define CONNECTION_ATTEMPT_DELAY 250
+
+#define DEFAULT_HIGH_WATERMARK (1 << 20)
+#define DEFAULT_LOW_WATERMARK (1 << 18)
+
+// peer_ip() of unix domain socket peers
+#define UNIX_PEER_ADDR "unix"
+
+Client::Client(int sockfd, sockaddr_in6 client_addr)
+    : sockfd(sockfd),
+      splice_pipe{-1, -1},
+      send_queue(),
+      high_watermark(DEFAULT_HIGH_WATERMARK),
+      low_watermark(DEFAULT_LOW_WATERMARK),
+      overflow(Block),
+      send_full(false),
+      send_closed(false),
+      on_full(),
+      on_drain(),
+      zerocopy_threshold(0),
+      zerocopy_sent(0),
+      zerocopy_done(0),
+      opened(std::chrono::steady_clock::now()),
+      first_write() {
+  // accept() fills in the family of any address
+  if (client_addr.sin6_family == AF_UNIX) {
+    strcpy(peer_ip_addr, UNIX_PEER_ADDR);
+  } else if (inet_ntop(AF_INET6, &client_addr.sin6_addr, peer_ip_addr,
+                       sizeof(peer_ip_addr)) == NULL) {
     perror("TCPClient inet_ntop");
   }
 }
 
-Client::Client(const char *server, int port_no) {
+Client::Client(const char *server, int port_no, const SocketOptions &options)
+    : splice_pipe{-1, -1},
+      send_queue(),
+      high_watermark(DEFAULT_HIGH_WATERMARK),
+      low_watermark(DEFAULT_LOW_WATERMARK),
+      overflow(Block),
+      send_full(false),
+      send_closed(false),
+      on_full(),
+      on_drain(),
+      zerocopy_threshold(0),
+      zerocopy_sent(0),
+      zerocopy_done(0),
+      opened(std::chrono::steady_clock::now()),
+      first_write() {
+  try {
+    connect_to(server, port_no, std::chrono::steady_clock::time_point::max(),
+               options);
+  } catch (ConnectionError &e) {
+    fprintf(stderr, "TCPClient connect: %s\n", e.what());
+    exit(EXIT_FAILURE);
+  }
+}
+
+Client::Client(const char *server, int port_no,
+               std::chrono::milliseconds timeout,
+               const SocketOptions &options)
+    : splice_pipe{-1, -1},
+      send_queue(),
+      high_watermark(DEFAULT_HIGH_WATERMARK),
+      low_watermark(DEFAULT_LOW_WATERMARK),
+      overflow(Block),
+      send_full(false),
+      send_closed(false),
+      on_full(),
+      on_drain(),
+      zerocopy_threshold(0),
+      zerocopy_sent(0),
+      zerocopy_done(0),
+      opened(std::chrono::steady_clock::now()),
+      first_write() {
+  connect_to(server, port_no, std::chrono::steady_clock::now() + timeout,
+             options);
+}
+
+void Client::connect_to(const char *server, int port_no,
+                        std::chrono::steady_clock::time_point deadline,
+                        const SocketOptions &options) {
   // check if a hostname or ip address was provided
   if (server == nullptr) {
-    fprintf(stderr, "TCPClient: no server provided\n");
-    exit(EXIT_FAILURE);
+    throw ConnectionError("no server provided", EINVAL);
+  }
+  // a path has nothing to resolve and only one address to try
+  if (*server == '/') {
+    connect_unix(server, deadline);
+    return;
   }
+  std::string peer = std::string(server) + ":" + std::to_string(port_no);
 
-  // check for any colons in the server address (IPv6)
-  bool is_ipv6 = false;
-  for (auto p = server; *p; p++) {
-    if (*p == ':') {
-      is_ipv6 = true;
-      break;
+  // literals, the hosts file and cached answers resolve without any I/O,
+  // queries count against the deadline
+  std::vector<struct in6_addr> addresses;
+  int s = dns::Resolver::get_default().resolve(server, addresses, deadline);
+  if (s == EAI_AGAIN && std::chrono::steady_clock::now() >= deadline) {
+    throw ConnectionError(peer + ": name resolution timed out", ETIMEDOUT);
+  }
+  if (s != 0) {
+    throw ConnectionError(peer + ": " + gai_strerror(s), EHOSTUNREACH);
+  }
+
+  // alternate address families, starting with the preferred (first) one
+  std::vector<struct in6_addr> preferred, other;
+  for (auto &address : addresses) {
+    bool same = IN6_IS_ADDR_V4MAPPED(&address) ==
+                IN6_IS_ADDR_V4MAPPED(&addresses[0]);
+    (same ? preferred : other).push_back(address);
+  }
+  std::vector<struct in6_addr> candidates;
+  for (size_t i = 0; i < preferred.size() || i < other.size(); i++) {
+    if (i < preferred.size()) {
+      candidates.push_back(preferred[i]);
+    }
+    if (i < other.size()) {
+      candidates.push_back(other[i]);
     }
   }
-  // check for any alphabetic characters in the server address
-  bool is_hostname = false;
-  if (!is_ipv6) {
-    for (auto p = server; *p; p++) {
-      if (isalpha(*p)) {
-        is_hostname = true;
+
+  struct Attempt {
+    int fd;
+    struct sockaddr_in6 addr;
+  };
+  std::vector<Attempt> attempts;
+  struct sockaddr_in6 addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin6_family = AF_INET6;
+  addr.sin6_port = htons(port_no);
+  size_t next = 0;
+  auto next_start = std::chrono::steady_clock::now();
+  int last_error = EHOSTUNREACH;
+  sockfd = -1;
+
+  while (sockfd < 0) {
+    auto now = std::chrono::steady_clock::now();
+    if (now >= deadline) {
+      last_error = ETIMEDOUT;
+      break;
+    }
+
+    // start the next candidate once the attempt delay is up, or right away
+    // if every earlier attempt has already failed
+    if (next < candidates.size() && (now >= next_start || attempts.empty())) {
+      addr.sin6_addr = candidates[next++];
+      int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, 0);
+      if (fd < 0) {
+        last_error = errno;
+        break;
+      }
+      if (options.apply(fd) < 0) {
+        perror("TCPClient setsockopt");
+      }
+      if (::connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        sockfd = fd;
         break;
       }
+      if (errno != EINPROGRESS) {
+        last_error = errno;
+        close(fd);
+        continue;
+      }
+      attempts.push_back({fd, addr});
+      next_start = now + std::chrono::milliseconds(CONNECTION_ATTEMPT_DELAY);
+      continue;
+    }
+    if (attempts.empty()) {
+      break;
     }
-  }
-
-  // get the address info if a hostname was provided
-  if (is_hostname) {
-    struct addrinfo hints;
-    struct addrinfo *result;
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = 0;
-    hints.ai_protocol = 0;
 
-    int s = getaddrinfo(server, nullptr, &hints, &result);
-    if (s != 0) {
-      fprintf(stderr, "TCPClient getaddrinfo: %s\n", gai_strerror(s));
-      exit(EXIT_FAILURE);
+    // wait for an attempt to finish, the next start or the deadline
+    auto wake = deadline;
+    if (next < candidates.size() && next_start < wake) {
+      wake = next_start;
+    }
+    int timeout_ms = -1;
+    if (wake != std::chrono::steady_clock::time_point::max()) {
+      auto wait = std::chrono::ceil<std::chrono::milliseconds>(wake - now);
+      timeout_ms = std::min<long long>(wait.count(), INT_MAX);
     }
-    // set the peer ip address to the first address in the list
-    // for now, only support IPv4
-    char namebuf[INET_ADDRSTRLEN];
-    if (result->ai_family == AF_INET) {
-      if (inet_ntop(AF_INET,
-                    &((struct sockaddr_in *)result->ai_addr)->sin_addr,
-                    namebuf, sizeof(namebuf)) == NULL) {
-        perror("TCPClient inet_ntop");
+    std::vector<struct pollfd> pfds;
+    for (auto &attempt : attempts) {
+      pfds.push_back({attempt.fd, POLLOUT, 0});
+    }
+    if (poll(pfds.data(), pfds.size(), timeout_ms) < 0) {
+      if (errno == EINTR) {
+        continue;
       }
-      snprintf(peer_ip_addr, INET6_ADDRSTRLEN, "::ffff:%s", namebuf);
-    } else {
-      fprintf(stderr, "TCPClient: unsupported address family\n");
-      exit(EXIT_FAILURE);
+      last_error = errno;
+      break;
     }
-    freeaddrinfo(result);
-  }
-  // ip address was provided
-  else {
-    // convert to v6 if it is v4
-    if (!is_ipv6) {
-      snprintf(peer_ip_addr, INET6_ADDRSTRLEN, "::ffff:%s", server);
-    } else {
-      strncpy(peer_ip_addr, server, INET6_ADDRSTRLEN);
-      peer_ip_addr[INET6_ADDRSTRLEN - 1] = '\0';
+
+    for (size_t i = pfds.size(); i-- > 0;) {
+      if (pfds[i].revents == 0) {
+        continue;
+      }
+      int error = 0;
+      socklen_t error_len = sizeof(error);
+      if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &error, &error_len) <
+          0) {
+        error = errno;
+      }
+      if (error == 0 && sockfd < 0) {
+        sockfd = pfds[i].fd;
+        addr = attempts[i].addr;
+      } else {
+        close(pfds[i].fd);
+        last_error = error != 0 ? error : last_error;
+      }
+      attempts.erase(attempts.begin() + i);
     }
   }
 
-  sockfd = socket(AF_INET6, SOCK_STREAM, 0);
+  // the losers of the race
+  for (auto &attempt : attempts) {
+    close(attempt.fd);
+  }
   if (sockfd < 0) {
-    perror("TCPClient socket");
-    exit(EXIT_FAILURE);
+    throw ConnectionError(peer + ": " + strerror(last_error), last_error);
   }
 
-  struct sockaddr_in6 addr;
+  // back to blocking I/O
+  int flags = fcntl(sockfd, F_GETFL);
+  if (flags < 0 || fcntl(sockfd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+    perror("TCPClient fcntl");
+  }
+  if (inet_ntop(AF_INET6, &addr.sin6_addr, peer_ip_addr,
+                sizeof(peer_ip_addr)) == NULL) {
+    perror("TCPClient inet_ntop");
+  }
+}
+
+void Client::connect_unix(const char *path,
+                          std::chrono::steady_clock::time_point deadline) {
+  struct sockaddr_un addr;
   memset(&addr, 0, sizeof(addr));
-  addr.sin6_family = AF_INET6;
-  addr.sin6_port = htons(port_no);
-  if (inet_pton(AF_INET6, peer_ip_addr, &addr.sin6_addr) < 0) {
-    perror("TCPClient inet_pton");
-    exit(EXIT_FAILURE);
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    throw ConnectionError(std::string(path) + ": path too long",
+                          ENAMETOOLONG);
   }
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
 
-  if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-    perror("TCPClient connect");
-    exit(EXIT_FAILURE);
+  sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sockfd < 0) {
+    throw ConnectionError(std::string(path) + ": " + strerror(errno), errno);
   }
+  // connect only waits while the listener's backlog is full, and for no
+  // longer than the send timeout
+  bool timed = deadline != std::chrono::steady_clock::time_point::max();
+  if (timed) {
+    auto wait = std::chrono::ceil<std::chrono::microseconds>(
+        deadline - std::chrono::steady_clock::now());
+    // a zero timeout would mean no timeout at all
+    long long us = std::max<long long>(wait.count(), 1);
+    struct timeval tv;
+    tv.tv_sec = us / 1000000;
+    tv.tv_usec = us % 1000000;
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  }
+  int ret;
+  do {
+    ret = ::connect(sockfd, (struct sockaddr *)&addr, sizeof(addr));
+  } while (ret < 0 && errno == EINTR);
+  if (ret < 0) {
+    int error = errno == EAGAIN ? ETIMEDOUT : errno;
+    close(sockfd);
+    sockfd = -1;
+    throw ConnectionError(std::string(path) + ": " + strerror(error), error);
+  }
+  if (timed) {
+    struct timeval tv = {0, 0};
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  }
+  strcpy(peer_ip_addr, UNIX_PEER_ADDR);
 }
 
 Client::~Client() {
   if (close(sockfd) < 0) {
     perror("TCPClient close");
   }
+  if (splice_pipe[0] >= 0) {
+    close(splice_pipe[0]);
+    close(splice_pipe[1]);
+  }
 }
 
 ssize_t Client::writen(void *msgbuf, size_t len) {
+  if (zerocopy_threshold > 0 && len >= zerocopy_threshold) {
+    struct iovec iov = {msgbuf, len};
+    return wrote(writev_zerocopy(&iov, 1));
+  }
   size_t n = 0;
   while (n < len) {
     ssize_t n_written = ::write(sockfd, (char *)msgbuf + n, len - n);
@@ -126,57 +329,443 @@ ssize_t Client::writen(void *msgbuf, size_t len) {
     }
     n += n_written;
   }
+  return wrote(n);
+}
+
+ssize_t Client::writev(const struct iovec *iov, int iovcnt) {
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    total += iov[i].iov_len;
+  }
+  if (zerocopy_threshold > 0 && total >= zerocopy_threshold) {
+    return wrote(writev_zerocopy(iov, iovcnt));
+  }
+
+  // common case: everything goes out in one call
+  ssize_t n_written;
+  do {
+    n_written = ::writev(sockfd, iov, std::min(iovcnt, IOV_MAX));
+  } while (n_written < 0 && errno == EINTR);
+  if (n_written < 0 || (size_t)n_written == total) {
+    return wrote(n_written);
+  }
+
+  // partial write: advance a copy of the iovecs past what was sent
+  std::vector<struct iovec> pending(iov, iov + iovcnt);
+  size_t n = n_written;
+  size_t skip = n;
+  size_t first = 0;
+  while (true) {
+    while (first < pending.size() && skip >= pending[first].iov_len) {
+      skip -= pending[first].iov_len;
+      first++;
+    }
+    if (first == pending.size()) {
+      break;
+    }
+    pending[first].iov_base = (char *)pending[first].iov_base + skip;
+    pending[first].iov_len -= skip;
+
+    int count = std::min(pending.size() - first, (size_t)IOV_MAX);
+    n_written = ::writev(sockfd, &pending[first], count);
+    if (n_written < 0) {
+      if (errno == EINTR) {
+        skip = 0;
+        continue;
+      }
+      return n_written;
+    }
+    n += n_written;
+    skip = n_written;
+  }
+  return wrote(n);
+}
+
+int Client::set_zerocopy(size_t threshold) {
+  if (threshold > 0) {
+    int on = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0) {
+      return -1;
+    }
+  }
+  zerocopy_threshold = threshold;
+  return 0;
+}
+
+ssize_t Client::writev_zerocopy(const struct iovec *iov, int iovcnt) {
+  std::vector<struct iovec> pending(iov, iov + iovcnt);
+  size_t first = 0;
+  size_t n = 0;
+  while (true) {
+    while (first < pending.size() && pending[first].iov_len == 0) {
+      first++;
+    }
+    if (first == pending.size()) {
+      break;
+    }
+
+    struct msghdr msg = {};
+    msg.msg_iov = &pending[first];
+    msg.msg_iovlen = std::min(pending.size() - first, (size_t)IOV_MAX);
+    ssize_t n_sent = sendmsg(sockfd, &msg, MSG_ZEROCOPY);
+    if (n_sent >= 0) {
+      zerocopy_sent++;
+    } else if (errno == ENOBUFS) {
+      // over the locked memory limit (optmem_max), copy this part
+      n_sent = ::writev(sockfd, msg.msg_iov, msg.msg_iovlen);
+    }
+    if (n_sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // the kernel may still hold pages of earlier sends
+      int error = errno;
+      wait_zerocopy();
+      errno = error;
+      return -1;
+    }
+
+    n += n_sent;
+    size_t skip = n_sent;
+    while (skip > 0 && skip >= pending[first].iov_len) {
+      skip -= pending[first].iov_len;
+      first++;
+    }
+    if (skip > 0) {
+      pending[first].iov_base = (char *)pending[first].iov_base + skip;
+      pending[first].iov_len -= skip;
+    }
+  }
+
+  if (wait_zerocopy() < 0) {
+    return -1;
+  }
   return n;
 }
 
-void Client::readn(void *msgbuf, size_t len) {
+int Client::wait_zerocopy() {
+  while (zerocopy_done != zerocopy_sent) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err) +
+                            sizeof(struct sockaddr_in6))];
+    struct msghdr msg = {};
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    // reading the error queue never blocks, POLLERR says it has entries
+    if (recvmsg(sockfd, &msg, MSG_ERRQUEUE) < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        struct pollfd pfd = {sockfd, 0, 0};
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+          return -1;
+        }
+        continue;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+
+    for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+          !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+        continue;
+      }
+      auto error = (struct sock_extended_err *)CMSG_DATA(cmsg);
+      if (error->ee_errno != 0 || error->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+      // one notification covers the sends numbered ee_info to ee_data
+      zerocopy_done += error->ee_data - error->ee_info + 1;
+      if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        // the pinning and notifications were pure overhead
+        zerocopy_threshold = 0;
+      }
+    }
+  }
+  return 0;
+}
+
+ssize_t Client::send(const void *msgbuf, size_t len) {
+  if (send_closed) {
+    errno = EPIPE;
+    return -1;
+  }
+
+  // nothing queued, so the message can go straight out
+  size_t n = 0;
+  if (send_queue.empty()) {
+    ssize_t n_sent;
+    do {
+      n_sent = ::send(sockfd, msgbuf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while (n_sent < 0 && errno == EINTR);
+    if (n_sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      return -1;
+    }
+    n = n_sent > 0 ? wrote(n_sent) : 0;
+  }
+  size_t rest = len - n;
+
+  // a message that already started has to be queued whole
+  bool blocked = false;
+  if (rest > 0 && n == 0 && send_queue.size() + rest > high_watermark) {
+    mark_full();
+    switch (overflow) {
+      case Block:
+        // wait until it fits (or the queue is empty, for huge messages)
+        while (!send_queue.empty() &&
+               send_queue.size() + rest > high_watermark) {
+          struct pollfd pfd = {sockfd, POLLOUT, 0};
+          if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            return -1;
+          }
+          if (flush() < 0) {
+            return -1;
+          }
+        }
+        blocked = true;
+        break;
+      case Drop:
+        errno = ENOBUFS;
+        return -1;
+      case Disconnect:
+        shutdown(sockfd, SHUT_RDWR);
+        send_queue.clear();
+        send_closed = true;
+        errno = ECONNRESET;
+        return -1;
+      case Queue:
+        // on_full and writable() told the caller to back off
+        break;
+    }
+  }
+
+  send_queue.push((const char *)msgbuf + n, rest);
+  if (send_queue.size() >= high_watermark) {
+    mark_full();
+  }
+  if (blocked && flush() < 0) {
+    return -1;
+  }
+  return len;
+}
+
+ssize_t Client::flush() {
+  size_t before = send_queue.size();
+  if (before > 0 && send_queue.flush(sockfd) < 0) {
+    return -1;
+  }
+  wrote(before - send_queue.size());
+  if (send_full && send_queue.size() <= low_watermark) {
+    send_full = false;
+    if (on_drain) {
+      on_drain();
+    }
+  }
+  return send_queue.size();
+}
+
+void Client::mark_full() {
+  if (send_full) {
+    return;
+  }
+  send_full = true;
+  if (on_full) {
+    on_full();
+  }
+}
+
+void Client::set_send_queue(size_t high_watermark, size_t low_watermark,
+                            overflow_policy policy) {
+  this->high_watermark = high_watermark;
+  this->low_watermark = std::min(low_watermark, high_watermark);
+  overflow = policy;
+}
+
+void Client::set_overflow_policy(overflow_policy policy) {
+  overflow = policy;
+}
+
+void Client::set_send_callbacks(std::function<void()> on_full,
+                                std::function<void()> on_drain) {
+  this->on_full = std::move(on_full);
+  this->on_drain = std::move(on_drain);
+}
+
+int Client::cork() {
+  int on = 1;
+  return setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+int Client::uncork() {
+  // clearing the cork flushes whatever is still queued
+  int off = 0;
+  return setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+}
+
+ssize_t Client::send_file(int in_fd, off_t offset, size_t len) {
   size_t n = 0;
   while (n < len) {
-    ssize_t n_read = ::read(sockfd, (char *)msgbuf + n, len - n);
-    if (n_read < 0) {
+    ssize_t n_sent = sendfile(sockfd, in_fd, &offset, len - n);
+    if (n_sent < 0) {
       if (errno == EINTR) {
         continue;
       }
-      perror("TCPClient read");
-      exit(EXIT_FAILURE);
-    } else if (n_read == 0) {
-      fprintf(stderr, "TCPClient read EOF before finished\n");
-      exit(EXIT_FAILURE);
+      return n_sent;
+    } else if (n_sent == 0) {
+      // end of file
+      break;
     }
-    n += n_read;
+    n += n_sent;
   }
+  return wrote(n);
 }
 
-size_t Client::readline(void *msgbuf, size_t maxlen) {
-  size_t n_read = 0;
-  while (n_read < maxlen - 1) {
-    ssize_t n = ::read(sockfd, (char *)msgbuf + n_read, 1);
-    if (n < 0) {
+#define SPLICE_CHUNK_SIZE 65536
+
+ssize_t Client::splice_from(Client &other, size_t len) {
+  // anything other already buffered has to be copied the normal way
+  size_t n = 0;
+  if (!other.read_buffer.empty()) {
+    size_t n_buffered = std::min(other.read_buffer.size(), len);
+    if (writen((void *)other.read_buffer.data(), n_buffered) < 0) {
+      return -1;
+    }
+    other.read_buffer.consume(n_buffered);
+    n += n_buffered;
+  }
+
+  if (splice_pipe[0] < 0 && pipe2(splice_pipe, O_CLOEXEC) < 0) {
+    return -1;
+  }
+
+  while (n < len) {
+    ssize_t n_in = splice(other.sockfd, nullptr, splice_pipe[1], nullptr,
+                          std::min(len - n, (size_t)SPLICE_CHUNK_SIZE),
+                          SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (n_in < 0) {
       if (errno == EINTR) {
         continue;
       }
-      perror("TCPClient read");
-      exit(EXIT_FAILURE);
-    } else if (n == 0) {
+      return n_in;
+    } else if (n_in == 0) {
+      // other reached EOF
       break;
     }
-    n_read += n;
-    if (((char *)msgbuf)[n_read - 1] == '\n') {
-      break;
+
+    // the pipe must be emptied before the next splice in
+    while (n_in > 0) {
+      ssize_t n_out = splice(splice_pipe[0], nullptr, sockfd, nullptr, n_in,
+                             SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (n_out < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        // drop the stranded bytes so the pipe can be reused
+        close(splice_pipe[0]);
+        close(splice_pipe[1]);
+        splice_pipe[0] = splice_pipe[1] = -1;
+        return n_out;
+      }
+      n_in -= n_out;
+      n += n_out;
     }
   }
+  return wrote(n);
+}
+
+void Client::readn(void *msgbuf, size_t len) {
+  ssize_t n_read = read_exact(msgbuf, len);
+  if (n_read < 0) {
+    perror("TCPClient read");
+    exit(EXIT_FAILURE);
+  } else if ((size_t)n_read < len) {
+    fprintf(stderr, "TCPClient read EOF before finished\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+size_t Client::readline(void *msgbuf, size_t maxlen) {
+  ssize_t n_read = buffer_until("\n", 1, maxlen - 1);
+  if (n_read < 0) {
+    perror("TCPClient read");
+    exit(EXIT_FAILURE);
+  }
   if (n_read == 0) {
     return 0;
   }
+  read_buffer.take(msgbuf, n_read);
   ((char *)msgbuf)[n_read] = '\0';
   return n_read;
 }
 
+ssize_t Client::read_until(std::string &out, const std::string &delimiter,
+                           size_t maxlen) {
+  ssize_t n_read = buffer_until(delimiter.data(), delimiter.size(), maxlen);
+  if (n_read <= 0) {
+    return n_read;
+  }
+  out.append(read_buffer.data(), n_read);
+  read_buffer.consume(n_read);
+  return n_read;
+}
+
+ssize_t Client::read_exact(void *msgbuf, size_t len) {
+  // drain the buffer, then read straight into msgbuf so nothing past len is
+  // pulled off the socket
+  size_t n = read_buffer.take(msgbuf, len);
+  while (n < len) {
+    ssize_t n_read = ::read(sockfd, (char *)msgbuf + n, len - n);
+    if (n_read < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return n_read;
+    } else if (n_read == 0) {
+      break;
+    }
+    n += n_read;
+  }
+  return n;
+}
+
+ssize_t Client::buffer_until(const char *delimiter, size_t delimiter_len,
+                             size_t maxlen) {
+  size_t from = 0;
+  while (true) {
+    size_t pos = read_buffer.find(delimiter, delimiter_len, from);
+    if (pos != ReadBuffer::npos && pos + delimiter_len <= maxlen) {
+      return pos + delimiter_len;
+    }
+    if (read_buffer.size() >= maxlen) {
+      return maxlen;
+    }
+    // only rescan the tail that could hold a partial delimiter
+    if (read_buffer.size() >= delimiter_len) {
+      from = read_buffer.size() - delimiter_len + 1;
+    }
+
+    ssize_t n = read_buffer.fill(sockfd);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return n;
+    } else if (n == 0) {
+      // EOF, hand back whatever is left
+      return read_buffer.size();
+    }
+  }
+}
+
 ssize_t Client::write(void *msgbuf, size_t maxlen) {
-  return ::write(sockfd, msgbuf, maxlen);
+  return wrote(::write(sockfd, msgbuf, maxlen));
 }
 
 ssize_t Client::read(void *msgbuf, size_t maxlen) {
+  if (!read_buffer.empty()) {
+    return read_buffer.take(msgbuf, maxlen);
+  }
   return ::read(sockfd, msgbuf, maxlen);
 }
 
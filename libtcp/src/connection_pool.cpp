@@ -0,0 +1,140 @@
+#include "tcp/connection_pool.hpp"
+
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "tcp/error.hpp"
+
+namespace tcp {
+
+void PooledClient::release() {
+  if (pool != nullptr && client) {
+    pool->put_back(key, std::move(client), created);
+  }
+}
+
+ConnectionPool& ConnectionPool::set_max_idle(unsigned int per_destination) {
+  std::lock_guard<std::mutex> guard(lock);
+  max_idle = per_destination;
+  return *this;
+}
+
+ConnectionPool& ConnectionPool::set_idle_timeout(unsigned int seconds) {
+  if (seconds == 0) {
+    throw ConfigurationError("Idle timeout must be at least one second");
+  }
+  std::lock_guard<std::mutex> guard(lock);
+  idle_timeout = std::chrono::seconds(seconds);
+  return *this;
+}
+
+ConnectionPool& ConnectionPool::set_max_age(unsigned int seconds) {
+  if (seconds == 0) {
+    throw ConfigurationError("Max age must be at least one second");
+  }
+  std::lock_guard<std::mutex> guard(lock);
+  max_age = std::chrono::seconds(seconds);
+  return *this;
+}
+
+ConnectionPool& ConnectionPool::set_connect_timeout(unsigned int ms) {
+  if (ms == 0) {
+    throw ConfigurationError("Connect timeout must be positive");
+  }
+  std::lock_guard<std::mutex> guard(lock);
+  connect_timeout = std::chrono::milliseconds(ms);
+  return *this;
+}
+
+ConnectionPool& ConnectionPool::set_socket_options(
+    const SocketOptions& options) {
+  std::lock_guard<std::mutex> guard(lock);
+  socket_options = options;
+  return *this;
+}
+
+PooledClient ConnectionPool::acquire(const char* server, int port_no) {
+  std::string key = std::string(server) + ":" + std::to_string(port_no);
+  auto now = Clock::now();
+
+  // closed after the lock is dropped
+  std::vector<IdleClient> stale;
+  std::chrono::milliseconds timeout;
+  SocketOptions options;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    timeout = connect_timeout;
+    options = socket_options;
+    auto it = idle.find(key);
+    while (it != idle.end() && !it->second.empty()) {
+      // most recently used first, it is the least likely to be closed
+      IdleClient entry = std::move(it->second.back());
+      it->second.pop_back();
+      if (now - entry.idle_since >= idle_timeout ||
+          now - entry.created >= max_age || !healthy(*entry.client)) {
+        stale.push_back(std::move(entry));
+        continue;
+      }
+      hits++;
+      return PooledClient(this, key, std::move(entry.client), entry.created,
+                          true);
+    }
+  }
+  stale.clear();
+
+  misses++;
+  std::unique_ptr<Client> client(new Client(server, port_no, timeout, options));
+  return PooledClient(this, key, std::move(client), now, false);
+}
+
+void ConnectionPool::put_back(const std::string& key,
+                              std::unique_ptr<Client> client,
+                              Clock::time_point created) {
+  // a syscall, kept out of the lock
+  if (!healthy(*client)) {
+    return;
+  }
+
+  auto now = Clock::now();
+  std::lock_guard<std::mutex> guard(lock);
+  // set_max_age() may change it while connections come back
+  if (now - created >= max_age) {
+    return;
+  }
+  auto& entries = idle[key];
+  if (entries.size() >= max_idle) {
+    // the oldest idle connection makes room
+    if (entries.empty()) {
+      return;
+    }
+    entries.erase(entries.begin());
+  }
+  entries.push_back({std::move(client), created, now});
+}
+
+void ConnectionPool::clear() {
+  std::unordered_map<std::string, std::vector<IdleClient>> closing;
+  std::lock_guard<std::mutex> guard(lock);
+  closing.swap(idle);
+}
+
+size_t ConnectionPool::idle_count() {
+  std::lock_guard<std::mutex> guard(lock);
+  size_t count = 0;
+  for (auto& entry : idle) {
+    count += entry.second.size();
+  }
+  return count;
+}
+
+bool ConnectionPool::healthy(const Client& client) {
+  if (client.buffered() > 0) {
+    return false;
+  }
+  // EOF, an error or stray bytes all mean the connection can't be reused
+  char byte;
+  ssize_t n = recv(client.get_fd(), &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+}  // namespace tcp
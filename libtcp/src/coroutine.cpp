@@ -0,0 +1,461 @@
+#include "tcp/coroutine.hpp"
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+
+#include "dns/resolver.hpp"
+
+namespace tcp {
+
+thread_local IoContext::Worker* IoContext::current = nullptr;
+
+// handed to another thread, which resumes the coroutine through it unless
+// the context has stopped (and destroyed the coroutine) in the meantime
+class IoContext::RemoteResume {
+ private:
+  std::mutex lock;
+  Worker* worker;
+  std::coroutine_handle<> coro;
+
+ public:
+  RemoteResume(Worker* worker, std::coroutine_handle<> coro)
+      : lock(), worker(worker), coro(coro) {}
+
+  // run fn (it may touch the suspended frame), then queue the resume
+  void complete(const std::function<void()>& fn) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (worker == nullptr) {
+      return;
+    }
+    fn();
+    {
+      std::lock_guard<std::mutex> worker_guard(worker->lock);
+      worker->resumed.push_back(coro);
+    }
+    wake(*worker);
+    worker = nullptr;
+  }
+
+  // the coroutine is going away
+  void cancel() {
+    std::lock_guard<std::mutex> guard(lock);
+    worker = nullptr;
+  }
+};
+
+// owns a spawned task, frees itself once the task is done
+struct IoContext::Detached {
+  struct promise_type {
+    Detached get_return_object() {
+      return {std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() {
+      try {
+        throw;
+      } catch (std::exception& e) {
+        fprintf(stderr, "TCPIoContext coroutine: %s\n", e.what());
+      } catch (...) {
+        fprintf(stderr, "TCPIoContext coroutine: unknown exception\n");
+      }
+    }
+    ~promise_type() {
+      if (current != nullptr) {
+        current->running.erase(
+            std::coroutine_handle<promise_type>::from_promise(*this)
+                .address());
+      }
+    }
+  };
+
+  std::coroutine_handle<promise_type> coro;
+};
+
+IoContext::Detached IoContext::run_detached(Task<void> task) {
+  co_await task;
+}
+
+IoContext::IoContext(unsigned int num_threads, bool use_io_uring)
+    : workers(), next_worker(0), stopping(false) {
+  if (num_threads == 0) {
+    num_threads = 1;
+  }
+  for (unsigned int i = 0; i < num_threads; i++) {
+    workers.emplace_back(new Worker(use_io_uring));
+    Worker& worker = *workers.back();
+    worker.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker.wake_fd < 0) {
+      perror("TCPIoContext eventfd");
+      exit(EXIT_FAILURE);
+    }
+    if (worker.loop.add(worker.wake_fd, EPOLLIN, [this, &worker](uint32_t) {
+          run_spawned(worker);
+        }) < 0) {
+      perror("TCPIoContext add");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (auto& worker : workers) {
+    worker->thread = std::thread([this, &worker]() { run(*worker); });
+  }
+}
+
+IoContext::~IoContext() {
+  stop();
+  for (auto& worker : workers) {
+    worker->loop.remove(worker->wake_fd);
+    close(worker->wake_fd);
+  }
+}
+
+void IoContext::spawn(Task<void> task) {
+  auto coro = run_detached(std::move(task)).coro;
+  Worker& worker = *workers[next_worker++ % workers.size()];
+  {
+    // checked under the lock, so the loop cannot exit (and drop what was
+    // spawned) between the check and the push
+    std::lock_guard<std::mutex> guard(worker.lock);
+    if (!stopping && !worker.stopped) {
+      worker.spawned.push_back(coro);
+      coro = nullptr;
+    }
+  }
+  if (coro) {
+    coro.destroy();
+    return;
+  }
+  wake(worker);
+}
+
+void IoContext::stop() {
+  if (stopping.exchange(true)) {
+    return;
+  }
+  for (auto& worker : workers) {
+    wake(*worker);
+  }
+  for (auto& worker : workers) {
+    if (worker->thread.joinable()) {
+      worker->thread.join();
+    }
+  }
+}
+
+EventLoop* IoContext::current_loop() {
+  return current != nullptr ? &current->loop : nullptr;
+}
+
+void IoContext::resume_at(TimePoint deadline, std::coroutine_handle<> coro) {
+  if (current == nullptr) {
+    fprintf(stderr, "TCPIoContext: not running on an IoContext thread\n");
+    exit(EXIT_FAILURE);
+  }
+  auto delay = std::chrono::ceil<std::chrono::milliseconds>(
+      deadline - std::chrono::steady_clock::now());
+  current->loop.add_timer(delay.count() > 0 ? delay.count() : 0,
+                          [coro]() { coro.resume(); });
+}
+
+std::shared_ptr<IoContext::RemoteResume> IoContext::resume_remotely(
+    std::coroutine_handle<> coro) {
+  if (current == nullptr) {
+    fprintf(stderr, "TCPIoContext: not running on an IoContext thread\n");
+    exit(EXIT_FAILURE);
+  }
+  auto& remotes = current->remotes;
+  remotes.erase(std::remove_if(remotes.begin(), remotes.end(),
+                               [](auto& remote) { return remote.expired(); }),
+                remotes.end());
+  auto remote = std::make_shared<RemoteResume>(current, coro);
+  remotes.push_back(remote);
+  return remote;
+}
+
+void IoContext::run(Worker& worker) {
+  current = &worker;
+  while (!stopping) {
+    // sleeping coroutines are timers on the loop
+    if (worker.loop.poll(-1) < 0 && errno != EINTR) {
+      perror("TCPIoContext poll");
+      break;
+    }
+  }
+
+  // tear down whatever is still suspended, closing its clients
+  for (auto& weak : worker.remotes) {
+    if (auto remote = weak.lock()) {
+      remote->cancel();
+    }
+  }
+  worker.remotes.clear();
+  std::vector<void*> frames(worker.running.begin(), worker.running.end());
+  for (void* frame : frames) {
+    std::coroutine_handle<>::from_address(frame).destroy();
+  }
+  std::vector<std::coroutine_handle<>> spawned;
+  {
+    std::lock_guard<std::mutex> guard(worker.lock);
+    worker.stopped = true;
+    spawned.swap(worker.spawned);
+    // owned by the frames destroyed above
+    worker.resumed.clear();
+  }
+  for (auto coro : spawned) {
+    coro.destroy();
+  }
+  current = nullptr;
+}
+
+void IoContext::run_spawned(Worker& worker) {
+  uint64_t count;
+  while (read(worker.wake_fd, &count, sizeof(count)) > 0) {
+  }
+
+  std::vector<std::coroutine_handle<>> spawned;
+  std::vector<std::coroutine_handle<>> resumed;
+  {
+    std::lock_guard<std::mutex> guard(worker.lock);
+    spawned.swap(worker.spawned);
+    resumed.swap(worker.resumed);
+  }
+  for (auto coro : spawned) {
+    worker.running.insert(coro.address());
+    coro.resume();
+  }
+  for (auto coro : resumed) {
+    coro.resume();
+  }
+}
+
+void IoContext::wake(Worker& worker) {
+  uint64_t one = 1;
+  if (write(worker.wake_fd, &one, sizeof(one)) < 0) {
+    perror("TCPIoContext write");
+  }
+}
+
+AsyncClient::AsyncClient(int sockfd, const struct sockaddr_in6& addr)
+    : client(new Client(sockfd, addr)),
+      loop(IoContext::current_loop()),
+      readable(true),
+      writable(true),
+      reader(nullptr),
+      writer(nullptr),
+      read_timeout(0),
+      write_timeout(0) {
+  if (loop == nullptr) {
+    fprintf(stderr, "TCPAsyncClient: not running on an IoContext thread\n");
+    exit(EXIT_FAILURE);
+  }
+  if (loop->add(sockfd, EPOLLIN | EPOLLOUT | EPOLLRDHUP,
+                [this](uint32_t events) { on_events(events); }) < 0) {
+    perror("TCPAsyncClient add");
+  }
+}
+
+AsyncClient::~AsyncClient() { loop->remove(client->get_fd()); }
+
+void AsyncClient::on_events(uint32_t events) {
+  std::coroutine_handle<> resume_reader = nullptr;
+  std::coroutine_handle<> resume_writer = nullptr;
+  if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+    readable = true;
+    resume_reader = std::exchange(reader, nullptr);
+  }
+  if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+    writable = true;
+    resume_writer = std::exchange(writer, nullptr);
+  }
+  // either one may finish the coroutine that owns this client
+  if (resume_reader) {
+    resume_reader.resume();
+  }
+  if (resume_writer) {
+    resume_writer.resume();
+  }
+}
+
+Task<ssize_t> AsyncClient::read(void* msgbuf, size_t maxlen) {
+  while (true) {
+    ssize_t n = client->read(msgbuf, maxlen);
+    if (n >= 0) {
+      co_return n;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      co_return -1;
+    }
+    readable = false;
+    if (!co_await wait_readable()) {
+      errno = ETIMEDOUT;
+      co_return -1;
+    }
+  }
+}
+
+Task<ssize_t> AsyncClient::read_until(std::string& out,
+                                      const std::string& delimiter,
+                                      size_t maxlen) {
+  while (true) {
+    // partial data stays buffered in the client between attempts
+    ssize_t n = client->read_until(out, delimiter, maxlen);
+    if (n >= 0) {
+      co_return n;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      co_return -1;
+    }
+    readable = false;
+    if (!co_await wait_readable()) {
+      errno = ETIMEDOUT;
+      co_return -1;
+    }
+  }
+}
+
+Task<ssize_t> AsyncClient::write(const void* msgbuf, size_t len) {
+  size_t n = 0;
+  while (n < len) {
+    ssize_t n_written = client->write((char*)msgbuf + n, len - n);
+    if (n_written >= 0) {
+      n += n_written;
+      continue;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      co_return -1;
+    }
+    writable = false;
+    if (!co_await wait_writable()) {
+      errno = ETIMEDOUT;
+      co_return -1;
+    }
+  }
+  co_return n;
+}
+
+// looks server up on the resolver's threads, the loop keeps running
+struct ResolveAwaiter {
+  std::string name;
+  int error;
+  std::vector<struct in6_addr> addresses;
+
+  bool await_ready() {
+    return dns::Resolver::get_default().resolve_cached(name, error,
+                                                       addresses);
+  }
+  void await_suspend(std::coroutine_handle<> coro) {
+    auto remote = IoContext::resume_remotely(coro);
+    dns::Resolver::get_default().resolve_async(
+        name, [this, remote](int error, const auto& addresses) {
+          remote->complete([&]() {
+            this->error = error;
+            this->addresses = addresses;
+          });
+        });
+  }
+  int await_resume() const noexcept { return error; }
+};
+
+Task<std::unique_ptr<AsyncClient>> connect(const char* server, int port_no) {
+  if (server == nullptr) {
+    errno = EINVAL;
+    co_return nullptr;
+  }
+  // a unix domain socket path, connect fails with EAGAIN on a full backlog
+  if (*server == '/') {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(server) >= sizeof(addr.sun_path)) {
+      errno = ENAMETOOLONG;
+      co_return nullptr;
+    }
+    strncpy(addr.sun_path, server, sizeof(addr.sun_path) - 1);
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) {
+      co_return nullptr;
+    }
+    if (::connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+      int saved_errno = errno;
+      close(sockfd);
+      errno = saved_errno;
+      co_return nullptr;
+    }
+    struct sockaddr_in6 peer;
+    memset(&peer, 0, sizeof(peer));
+    peer.sin6_family = AF_UNIX;
+    co_return std::unique_ptr<AsyncClient>(new AsyncClient(sockfd, peer));
+  }
+  ResolveAwaiter lookup{server, 0, {}};
+  int s = co_await lookup;
+  if (s != 0) {
+    fprintf(stderr, "TCPAsyncClient resolve: %s\n", gai_strerror(s));
+    errno = EHOSTUNREACH;
+    co_return nullptr;
+  }
+
+  // try every address in order (IPv6 first)
+  struct sockaddr_in6 addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin6_family = AF_INET6;
+  addr.sin6_port = htons(port_no);
+  for (auto& address : lookup.addresses) {
+    addr.sin6_addr = address;
+    int sockfd =
+        socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) {
+      co_return nullptr;
+    }
+    bool connected = true;
+    if (::connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+      if (errno != EINPROGRESS) {
+        int saved_errno = errno;
+        close(sockfd);
+        errno = saved_errno;
+        continue;
+      }
+      connected = false;
+    }
+
+    std::unique_ptr<AsyncClient> client(new AsyncClient(sockfd, addr));
+    if (!connected) {
+      // writable once the handshake finishes (or fails)
+      client->writable = false;
+      co_await client->wait_writable();
+
+      int error = 0;
+      socklen_t error_len = sizeof(error);
+      if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0) {
+        error = errno;
+      }
+      if (error != 0) {
+        client.reset();
+        errno = error;
+        continue;
+      }
+    }
+    co_return client;
+  }
+  // errno is left from the last address
+  co_return nullptr;
+}
+
+}  // namespace tcp
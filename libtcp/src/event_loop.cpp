@@ -0,0 +1,366 @@
+#include "tcp/event_loop.hpp"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "tcp/io_uring.hpp"
+
+namespace tcp {
+
+#define MAX_EVENTS_PER_POLL 256
+#define IO_URING_ENTRIES 256
+
+// io_uring user_data: generation << 32 | fd << 8 | request kind
+enum request_kind : uint64_t {
+  PollRequest = 1,
+  AcceptRequest = 2,
+  CancelRequest = 3
+};
+
+static uint64_t make_request(request_kind kind, int fd, uint32_t generation) {
+  return ((uint64_t)generation << 32) | ((uint64_t)(fd & 0xffffff) << 8) |
+         kind;
+}
+
+EventLoop::EventLoop(bool use_io_uring)
+    : epoll_fd(-1),
+      ring(),
+      watches(),
+      next_generation(0),
+      dispatching(false),
+      retired(),
+      timers() {
+  if (use_io_uring) {
+    ring.reset(new IoUring(IO_URING_ENTRIES));
+    if (ring->ok()) {
+      return;
+    }
+    // not supported (or not allowed) here, use epoll instead
+    ring.reset();
+  }
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    perror("TCPEventLoop epoll_create1");
+    exit(EXIT_FAILURE);
+  }
+}
+
+EventLoop::~EventLoop() {
+  // closing the ring cancels every outstanding request
+  ring.reset();
+  if (epoll_fd >= 0 && close(epoll_fd) < 0) {
+    perror("TCPEventLoop close");
+  }
+}
+
+// fresh watch for fd, retiring the old one if it may still be running
+EventLoop::Watch& EventLoop::watch(int fd) {
+  auto& slot = watches[fd];
+  if (slot) {
+    // the fd number was reused before a pending removal was flushed
+    removed.erase(std::remove(removed.begin(), removed.end(), fd),
+                  removed.end());
+    if (dispatching) {
+      retired.push_back(std::move(slot));
+    }
+  }
+  slot.reset(new Watch());
+  return *slot;
+}
+
+int EventLoop::add(int fd, uint32_t events, EventCallback callback) {
+  auto it = watches.find(fd);
+  if (it != watches.end() && !it->second->removed) {
+    errno = EEXIST;
+    return -1;
+  }
+
+  if (!ring) {
+    struct epoll_event ev;
+    ev.events = events | EPOLLET;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      return -1;
+    }
+  }
+
+  Watch& w = watch(fd);
+  w.callback = std::move(callback);
+  w.events = events | EPOLLET;
+  if (ring && arm_poll(fd, w) < 0) {
+    int saved_errno = errno;
+    watches.erase(fd);
+    errno = saved_errno;
+    return -1;
+  }
+  return 0;
+}
+
+int EventLoop::add_acceptor(int fd, AcceptCallback callback) {
+  auto it = watches.find(fd);
+  if (it != watches.end() && !it->second->removed) {
+    errno = EEXIST;
+    return -1;
+  }
+
+  // readiness based accept (epoll, or io_uring without multishot accept)
+  EventCallback drain = [fd, callback](uint32_t) {
+    while (true) {
+      struct sockaddr_in6 addr;
+      socklen_t addr_len = sizeof(addr);
+      int client_fd = accept4(fd, (struct sockaddr*)&addr, &addr_len,
+                              SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (client_fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) {
+          continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          perror("TCPEventLoop accept");
+        }
+        return;
+      }
+      callback(client_fd, &addr);
+    }
+  };
+
+  if (!ring) {
+    return add(fd, EPOLLIN, std::move(drain));
+  }
+
+  Watch& w = watch(fd);
+  w.callback = std::move(drain);
+  w.on_accept = std::move(callback);
+  w.events = EPOLLIN | EPOLLET;
+  if (arm_accept(fd, w) < 0) {
+    int saved_errno = errno;
+    watches.erase(fd);
+    errno = saved_errno;
+    return -1;
+  }
+  return 0;
+}
+
+int EventLoop::modify(int fd, uint32_t events) {
+  auto it = watches.find(fd);
+  if (it == watches.end() || it->second->removed) {
+    errno = ENOENT;
+    return -1;
+  }
+  Watch& w = *it->second;
+  w.events = events | EPOLLET;
+
+  if (!ring) {
+    struct epoll_event ev;
+    ev.events = w.events;
+    ev.data.fd = fd;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+  }
+
+  // replace the poll request, completions of the old one are now stale
+  if (cancel(fd, w) < 0) {
+    return -1;
+  }
+  return arm_poll(fd, w);
+}
+
+int EventLoop::remove(int fd) {
+  auto it = watches.find(fd);
+  if (it == watches.end() || it->second->removed) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  int ret;
+  if (ring) {
+    ret = cancel(fd, *it->second);
+  } else {
+    // closed fds are dropped from the interest list automatically
+    ret = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    if (ret < 0 && errno == EBADF) {
+      ret = 0;
+    }
+  }
+
+  if (dispatching) {
+    // the callback may be the one currently running
+    it->second->removed = true;
+    removed.push_back(fd);
+  } else {
+    watches.erase(it);
+  }
+  return ret;
+}
+
+int EventLoop::poll(int timeout_ms) {
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(timeout_ms);
+  while (true) {
+    // wake up early for the timers
+    int wait_ms = timeout_ms;
+    int timer_ms = timers.next_timeout_ms();
+    if (timer_ms >= 0 && (wait_ms < 0 || timer_ms < wait_ms)) {
+      wait_ms = timer_ms;
+    }
+
+    int n = ring ? poll_io_uring(wait_ms) : poll_epoll(wait_ms);
+    flush_removed();
+    if (n < 0) {
+      return n;
+    }
+    n += timers.advance();
+    flush_removed();
+    if (n > 0 || wait_ms == timeout_ms) {
+      return n;
+    }
+
+    // only a cascade was due, keep waiting out the caller's timeout
+    if (timeout_ms >= 0) {
+      auto left = std::chrono::ceil<std::chrono::milliseconds>(
+          deadline - std::chrono::steady_clock::now());
+      if (left.count() <= 0) {
+        return 0;
+      }
+      timeout_ms = left.count();
+    }
+  }
+}
+
+int EventLoop::poll_epoll(int timeout_ms) {
+  struct epoll_event events[MAX_EVENTS_PER_POLL];
+  int n = epoll_wait(epoll_fd, events, MAX_EVENTS_PER_POLL, timeout_ms);
+  if (n <= 0) {
+    return n;
+  }
+
+  dispatching = true;
+  for (int i = 0; i < n; i++) {
+    auto it = watches.find(events[i].data.fd);
+    // skip fds removed earlier in this batch
+    if (it == watches.end() || it->second->removed) {
+      continue;
+    }
+    it->second->callback(events[i].events);
+  }
+  dispatching = false;
+
+  return n;
+}
+
+int EventLoop::poll_io_uring(int timeout_ms) {
+  // requests queued since the last poll go out with the wait
+  int ret = ring->submit_and_wait(timeout_ms);
+  if (ret <= 0) {
+    return ret;
+  }
+
+  dispatching = true;
+  unsigned int n = ring->reap([this](const struct io_uring_cqe* cqe) {
+    complete(cqe->user_data, cqe->res, cqe->flags);
+  });
+  dispatching = false;
+
+  return n;
+}
+
+int EventLoop::arm_poll(int fd, Watch& w) {
+  struct io_uring_sqe* sqe = ring->get_sqe();
+  if (sqe == nullptr) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->poll32_events = w.events;
+  sqe->user_data = make_request(PollRequest, fd, next_generation++);
+  w.request = sqe->user_data;
+  return 0;
+}
+
+int EventLoop::arm_accept(int fd, Watch& w) {
+  struct io_uring_sqe* sqe = ring->get_sqe();
+  if (sqe == nullptr) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = make_request(AcceptRequest, fd, next_generation++);
+  w.request = sqe->user_data;
+  return 0;
+}
+
+int EventLoop::cancel(int fd, const Watch& w) {
+  struct io_uring_sqe* sqe = ring->get_sqe();
+  if (sqe == nullptr) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = w.request;
+  sqe->user_data = make_request(CancelRequest, fd, 0);
+  return 0;
+}
+
+void EventLoop::complete(uint64_t user_data, int32_t res, uint32_t flags) {
+  request_kind kind = (request_kind)(user_data & 0xff);
+  int fd = (user_data >> 8) & 0xffffff;
+  if (kind == CancelRequest) {
+    return;
+  }
+
+  auto it = watches.find(fd);
+  // completions of removed or replaced requests are stale
+  if (it == watches.end() || it->second->removed ||
+      it->second->request != user_data) {
+    return;
+  }
+  Watch& w = *it->second;
+  // multishot requests end on errors and overflow, re-arm them
+  bool rearm = !(flags & IORING_CQE_F_MORE) && res != -ECANCELED;
+
+  if (kind == AcceptRequest) {
+    if (res == -EINVAL) {
+      // no multishot accept in this kernel, fall back to readiness
+      if (arm_poll(fd, w) == 0) {
+        w.callback(EPOLLIN);
+      }
+      return;
+    }
+    if (rearm && arm_accept(fd, w) < 0) {
+      perror("TCPEventLoop io_uring");
+    }
+    if (res >= 0) {
+      w.on_accept(res, nullptr);
+    } else if (res != -ECANCELED && res != -EAGAIN && res != -EINTR) {
+      errno = -res;
+      perror("TCPEventLoop accept");
+    }
+    return;
+  }
+
+  if (rearm && arm_poll(fd, w) < 0) {
+    perror("TCPEventLoop io_uring");
+  }
+  if (res == -ECANCELED) {
+    return;
+  }
+  w.callback(res >= 0 ? (uint32_t)res : EPOLLERR);
+}
+
+void EventLoop::flush_removed() {
+  for (int fd : removed) {
+    watches.erase(fd);
+  }
+  removed.clear();
+  retired.clear();
+}
+
+}  // namespace tcp
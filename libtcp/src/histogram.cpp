@@ -0,0 +1,62 @@
+#include "tcp/histogram.hpp"
+
+#include <math.h>
+
+namespace tcp {
+
+unsigned int Histogram::bucket_of(unsigned long value) {
+  if (value >= 1UL << MAX_BITS) {
+    value = (1UL << MAX_BITS) - 1;
+  }
+  if (value < SUB_BUCKETS) {
+    return value;
+  }
+  // the top bit picks the group, the next SUB_BUCKET_BITS the sub-bucket
+  unsigned int top = 63 - __builtin_clzl(value);
+  unsigned int shift = top - SUB_BUCKET_BITS;
+  return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+unsigned long Histogram::bucket_limit(unsigned int bucket) {
+  if (bucket < SUB_BUCKETS) {
+    return bucket;
+  }
+  unsigned int shift = bucket / SUB_BUCKETS - 1;
+  unsigned long lowest = (unsigned long)(SUB_BUCKETS + bucket % SUB_BUCKETS)
+                         << shift;
+  return lowest + (1UL << shift) - 1;
+}
+
+void HistogramSnapshot::add(const Histogram& histogram) {
+  for (unsigned int i = 0; i < Histogram::BUCKETS; i++) {
+    unsigned long count =
+        histogram.counts[i].load(std::memory_order_relaxed);
+    counts[i] += count;
+    total += count;
+  }
+}
+
+unsigned long HistogramSnapshot::percentile(double fraction) const {
+  if (total == 0) {
+    return 0;
+  }
+  unsigned long rank = ceil(fraction * total);
+  if (rank == 0) {
+    rank = 1;
+  }
+  unsigned long seen = 0;
+  for (unsigned int i = 0; i < Histogram::BUCKETS; i++) {
+    seen += counts[i];
+    if (seen >= rank) {
+      return Histogram::bucket_limit(i);
+    }
+  }
+  return Histogram::bucket_limit(Histogram::BUCKETS - 1);
+}
+
+Percentiles HistogramSnapshot::percentiles() const {
+  return {total, percentile(0.5), percentile(0.99), percentile(0.999),
+          percentile(1.0)};
+}
+
+}  // namespace tcp
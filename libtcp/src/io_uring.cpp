@@ -0,0 +1,194 @@
+#include "tcp/io_uring.hpp"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace tcp {
+
+IoUring::IoUring(unsigned int entries)
+    : ring_fd(-1),
+      sq_ring(MAP_FAILED),
+      sq_ring_size(0),
+      sq_head(nullptr),
+      sq_tail(nullptr),
+      sq_mask(nullptr),
+      sq_array(nullptr),
+      sq_entries(0),
+      sqes((struct io_uring_sqe*)MAP_FAILED),
+      sqes_size(0),
+      sqe_tail(0),
+      cq_ring(MAP_FAILED),
+      cq_ring_size(0),
+      cq_head(nullptr),
+      cq_tail(nullptr),
+      cq_mask(nullptr),
+      cqes(nullptr) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  // multishot requests post many completions per submission
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = entries * 4;
+  int fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd < 0) {
+    return;
+  }
+
+  // timeouts on io_uring_enter and overflow-safe completions are required
+  if (!(params.features & IORING_FEAT_EXT_ARG) ||
+      !(params.features & IORING_FEAT_NODROP)) {
+    close(fd);
+    errno = ENOTSUP;
+    return;
+  }
+
+  sq_ring_size =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap && cq_ring_size > sq_ring_size) {
+    sq_ring_size = cq_ring_size;
+  }
+
+  sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED) {
+    close(fd);
+    return;
+  }
+  if (single_mmap) {
+    cq_ring = sq_ring;
+  } else {
+    cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED) {
+      munmap(sq_ring, sq_ring_size);
+      sq_ring = MAP_FAILED;
+      close(fd);
+      return;
+    }
+  }
+
+  sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = (struct io_uring_sqe*)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, fd,
+                                    IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    if (cq_ring != sq_ring) {
+      munmap(cq_ring, cq_ring_size);
+    }
+    munmap(sq_ring, sq_ring_size);
+    sq_ring = cq_ring = MAP_FAILED;
+    close(fd);
+    return;
+  }
+
+  char* sq = (char*)sq_ring;
+  sq_head = (unsigned int*)(sq + params.sq_off.head);
+  sq_tail = (unsigned int*)(sq + params.sq_off.tail);
+  sq_mask = (unsigned int*)(sq + params.sq_off.ring_mask);
+  sq_array = (unsigned int*)(sq + params.sq_off.array);
+  sq_entries = params.sq_entries;
+  sqe_tail = *sq_tail;
+
+  char* cq = (char*)cq_ring;
+  cq_head = (unsigned int*)(cq + params.cq_off.head);
+  cq_tail = (unsigned int*)(cq + params.cq_off.tail);
+  cq_mask = (unsigned int*)(cq + params.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  ring_fd = fd;
+}
+
+IoUring::~IoUring() {
+  if (sqes != MAP_FAILED) {
+    munmap(sqes, sqes_size);
+  }
+  if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+    munmap(cq_ring, cq_ring_size);
+  }
+  if (sq_ring != MAP_FAILED) {
+    munmap(sq_ring, sq_ring_size);
+  }
+  if (ring_fd >= 0 && close(ring_fd) < 0) {
+    perror("TCPIoUring close");
+  }
+}
+
+struct io_uring_sqe* IoUring::get_sqe() {
+  unsigned int head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+  if (sqe_tail - head >= sq_entries) {
+    // ring is full, hand what we have to the kernel first
+    if (enter(0, 0, -1) < 0) {
+      return nullptr;
+    }
+    head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (sqe_tail - head >= sq_entries) {
+      errno = EBUSY;
+      return nullptr;
+    }
+  }
+  unsigned int index = sqe_tail & *sq_mask;
+  struct io_uring_sqe* sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array[index] = index;
+  sqe_tail++;
+  return sqe;
+}
+
+int IoUring::enter(unsigned int min_complete, unsigned int flags,
+                   int timeout_ms) {
+  // publish the queued entries
+  __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+  unsigned int to_submit =
+      sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.sigmask_sz = _NSIG / 8;
+  if (timeout_ms >= 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    arg.ts = (unsigned long)&ts;
+  }
+
+  return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                 flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+int IoUring::submit_and_wait(int timeout_ms) {
+  unsigned int head = *cq_head;
+  if (__atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) != head) {
+    // completions are already waiting, just submit
+    return enter(0, 0, -1) < 0 ? -1 : 1;
+  }
+  unsigned int min_complete = timeout_ms == 0 ? 0 : 1;
+  int ret = enter(min_complete, IORING_ENTER_GETEVENTS, timeout_ms);
+  if (ret < 0) {
+    return errno == ETIME ? 0 : -1;
+  }
+  return __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) != *cq_head ? 1 : 0;
+}
+
+unsigned int IoUring::reap(const CompletionCallback& callback) {
+  unsigned int head = *cq_head;
+  unsigned int tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+  unsigned int count = 0;
+  while (head != tail) {
+    callback(&cqes[head & *cq_mask]);
+    head++;
+    count++;
+    // release the slot right away, the callback may queue more work
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  }
+  return count;
+}
+
+}  // namespace tcp
@@ -0,0 +1,129 @@
+#include "tcp/metrics.hpp"
+
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <new>
+
+namespace tcp {
+
+int MetricsRegistry::create(const char* name, unsigned int num_slots) {
+  if (MetricsSegment::create(name, sizeof(Shard), num_slots) < 0) {
+    return -1;
+  }
+  new (shard(0)) Shard[shard_count()]();
+  return 0;
+}
+
+int MetricsRegistry::attach(const char* name) {
+  return MetricsSegment::attach(name, sizeof(Shard));
+}
+
+Metrics MetricsRegistry::snapshot() const {
+  Metrics metrics = {};
+  for (unsigned int i = 0; i < shard_count(); i++) {
+    const Shard& shard = *(const Shard*)this->shard(i);
+    metrics.accepts += shard.accepts.load(std::memory_order_relaxed);
+    metrics.drops += shard.drops.load(std::memory_order_relaxed);
+    metrics.active += shard.active.load(std::memory_order_relaxed);
+    metrics.closed += shard.closed.load(std::memory_order_relaxed);
+    metrics.bytes_in += shard.bytes_in.load(std::memory_order_relaxed);
+    metrics.bytes_out += shard.bytes_out.load(std::memory_order_relaxed);
+    metrics.handler_calls +=
+        shard.handler_calls.load(std::memory_order_relaxed);
+    metrics.handler_ns += shard.handler_ns.load(std::memory_order_relaxed);
+    metrics.queued += shard.queued.load(std::memory_order_relaxed);
+    metrics.queue_timeouts +=
+        shard.queue_timeouts.load(std::memory_order_relaxed);
+    metrics.queue_ns += shard.queue_ns.load(std::memory_order_relaxed);
+  }
+  return metrics;
+}
+
+void MetricsRegistry::accepted() const {
+  local().accepts.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MetricsRegistry::dropped() const {
+  local().drops.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MetricsRegistry::opened() const {
+  local().active.fetch_add(1, std::memory_order_relaxed);
+}
+
+// TCP_INFO fills in as much of the struct as the kernel knows
+#define HAS_FIELD(len, field) \
+  ((len) >= offsetof(struct tcp_info, field) + sizeof(tcp_info::field))
+
+static unsigned long nanoseconds(std::chrono::steady_clock::duration time) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(time).count();
+}
+
+void MetricsRegistry::closed(const Client& client, unsigned int slot) const {
+  unsigned int index = local_shard();
+  Shard& shard = *(Shard*)this->shard(index);
+  unsigned long lifetime = nanoseconds(std::chrono::steady_clock::now() -
+                                       client.opened_at());
+  bool wrote =
+      client.first_write_at() != std::chrono::steady_clock::time_point();
+  long first_byte =
+      wrote ? nanoseconds(client.first_write_at() - client.opened_at()) : -1;
+  long bytes_per_sec = -1;
+
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+  if (getsockopt(client.get_fd(), IPPROTO_TCP, TCP_INFO, &info, &len) == 0 &&
+      HAS_FIELD(len, tcpi_bytes_received)) {
+    shard.bytes_in.fetch_add(info.tcpi_bytes_received,
+                             std::memory_order_relaxed);
+    // everything written, whether or not the peer acked it yet
+    unsigned long bytes_out =
+        HAS_FIELD(len, tcpi_bytes_retrans)
+            ? info.tcpi_bytes_sent - info.tcpi_bytes_retrans +
+                  info.tcpi_notsent_bytes
+            : info.tcpi_bytes_acked;
+    shard.bytes_out.fetch_add(bytes_out, std::memory_order_relaxed);
+    if (wrote && bytes_out > 0) {
+      bytes_per_sec = bytes_out * 1e9 / (lifetime + 1);
+    }
+  }
+  record_session(index, slot, lifetime, first_byte, bytes_per_sec);
+  // wraps below zero on a shard other than the one it was opened on
+  shard.active.fetch_sub(1, std::memory_order_relaxed);
+  shard.closed.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MetricsRegistry::handled(std::chrono::steady_clock::duration time) const {
+  Shard& shard = local();
+  shard.handler_calls.fetch_add(1, std::memory_order_relaxed);
+  shard.handler_ns.fetch_add(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(time).count(),
+      std::memory_order_relaxed);
+}
+
+void MetricsRegistry::queued() const {
+  local().queued.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MetricsRegistry::admitted(std::chrono::steady_clock::duration wait) const {
+  local().queue_ns.fetch_add(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(wait).count(),
+      std::memory_order_relaxed);
+}
+
+void MetricsRegistry::expired() const {
+  local().queue_timeouts.fetch_add(1, std::memory_order_relaxed);
+}
+
+int MetricsRegistry::read(const char* name, Metrics& metrics) {
+  MetricsRegistry registry;
+  if (registry.attach(name) < 0) {
+    return -1;
+  }
+  metrics = registry.snapshot();
+  return 0;
+}
+
+}  // namespace tcp
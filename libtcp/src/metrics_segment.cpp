@@ -0,0 +1,242 @@
+#include "tcp/metrics_segment.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <new>
+
+namespace tcp {
+
+// histogram sets of a shard
+#define LIFETIME 0
+#define FIRST_BYTE 1
+#define BYTES_PER_SEC 2
+
+// the header gets cache lines of its own so it never shares one with a
+// shard
+size_t MetricsSegment::shard_offset() const {
+  return (sizeof(Header) + shard_size - 1) / shard_size * shard_size;
+}
+
+// Histogram is a whole number of cache lines, so the histograms that
+// follow the shards stay aligned
+size_t MetricsSegment::size_of(unsigned int num_shards) const {
+  return shard_offset() + num_shards * shard_size +
+         (size_t)num_shards * histograms_per_shard() * sizeof(Histogram);
+}
+
+int MetricsSegment::map(int fd, bool writable) {
+  int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+  int flags = MAP_SHARED | (fd < 0 ? MAP_ANONYMOUS : 0);
+  segment = mmap(nullptr, segment_size, prot, flags, fd, 0);
+  if (segment == MAP_FAILED) {
+    segment = nullptr;
+    return -1;
+  }
+  shards = (char*)segment + shard_offset();
+  return 0;
+}
+
+int MetricsSegment::create(const char* name, size_t shard_size,
+                           unsigned int num_slots) {
+  destroy();
+  long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+  num_shards = num_cpus > 0 ? num_cpus : 1;
+  this->shard_size = shard_size;
+  this->num_slots = num_slots > 0 ? num_slots : 1;
+  segment_size = size_of(num_shards);
+
+  int fd = -1;
+  if (name != nullptr) {
+    fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      return -1;
+    }
+    if (ftruncate(fd, segment_size) < 0) {
+      int error = errno;
+      close(fd);
+      shm_unlink(name);
+      errno = error;
+      return -1;
+    }
+    this->name = name;
+    owner = getpid();
+  }
+  int ret = map(fd, true);
+  int error = errno;
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (ret < 0) {
+    destroy();
+    errno = error;
+    return -1;
+  }
+
+  Header* header = new (segment) Header();
+  header->num_shards = num_shards;
+  header->num_slots = this->num_slots;
+  header->shard_size = shard_size;
+  histograms = new (shards + num_shards * shard_size)
+      Histogram[(size_t)num_shards * histograms_per_shard()]();
+  return 0;
+}
+
+int MetricsSegment::attach(const char* name, size_t shard_size) {
+  destroy();
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+  }
+  this->shard_size = shard_size;
+  if ((size_t)st.st_size < shard_offset()) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+  segment_size = st.st_size;
+  int ret = map(fd, false);
+  int error = errno;
+  close(fd);
+  if (ret < 0) {
+    errno = error;
+    return -1;
+  }
+  // never trust the header past the end of the segment
+  const Header* header = (const Header*)segment;
+  num_shards = header->num_shards;
+  num_slots = header->num_slots;
+  if (header->shard_size != shard_size || num_shards == 0 ||
+      num_slots == 0 || size_of(num_shards) > segment_size) {
+    destroy();
+    errno = EINVAL;
+    return -1;
+  }
+  histograms = (Histogram*)(shards + num_shards * shard_size);
+  return 0;
+}
+
+void MetricsSegment::destroy() {
+  if (segment != nullptr) {
+    munmap(segment, segment_size);
+  }
+  if (owner == getpid()) {
+    shm_unlink(name.c_str());
+  }
+  segment = nullptr;
+  segment_size = 0;
+  shards = nullptr;
+  shard_size = 0;
+  num_shards = 0;
+  histograms = nullptr;
+  num_slots = 0;
+  name.clear();
+  owner = -1;
+}
+
+// sched_getcpu is a vDSO call, and a thread that migrates between the
+// read and the add only costs a shared cache line
+unsigned int MetricsSegment::local_shard() const {
+  int cpu = sched_getcpu();
+  return cpu >= 0 ? cpu % num_shards : 0;
+}
+
+void MetricsSegment::record_session(unsigned int index, unsigned int slot,
+                                    unsigned long lifetime_ns,
+                                    long first_byte_ns,
+                                    long bytes_per_sec) const {
+  if (slot >= num_slots) {
+    return;
+  }
+  Histogram* session = histograms + index * histograms_per_shard() +
+                       slot * SESSION_HISTOGRAMS;
+  session[LIFETIME].record(lifetime_ns);
+  if (first_byte_ns >= 0) {
+    session[FIRST_BYTE].record(first_byte_ns);
+  }
+  if (bytes_per_sec >= 0) {
+    session[BYTES_PER_SEC].record(bytes_per_sec);
+  }
+}
+
+int MetricsSegment::phase(const char* name) const {
+  if (shards == nullptr) {
+    return -1;
+  }
+  Phase* phases = ((Header*)segment)->phases;
+  for (unsigned int i = 0; i < MAX_PHASES; i++) {
+    unsigned int state = phases[i].state.load(std::memory_order_acquire);
+    if (state == 0) {
+      // claim the free phase, or see what took it first
+      if (phases[i].state.compare_exchange_strong(state, 1,
+                                                  std::memory_order_acquire)) {
+        strncpy(phases[i].name, name, PHASE_NAME_SIZE - 1);
+        phases[i].state.store(2, std::memory_order_release);
+        return i;
+      }
+    }
+    // another process is writing the name
+    while (state == 1) {
+      sched_yield();
+      state = phases[i].state.load(std::memory_order_acquire);
+    }
+    if (strncmp(phases[i].name, name, PHASE_NAME_SIZE - 1) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void MetricsSegment::timed(int phase,
+                           std::chrono::steady_clock::duration time) const {
+  histograms[local_shard() * histograms_per_shard() +
+             num_slots * SESSION_HISTOGRAMS + phase]
+      .record(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(time).count());
+}
+
+HistogramSnapshot MetricsSegment::merge(unsigned int index) const {
+  HistogramSnapshot snapshot;
+  for (unsigned int i = 0; i < num_shards; i++) {
+    snapshot.add(histograms[i * histograms_per_shard() + index]);
+  }
+  return snapshot;
+}
+
+HandlerLatency MetricsSegment::latency(unsigned int slot) const {
+  if (slot >= num_slots) {
+    return {};
+  }
+  unsigned int first = slot * SESSION_HISTOGRAMS;
+  return {merge(first + LIFETIME).percentiles(),
+          merge(first + FIRST_BYTE).percentiles(),
+          merge(first + BYTES_PER_SEC).percentiles()};
+}
+
+Percentiles MetricsSegment::phase_latency(const char* name) const {
+  if (shards == nullptr) {
+    return {};
+  }
+  const Phase* phases = ((Header*)segment)->phases;
+  for (unsigned int i = 0; i < MAX_PHASES; i++) {
+    if (phases[i].state.load(std::memory_order_acquire) == 2 &&
+        strncmp(phases[i].name, name, PHASE_NAME_SIZE - 1) == 0) {
+      return merge(num_slots * SESSION_HISTOGRAMS + i).percentiles();
+    }
+  }
+  return {};
+}
+
+}  // namespace tcp
@@ -0,0 +1,76 @@
+#include "tcp/read_buffer.hpp"
+
+#include <string.h>
+#include <unistd.h>
+
+namespace tcp {
+
+void ReadBuffer::consume(size_t n) {
+  start += n;
+  if (start >= end) {
+    start = end = 0;
+  }
+}
+
+size_t ReadBuffer::take(void* dest, size_t len) {
+  if (len > size()) {
+    len = size();
+  }
+  memcpy(dest, data(), len);
+  consume(len);
+  return len;
+}
+
+void ReadBuffer::reserve() {
+  if (!buffer) {
+    buffer.reset(new char[capacity]);
+    return;
+  }
+  if (end < capacity) {
+    return;
+  }
+  // reuse the consumed space at the front before growing
+  if (start > 0) {
+    memmove(buffer.get(), buffer.get() + start, end - start);
+    end -= start;
+    start = 0;
+    return;
+  }
+  char* grown = new char[capacity * 2];
+  memcpy(grown, buffer.get(), end);
+  buffer.reset(grown);
+  capacity *= 2;
+}
+
+ssize_t ReadBuffer::fill(int fd) {
+  reserve();
+  ssize_t n = ::read(fd, buffer.get() + end, capacity - end);
+  if (n > 0) {
+    end += n;
+  }
+  return n;
+}
+
+size_t ReadBuffer::find(const char* delim, size_t delim_len,
+                        size_t from) const {
+  if (delim_len == 0 || size() < delim_len) {
+    return npos;
+  }
+  const char* begin = data();
+  const char* last = begin + size() - delim_len;
+  const char* p = begin + from;
+  // memchr is vectorized in libc, so scan for the first delimiter byte
+  while (p <= last) {
+    p = (const char*)memchr(p, delim[0], last - p + 1);
+    if (p == nullptr) {
+      return npos;
+    }
+    if (memcmp(p + 1, delim + 1, delim_len - 1) == 0) {
+      return p - begin;
+    }
+    p++;
+  }
+  return npos;
+}
+
+}  // namespace tcp
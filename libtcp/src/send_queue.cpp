@@ -0,0 +1,74 @@
+#include "tcp/send_queue.hpp"
+
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+
+namespace tcp {
+
+// small messages are appended to the last chunk instead of getting their
+// own, so a burst of short lines stays one iovec
+#define SEND_CHUNK_SIZE 16384
+
+void SendQueue::push(const void* data, size_t len) {
+  if (len == 0) {
+    return;
+  }
+  if (!chunks.empty() && chunks.back().size() + len <= SEND_CHUNK_SIZE) {
+    chunks.back().append((const char*)data, len);
+  } else {
+    chunks.emplace_back((const char*)data, len);
+  }
+  total += len;
+}
+
+ssize_t SendQueue::flush(int fd) {
+  size_t n = 0;
+  while (!chunks.empty()) {
+    struct iovec iov[64];
+    size_t count = std::min(chunks.size(), sizeof(iov) / sizeof(iov[0]));
+    for (size_t i = 0; i < count; i++) {
+      size_t skip = i == 0 ? offset : 0;
+      iov[i].iov_base = (char*)chunks[i].data() + skip;
+      iov[i].iov_len = chunks[i].size() - skip;
+    }
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+
+    // the peer going away is reported as EPIPE rather than SIGPIPE
+    ssize_t n_sent = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n_sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return n == 0 ? -1 : (ssize_t)n;
+    }
+    n += n_sent;
+    total -= n_sent;
+
+    // drop the chunks that went out completely
+    size_t left = n_sent;
+    while (left > 0 && left >= chunks.front().size() - offset) {
+      left -= chunks.front().size() - offset;
+      chunks.pop_front();
+      offset = 0;
+    }
+    offset += left;
+  }
+  return n;
+}
+
+void SendQueue::clear() {
+  chunks.clear();
+  offset = 0;
+  total = 0;
+}
+
+}  // namespace tcp
@@ -1,24 +1,92 @@
 #include "tcp/server.hpp"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <new>
 #include <stdexcept>
 #include <thread>
 
+#include "tcp/coroutine.hpp"
 #include "tcp/error.hpp"
+#include "tcp/event_loop.hpp"
 
 namespace tcp {
 
-Server::~Server() { stop(true); }
+// ms between checks while waiting for clients to finish
+#define DRAIN_POLL_INTERVAL 10
+// ms past the drain timeout before a server or its clients are killed
+#define DRAIN_GRACE_PERIOD 1000
+// most listeners a replacement server can take over
+#define MAX_HANDOFF_FDS 64
+// drain() was not called, the server drains for drain_timeout
+#define DEFAULT_DRAIN UINT_MAX
+
+// SIGTERM handlers can only reach globals
+static int signal_stop_fd = -1;
+static pid_t signal_forward_pid = -1;
+static volatile sig_atomic_t worker_stopping = 0;
+
+// wake every acceptor polling stop_fd (async-signal-safe)
+static void notify_stop(int stop_fd) {
+  uint64_t one = 1;
+  ssize_t n = write(stop_fd, &one, sizeof(one));
+  (void)n;
+}
+
+static void drain_on_sigterm(int) {
+  int saved_errno = errno;
+  notify_stop(signal_stop_fd);
+  if (signal_forward_pid > 0) {
+    kill(signal_forward_pid, SIGTERM);
+  }
+  errno = saved_errno;
+}
+
+static void stop_worker_on_sigterm(int) { worker_stopping = 1; }
+
+// without restart, blocking calls return EINTR on SIGTERM
+static void handle_sigterm(void (*handler)(int), bool restart) {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handler;
+  action.sa_flags = restart ? SA_RESTART : 0;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGTERM, &action, nullptr) < 0) {
+    perror("TCPServer sigaction");
+  }
+}
+
+Server::~Server() {
+  stop(true);
+  if (shard_accepts != nullptr) {
+    munmap(shard_accepts, num_shard_counters * sizeof(AcceptCounter));
+  }
+  if (drain_state != nullptr) {
+    munmap(drain_state, sizeof(DrainState));
+  }
+}
 
 Server& Server::set_port(unsigned int port_no) {
   if (server_pid >= 0) {
@@ -32,6 +100,15 @@ Server& Server::set_ip_addr(const char* ip_addr) {
   if (server_pid >= 0) {
     throw ConfigurationError("Cannot set IP address while server is running");
   }
+  unix_path.clear();
+  if (*ip_addr == '/') {
+    if (strlen(ip_addr) >= sizeof(sockaddr_un::sun_path)) {
+      throw ConfigurationError("Unix socket path too long");
+    }
+    unix_path = ip_addr;
+    *server_ip_addr = '\0';
+    return *this;
+  }
   // copy the IP address (map to IPv6 if needed)
   bool is_ipv6 = false;
   for (auto p = ip_addr; *p; p++) {
@@ -73,6 +150,27 @@ Server& Server::set_backlog(unsigned int backlog) {
   return *this;
 }
 
+Server& Server::set_socket_options(const SocketOptions& options) {
+  if (server_pid >= 0) {
+    throw ConfigurationError(
+        "Cannot set socket options while server is running");
+  }
+  socket_options = options;
+  return *this;
+}
+
+Server& Server::set_acceptor_shards(unsigned int num_shards) {
+  if (server_pid >= 0) {
+    throw ConfigurationError(
+        "Cannot set acceptor shards while server is running");
+  }
+  if (num_shards == 0) {
+    throw ConfigurationError("Need at least one acceptor shard");
+  }
+  this->acceptor_shards = num_shards;
+  return *this;
+}
+
 Server& Server::debug(bool mode) {
   if (server_pid >= 0) {
     throw ConfigurationError("Cannot set debug mode while server is running");
@@ -87,7 +185,7 @@ Server& Server::set_timeout_handler(TimeoutFunction handler) {
     throw ConfigurationError(
         "Cannot set timeout handler while server is running");
   }
-  this->timeout_handler = handler;
+  this->timeout_handler = std::move(handler);
   return *this;
 }
 
@@ -101,11 +199,81 @@ Server& Server::use_threads() {
   return *this;
 }
 
+Server& Server::use_event_loop() {
+  if (server_pid >= 0) {
+    throw ConfigurationError(
+        "Cannot set use event loop while server is running");
+  }
+  client_handler.use_event_loop();
+  return *this;
+}
+
+Server& Server::use_coroutines(unsigned int num_threads) {
+  if (server_pid >= 0) {
+    throw ConfigurationError(
+        "Cannot set use coroutines while server is running");
+  }
+  if (num_threads == 0) {
+    throw ConfigurationError("Coroutines need at least one thread");
+  }
+  client_handler.use_coroutines(num_threads);
+  return *this;
+}
+
+Server& Server::use_io_uring() {
+  if (server_pid >= 0) {
+    throw ConfigurationError("Cannot set use io_uring while server is running");
+  }
+  io_uring = true;
+  return *this;
+}
+
+Server& Server::use_thread_pool(unsigned int num_workers) {
+  if (server_pid >= 0) {
+    throw ConfigurationError(
+        "Cannot set use thread pool while server is running");
+  }
+  if (num_workers == 0) {
+    throw ConfigurationError("Thread pool needs at least one worker");
+  }
+
+  client_handler.use_thread_pool(num_workers);
+  use_thread = true;
+  return *this;
+}
+
+Server& Server::use_prefork(unsigned int num_workers) {
+  if (server_pid >= 0) {
+    throw ConfigurationError("Cannot set use prefork while server is running");
+  }
+  if (num_workers == 0) {
+    throw ConfigurationError("Prefork needs at least one worker");
+  }
+  this->prefork_workers = num_workers;
+  return *this;
+}
+
 Server& Server::add_handler(ClientHandlerFunction handler) {
   if (server_pid >= 0) {
     throw ConfigurationError("Cannot add handler while server is running");
   }
-  client_handler.add_handler(handler);
+  client_handler.add_handler(std::move(handler));
+  return *this;
+}
+
+Server& Server::add_event_handler(EventHandlerFunction handler) {
+  if (server_pid >= 0) {
+    throw ConfigurationError("Cannot add handler while server is running");
+  }
+  client_handler.add_event_handler(std::move(handler));
+  return *this;
+}
+
+Server& Server::add_coroutine_handler(CoroutineHandlerFunction handler) {
+  if (server_pid >= 0) {
+    throw ConfigurationError("Cannot add handler while server is running");
+  }
+  client_handler.add_coroutine_handler(std::move(handler));
   return *this;
 }
 
@@ -125,6 +293,73 @@ Server& Server::set_max_clients(unsigned int max_clients) {
   return *this;
 }
 
+Server& Server::set_idle_timeout(unsigned int ms) {
+  if (server_pid >= 0) {
+    throw ConfigurationError("Cannot set idle timeout while server is running");
+  }
+  client_handler.set_idle_timeout(ms);
+  return *this;
+}
+
+Server& Server::set_read_timeout(unsigned int ms) {
+  if (server_pid >= 0) {
+    throw ConfigurationError("Cannot set read timeout while server is running");
+  }
+  client_handler.set_read_timeout(ms);
+  return *this;
+}
+
+Server& Server::set_write_timeout(unsigned int ms) {
+  if (server_pid >= 0) {
+    throw ConfigurationError(
+        "Cannot set write timeout while server is running");
+  }
+  client_handler.set_write_timeout(ms);
+  return *this;
+}
+
+Server& Server::set_admission_queue(
+    unsigned int size, unsigned int timeout_ms,
+    ClientHandler::admission_policy policy) {
+  if (server_pid >= 0) {
+    throw ConfigurationError(
+        "Cannot set admission queue while server is running");
+  }
+  client_handler.set_admission_queue(size, timeout_ms, policy);
+  return *this;
+}
+
+Server& Server::set_drain_timeout(unsigned int ms) {
+  if (server_pid >= 0) {
+    throw ConfigurationError(
+        "Cannot set drain timeout while server is running");
+  }
+  drain_timeout = ms;
+  return *this;
+}
+
+Server& Server::set_handoff_path(const char* path) {
+  if (server_pid >= 0) {
+    throw ConfigurationError("Cannot set handoff path while server is running");
+  }
+  if (strlen(path) >= sizeof(((struct sockaddr_un*)nullptr)->sun_path)) {
+    throw ConfigurationError("Handoff path too long");
+  }
+  handoff_path = path;
+  return *this;
+}
+
+Server& Server::set_metrics_name(const char* name) {
+  if (server_pid >= 0) {
+    throw ConfigurationError("Cannot set metrics name while server is running");
+  }
+  if (*name != '/' || strchr(name + 1, '/') != nullptr) {
+    throw ConfigurationError("Metrics name must be a single /name");
+  }
+  metrics_name = name;
+  return *this;
+}
+
 Server& Server::add_handler_extra_data(void* data) {
   if (server_pid >= 0) {
     throw ConfigurationError("Cannot set extra data while server is running");
@@ -138,34 +373,130 @@ pid_t Server::start() {
   if (server_pid >= 0) {
     throw ConfigurationError("Server already running");
   }
-  if (port_no == 0) {
+  if (port_no == 0 && unix_path.empty()) {
     throw ConfigurationError("Port number not set");
   }
+  if (!unix_path.empty() && acceptor_shards > 1) {
+    throw ConfigurationError("Acceptor shards need a TCP listener");
+  }
   if (backlog == 0) {
     throw ConfigurationError("Backlog not set");
   }
-  if (client_handler.handlers.size() == 0) {
+  if (client_handler.event_loop && client_handler.num_io_threads > 0) {
+    throw ConfigurationError("Cannot use both event loop and coroutines");
+  }
+  if (client_handler.event_loop) {
+    if (client_handler.event_handlers.size() == 0) {
+      throw ConfigurationError("No event handlers set");
+    }
+  } else if (client_handler.num_io_threads > 0) {
+    if (client_handler.coroutine_handlers.size() == 0) {
+      throw ConfigurationError("No coroutine handlers set");
+    }
+  } else if (client_handler.handlers.size() == 0) {
     throw ConfigurationError("No client handlers set");
   }
   if (client_handler.max_clients == 0) {
     throw ConfigurationError("Max clients not set");
   }
+  if (io_uring && !client_handler.event_loop &&
+      client_handler.num_io_threads == 0) {
+    throw ConfigurationError("io_uring needs the event loop or coroutines");
+  }
+  if (client_handler.idle_timeout > 0 && !client_handler.event_loop) {
+    throw ConfigurationError("Idle timeout needs the event loop");
+  }
+  if (client_handler.queue_size > 0 &&
+      (client_handler.event_loop || prefork_workers > 0)) {
+    throw ConfigurationError(
+        "Admission queue needs fork, thread or coroutine mode");
+  }
+  if (prefork_workers > 0) {
+    if (use_thread || client_handler.event_loop ||
+        client_handler.num_io_threads > 0) {
+      throw ConfigurationError("Prefork only works in fork mode");
+    }
+    if (max_timeouts > 0 || timeout_handler != nullptr) {
+      throw ConfigurationError("Prefork does not support timeouts");
+    }
+    if (!handoff_path.empty()) {
+      throw ConfigurationError("Prefork does not support handoffs");
+    }
+  }
+
+  // accept counters live in shared memory so a forked server can update them
+  if (shard_accepts != nullptr) {
+    munmap(shard_accepts, num_shard_counters * sizeof(AcceptCounter));
+  }
+  num_shard_counters = acceptor_shards;
+  void* counters = mmap(nullptr, num_shard_counters * sizeof(AcceptCounter),
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                        -1, 0);
+  if (counters == MAP_FAILED) {
+    perror("TCPServer mmap");
+    shard_accepts = nullptr;
+    num_shard_counters = 0;
+    return -1;
+  }
+  shard_accepts = new (counters) AcceptCounter[num_shard_counters]();
+
+  if (drain_state == nullptr) {
+    void* state = mmap(nullptr, sizeof(DrainState), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (state == MAP_FAILED) {
+      perror("TCPServer mmap");
+      return -1;
+    }
+    drain_state = new (state) DrainState();
+  }
+  drain_state->timeout_ms = DEFAULT_DRAIN;
+  drain_state->in_flight = 0;
+  drain_state->aborted = 0;
+  drain_state->handed_off = false;
+  drain_state->busy_workers = 0;
+
+  size_t num_handlers = client_handler.event_loop
+                            ? client_handler.event_handlers.size()
+                        : client_handler.num_io_threads > 0
+                            ? client_handler.coroutine_handlers.size()
+                            : client_handler.handlers.size();
+  if (client_handler.metrics.create(
+          metrics_name.empty() ? nullptr : metrics_name.c_str(),
+          num_handlers) < 0) {
+    perror("TCPServer metrics");
+    return -1;
+  }
+  if (client_handler.map_sessions(num_handlers) < 0) {
+    perror("TCPServer mmap");
+    return -1;
+  }
+
+  stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (stop_fd < 0) {
+    perror("TCPServer eventfd");
+    return -1;
+  }
 
   if (!use_thread) {
     server_pid = fork();
 
     if (server_pid < 0) {
       perror("TCPServer fork");
+      close(stop_fd);
+      stop_fd = -1;
       return server_pid;
     }
 
     if (server_pid == 0) {
+      signal_stop_fd = stop_fd;
+      signal_forward_pid = -1;
+      handle_sigterm(drain_on_sigterm, true);
       run_server();
       exit(EXIT_SUCCESS);
     }
   } else {
-    std::thread server_thread([this]() { run_server(); });
-    server_thread.detach();
+    server_pid = getpid();
+    server_thread = std::thread([this]() { run_server(); });
   }
 
   return server_pid;
@@ -173,33 +504,101 @@ pid_t Server::start() {
 
 void Server::exec() {
   auto pid = start();
-  if (use_thread) {
-    while (true) {
-      sleep(1000);
-    }
-  } else {
-    if (pid < 0) {
-      perror("TCPServer exec");
-      exit(EXIT_FAILURE);
-    }
+  if (pid < 0) {
+    perror("TCPServer exec");
+    exit(EXIT_FAILURE);
+  }
 
-    if (waitpid(pid, nullptr, 0) < 0) {
-      perror("TCPServer waitpid");
-    }
+  // SIGTERM drains the server, a forked one gets it passed on
+  signal_stop_fd = stop_fd;
+  signal_forward_pid = use_thread ? -1 : pid;
+  handle_sigterm(drain_on_sigterm, true);
+
+  if (use_thread) {
+    server_thread.join();
+  } else if (waitpid(pid, nullptr, 0) < 0) {
+    perror("TCPServer waitpid");
   }
   exit(EXIT_SUCCESS);
 }
 
-void Server::run_server() {
-  if (debug_mode) {
-    fprintf(stderr, "Starting server process pid: %d\n", getpid());
+// bind a unix socket to path, replacing the socket file of a server that
+// is no longer running (-1 on error)
+static int bind_unix(int sock_fd, const std::string& path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  if (bind(sock_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+    return 0;
+  }
+  if (errno != EADDRINUSE) {
+    return -1;
+  }
+
+  // only a refused connection shows nobody listens there anymore
+  int probe_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (probe_fd < 0) {
+    return -1;
+  }
+  int ret = connect(probe_fd, (struct sockaddr*)&addr, sizeof(addr));
+  int error = errno;
+  close(probe_fd);
+  if (ret == 0 || error != ECONNREFUSED) {
+    errno = EADDRINUSE;
+    return -1;
+  }
+  unlink(addr.sun_path);
+  return bind(sock_fd, (struct sockaddr*)&addr, sizeof(addr));
+}
+
+// create, bind and listen on a new socket (-1 on error)
+int Server::open_listener(bool reuse_port) {
+  if (!unix_path.empty()) {
+    int sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock_fd < 0) {
+      perror("TCPServer socket");
+      return -1;
+    }
+    if (bind_unix(sock_fd, unix_path) < 0) {
+      perror("TCPServer bind");
+      close(sock_fd);
+      return -1;
+    }
+    if (listen(sock_fd, backlog) < 0) {
+      perror("TCPServer listen");
+      close(sock_fd);
+      return -1;
+    }
+    return sock_fd;
   }
 
   // create a socket file descriptor for the server
-  server_sock_fd = socket(AF_INET6, SOCK_STREAM, 0);
-  if (server_sock_fd < 0) {
+  int sock_fd = socket(AF_INET6, SOCK_STREAM, 0);
+  if (sock_fd < 0) {
     perror("TCPServer socket");
-    exit(EXIT_FAILURE);
+    return -1;
+  }
+
+  // allow restarting while old connections are still in TIME_WAIT
+  int on = 1;
+  if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+    perror("TCPServer setsockopt SO_REUSEADDR");
+  }
+
+  if (reuse_port) {
+    // every shard binds the same address, the kernel balances between them
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+      perror("TCPServer setsockopt SO_REUSEPORT");
+      close(sock_fd);
+      return -1;
+    }
+  }
+
+  // buffer sizes have to be in place before listen() to affect the window
+  // scale, the kernel copies everything to accepted sockets
+  if (socket_options.apply(sock_fd, true) < 0) {
+    perror("TCPServer setsockopt");
   }
 
   struct sockaddr_in6 server_addr;
@@ -215,171 +614,934 @@ void Server::run_server() {
       } else {
         perror("TCPServer inet_pton");
       }
-      close(server_sock_fd);
-      exit(EXIT_FAILURE);
+      close(sock_fd);
+      return -1;
     }
   }
 
-  if (bind(server_sock_fd, (struct sockaddr*)&server_addr,
-           sizeof(server_addr)) < 0) {
+  if (bind(sock_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
     perror("TCPServer bind");
-    close(server_sock_fd);
-    exit(EXIT_FAILURE);
+    close(sock_fd);
+    return -1;
   }
 
-  if (listen(server_sock_fd, backlog) < 0) {
+  if (listen(sock_fd, backlog) < 0) {
     perror("TCPServer listen");
-    close(server_sock_fd);
-    exit(EXIT_FAILURE);
-  }
-
-  if (debug_mode) {
-    fprintf(stderr, "TCPServer started on port %d\n", port_no);
+    close(sock_fd);
+    return -1;
   }
 
-  while (true) {
-    client_handler.reap_clients();
-
-    if (timeout > 0) {
-      fd_set read_fds;
-      FD_ZERO(&read_fds);
-      FD_SET(server_sock_fd, &read_fds);
-
-      struct timeval tv;
-      tv.tv_sec = timeout;
-      tv.tv_usec = 0;
-
-      if (debug_mode) {
-        fprintf(stderr, "Waiting for up to %ds for a new connection\n",
-                timeout);
-      }
+  return sock_fd;
+}
 
-      int ret = select(server_sock_fd + 1, &read_fds, NULL, NULL, &tv);
-      if (ret < 0) {
-        perror("TCPServer select");
-        if (errno == EINTR) {
-          continue;
-        }
-        // stop server on error
-        break;
-      }
+// listeners of the server being replaced, passed over handoff_path
+std::vector<int> Server::take_over_listeners() {
+  std::vector<int> listener_fds;
+  int sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock_fd < 0) {
+    perror("TCPServer socket");
+    return listener_fds;
+  }
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, handoff_path.c_str(), sizeof(addr.sun_path) - 1);
+  if (connect(sock_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    // nobody to take over from
+    close(sock_fd);
+    return listener_fds;
+  }
 
-      if (ret == 0) {
-        if (debug_mode) {
-          fprintf(stderr, "TCPServer timeout\n");
-        }
+  uint32_t count = 0;
+  struct iovec iov = {&count, sizeof(count)};
+  union {
+    char buf[CMSG_SPACE(MAX_HANDOFF_FDS * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  ssize_t n;
+  do {
+    n = recvmsg(sock_fd, &msg, MSG_CMSG_CLOEXEC);
+  } while (n < 0 && errno == EINTR);
+  close(sock_fd);
+  if (n < 0) {
+    perror("TCPServer recvmsg");
+    return listener_fds;
+  }
 
-        timeout_count++;
-        // call timeout handler
-        if (timeout_handler != nullptr) {
-          if (debug_mode) {
-            fprintf(stderr, "Calling timeout handler\n");
-          }
-          timeout_handler();
-        }
-        if (max_timeouts > 0 && timeout_count >= max_timeouts) {
-          if (debug_mode) {
-            fprintf(stderr, "Max timeouts reached\n");
-          }
-          // stop server on max timeouts
-          break;
-        }
-        // continue waiting for connections
-        continue;
-      }
+  for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      size_t num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      listener_fds.resize(num_fds);
+      memcpy(listener_fds.data(), CMSG_DATA(cmsg), num_fds * sizeof(int));
+    }
+  }
+  // every shard needs its own listener
+  if (listener_fds.size() != count || count != acceptor_shards) {
+    fprintf(stderr, "TCPServer handoff: got %lu listeners for %u shards\n",
+            listener_fds.size(), acceptor_shards);
+    for (int fd : listener_fds) {
+      close(fd);
     }
+    listener_fds.clear();
+  } else if (debug_mode) {
+    fprintf(stderr, "Took over %u listeners from %s\n", count,
+            handoff_path.c_str());
+  }
+  return listener_fds;
+}
 
-    // socket is ready to accept a new connection
-    timeout_count = 0;
+// listen on handoff_path for the next replacement (-1 on error)
+int Server::open_handoff_socket() {
+  int sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock_fd < 0) {
+    perror("TCPServer socket");
+    return -1;
+  }
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, handoff_path.c_str(), sizeof(addr.sun_path) - 1);
+  // the socket of the server we replaced (or one that crashed)
+  unlink(addr.sun_path);
+  if (bind(sock_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(sock_fd, 1) < 0) {
+    perror("TCPServer handoff socket");
+    close(sock_fd);
+    return -1;
+  }
+  return sock_fd;
+}
 
-    // pass client to handler
-    client_handler.accept(server_sock_fd);
+void Server::hand_off(const std::vector<int>& listener_fds) {
+  int peer_fd = accept(handoff_fd, nullptr, nullptr);
+  if (peer_fd < 0) {
+    perror("TCPServer accept");
+    return;
+  }
+
+  uint32_t count = listener_fds.size();
+  struct iovec iov = {&count, sizeof(count)};
+  std::vector<char> control(CMSG_SPACE(count * sizeof(int)));
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+  auto cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), listener_fds.data(), count * sizeof(int));
+  ssize_t n;
+  do {
+    n = sendmsg(peer_fd, &msg, MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+  close(peer_fd);
+  if (n < 0) {
+    // keep serving, the replacement binds its own listeners
+    perror("TCPServer sendmsg");
+    return;
   }
 
   if (debug_mode) {
-    fprintf(stderr, "Stopping server thread\n");
+    fprintf(stderr, "Handed %u listeners over... draining\n", count);
   }
+  drain_state->handed_off = true;
+  notify_stop(stop_fd);
+}
 
-  close(server_sock_fd);
+bool Server::stop_requested() const {
+  struct pollfd pfd = {stop_fd, POLLIN, 0};
+  return poll(&pfd, 1, 0) > 0;
+}
 
-  client_handler.join_clients();
+// when the clients left at stop time have to be done
+std::chrono::steady_clock::time_point Server::drain_deadline() const {
+  // stopped on its own (max timeouts), clients finish as before
+  if (!stop_requested()) {
+    return std::chrono::steady_clock::time_point::max();
+  }
+  unsigned int ms = drain_state->timeout_ms;
+  if (ms == DEFAULT_DRAIN) {
+    ms = drain_timeout;
+  }
+  return std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
 }
 
-void Server::stop(bool force) {
-  if (server_pid < 0) {
-    return;
+void Server::run_server() {
+  if (debug_mode) {
+    fprintf(stderr, "Starting server process pid: %d\n", getpid());
   }
 
-  if (force) {
-    if (kill(server_pid, SIGKILL) < 0) {
-      perror("TCPServer kill");
-    }
-  } else {
-    if (kill(server_pid, SIGTERM) < 0) {
-      perror("TCPServer kill");
+  // one listener per shard (forked children close all of them), taken over
+  // from the server this one replaces if there is one
+  std::vector<int> listener_fds;
+  if (!handoff_path.empty()) {
+    listener_fds = take_over_listeners();
+  }
+  for (unsigned int shard = listener_fds.size(); shard < acceptor_shards;
+       shard++) {
+    int sock_fd = open_listener(acceptor_shards > 1);
+    if (sock_fd < 0) {
+      exit(EXIT_FAILURE);
     }
+    listener_fds.push_back(sock_fd);
   }
-
-  if (waitpid(server_pid, nullptr, 0) < 0) {
-    perror("TCPServer waitpid");
+  server_sock_fd = listener_fds[0];
+  client_handler.listener_fds = listener_fds;
+  client_handler.aborting = false;
+  if (!handoff_path.empty()) {
+    handoff_fd = open_handoff_socket();
   }
 
-  server_pid = -1;
-}
-
-// reap all clients that have finished
-void Server::ClientHandler::reap_clients() {
   if (debug_mode) {
-    fprintf(stderr, "Reaping clients\n");
+    fprintf(stderr, "TCPServer started on port %d with %u acceptor(s)\n",
+            port_no, acceptor_shards);
   }
 
-  if (clients.empty()) {
+  if (prefork_workers > 0) {
+    run_prefork(listener_fds);
+    for (int sock_fd : listener_fds) {
+      close(sock_fd);
+    }
+    if (!unix_path.empty()) {
+      unlink(unix_path.c_str());
+    }
     return;
   }
 
-  int reap_count = 0;
-  pid_t finished;
-  while (!clients.empty() && (finished = waitpid(0, nullptr, WNOHANG))) {
-    if (finished < 0) {
-      perror("TCPServer waitpid");
-      break;
+  // coroutines run on their own loop threads, the acceptors feed them
+  std::unique_ptr<IoContext> io_context;
+  if (client_handler.num_io_threads > 0) {
+    io_context.reset(new IoContext(client_handler.num_io_threads, io_uring));
+    client_handler.io_context = io_context.get();
+  } else if (!client_handler.event_loop) {
+    client_handler.start_workers();
+    if (!use_thread) {
+      client_handler.watch_children();
     }
-    clients.erase(std::remove(clients.begin(), clients.end(), finished),
-                  clients.end());
-    reap_count++;
   }
+  client_handler.open_admission();
 
-  if (debug_mode) {
-    fprintf(stderr, "Reaped %d clients\n", reap_count);
+  if (acceptor_shards == 1) {
+    run_acceptor(server_sock_fd, 0);
+  } else {
+    std::vector<std::thread> acceptors;
+    for (unsigned int shard = 0; shard < acceptor_shards; shard++) {
+      acceptors.emplace_back([this, &listener_fds, shard]() {
+        pin_to_cpu(shard);
+        run_acceptor(listener_fds[shard], shard);
+      });
+    }
+    for (auto& acceptor : acceptors) {
+      acceptor.join();
+    }
   }
 
   if (debug_mode) {
-    fprintf(stderr, "%lu connected clients remaining\n", clients.size());
+    fprintf(stderr, "Stopping server thread\n");
   }
-}
 
-// wait for all clients to finish
-void Server::ClientHandler::join_clients() {
-  if (debug_mode) {
-    fprintf(stderr, "Joining clients\n");
+  // a replacement holds its own copies of handed off listeners
+  for (int sock_fd : listener_fds) {
+    close(sock_fd);
   }
-
-  for (unsigned int i = 0; i < clients.size(); i++) {
-    if (waitpid(clients[i], nullptr, 0) < 0) {
-      perror("TCPServer waitpid");
+  client_handler.listener_fds.clear();
+  if (handoff_fd >= 0) {
+    close(handoff_fd);
+    handoff_fd = -1;
+    // the path belongs to the replacement now
+    if (!drain_state->handed_off) {
+      unlink(handoff_path.c_str());
     }
   }
+  if (!unix_path.empty() && !drain_state->handed_off) {
+    unlink(unix_path.c_str());
+  }
+
+  {
+    // never started, so not in flight either
+    std::lock_guard<std::mutex> guard(client_handler.lock);
+    client_handler.close_waiting();
+  }
+  unsigned long in_flight = client_handler.active_count();
+  drain_state->in_flight += in_flight;
+  drain_state->aborted += client_handler.drain_clients(drain_deadline());
+  client_handler.stop_workers();
+  client_handler.unwatch_children();
+  if (io_context) {
+    io_context->stop();
+    client_handler.io_context = nullptr;
+  }
+}
+
+// pin the calling acceptor thread to a core
+void Server::pin_to_cpu(unsigned int shard) {
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_cpus <= 0) {
+    return;
+  }
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(shard % num_cpus, &cpus);
+  int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  if (ret != 0) {
+    fprintf(stderr, "TCPServer pthread_setaffinity_np: %s\n", strerror(ret));
+  } else if (debug_mode) {
+    fprintf(stderr, "Acceptor %u pinned to cpu %ld\n", shard,
+            shard % num_cpus);
+  }
+}
+
+void Server::run_acceptor(int sock_fd, unsigned int shard) {
+  if (client_handler.event_loop) {
+    run_event_loop(sock_fd, shard);
+    return;
+  }
+
+  unsigned int timeout_count = 0;
+  while (true) {
+    // the first shard also serves handoffs to a replacement server
+    struct pollfd pfds[5] = {{sock_fd, POLLIN, 0},
+                             {stop_fd, POLLIN, 0},
+                             {shard == 0 ? handoff_fd : -1, POLLIN, 0},
+                             {client_handler.child_fd, POLLIN, 0},
+                             {client_handler.admit_fd, POLLIN, 0}};
+
+    if (debug_mode && timeout > 0) {
+      fprintf(stderr, "Waiting for up to %ds for a new connection\n",
+              timeout);
+    }
+
+    // wake up for the next admission deadline too, without counting it as
+    // a server timeout
+    int wait_ms = timeout > 0 ? timeout * 1000 : -1;
+    int admission_ms;
+    {
+      std::lock_guard<std::mutex> guard(client_handler.lock);
+      admission_ms = client_handler.admission_wait();
+    }
+    bool admission_deadline =
+        admission_ms >= 0 && (wait_ms < 0 || admission_ms < wait_ms);
+    if (admission_deadline) {
+      wait_ms = admission_ms;
+    }
+
+    int ret = poll(pfds, 5, wait_ms);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("TCPServer poll");
+      // stop server on error
+      break;
+    }
+
+    if (ret == 0) {
+      if (admission_deadline) {
+        std::lock_guard<std::mutex> guard(client_handler.lock);
+        client_handler.admit_waiting();
+        continue;
+      }
+      if (!handle_timeout(timeout_count)) {
+        // stop server on max timeouts
+        break;
+      }
+      // continue waiting for connections
+      continue;
+    }
+
+    if (pfds[1].revents & POLLIN) {
+      break;
+    }
+    if (pfds[2].revents & POLLIN) {
+      hand_off(client_handler.listener_fds);
+      continue;
+    }
+    if (pfds[3].revents & POLLIN || pfds[4].revents & POLLIN) {
+      std::lock_guard<std::mutex> guard(client_handler.lock);
+      if (pfds[4].revents & POLLIN) {
+        uint64_t count;
+        ssize_t n = read(client_handler.admit_fd, &count, sizeof(count));
+        (void)n;
+      }
+      client_handler.reap_clients();
+      client_handler.admit_waiting();
+    }
+    if (!(pfds[0].revents & POLLIN)) {
+      continue;
+    }
+
+    // socket is ready to accept a new connection
+    timeout_count = 0;
+
+    // pass client to handler
+    unsigned int accepted = client_handler.accept(sock_fd);
+    shard_accepts[shard].count.fetch_add(accepted, std::memory_order_relaxed);
+  }
+}
+
+void Server::run_event_loop(int sock_fd, unsigned int shard) {
+  if (debug_mode) {
+    fprintf(stderr, "TCPServer using event loop\n");
+  }
+
+  int flags = fcntl(sock_fd, F_GETFL);
+  if (flags < 0 || fcntl(sock_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    perror("TCPServer fcntl");
+    return;
+  }
+
+  unsigned int timeout_count = 0;
+  EventLoop loop(io_uring);
+  if (debug_mode && io_uring && !loop.uses_io_uring()) {
+    fprintf(stderr, "TCPServer io_uring unavailable... using epoll\n");
+  }
+  if (loop.add_acceptor(
+          sock_fd, [this, &loop, &timeout_count, shard](
+                       int client_sock_fd, const struct sockaddr_in6* addr) {
+            timeout_count = 0;
+            shard_accepts[shard].count.fetch_add(1, std::memory_order_relaxed);
+            client_handler.add_connection(loop, client_sock_fd, addr);
+          }) < 0) {
+    perror("TCPServer add_acceptor");
+    return;
+  }
+
+  bool stopping = false;
+  if (loop.add(stop_fd, EPOLLIN, [&stopping](uint32_t) { stopping = true; }) <
+      0) {
+    perror("TCPServer epoll_ctl");
+    return;
+  }
+  // the first shard also serves handoffs to a replacement server
+  int shard_handoff_fd = shard == 0 ? handoff_fd : -1;
+  if (shard_handoff_fd >= 0 &&
+      loop.add(shard_handoff_fd, EPOLLIN, [this](uint32_t) {
+        hand_off(client_handler.listener_fds);
+      }) < 0) {
+    perror("TCPServer epoll_ctl");
+    shard_handoff_fd = -1;
+  }
+
+  while (!stopping) {
+    int ret = loop.poll(timeout > 0 ? timeout * 1000 : -1);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("TCPServer poll");
+      // stop server on error
+      break;
+    }
+
+    if (ret == 0 && !handle_timeout(timeout_count)) {
+      // stop server on max timeouts
+      break;
+    }
+  }
+
+  if (debug_mode) {
+    fprintf(stderr, "Stopping event loop\n");
+  }
+
+  loop.remove(sock_fd);
+  loop.remove(stop_fd);
+  if (shard_handoff_fd >= 0) {
+    loop.remove(shard_handoff_fd);
+  }
+
+  // open connections get until the deadline to finish, stopping on max
+  // timeouts closes them right away as before
+  auto deadline =
+      stopping ? drain_deadline() : std::chrono::steady_clock::now();
+  unsigned long open = client_handler.count_connections(loop);
+  drain_state->in_flight += open;
+  while (open > 0 && std::chrono::steady_clock::now() < deadline) {
+    int wait_ms = -1;
+    if (deadline != std::chrono::steady_clock::time_point::max()) {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline - std::chrono::steady_clock::now());
+      wait_ms = std::min<long>(left.count() + 1, INT_MAX);
+    }
+    if (loop.poll(wait_ms) < 0 && errno != EINTR) {
+      perror("TCPServer poll");
+      break;
+    }
+    open = client_handler.count_connections(loop);
+  }
+  drain_state->aborted += client_handler.close_connections(loop);
+}
+
+// keep prefork_workers processes alive, respawning them as they exit
+void Server::run_prefork(const std::vector<int>& listener_fds) {
+  // exits are read from a signalfd so the wait for them also sees stop_fd,
+  // a blocking waitpid would miss a stop that comes in between
+  sigset_t sigchld;
+  sigemptyset(&sigchld);
+  sigaddset(&sigchld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &sigchld, nullptr);
+  int child_fd = signalfd(-1, &sigchld, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (child_fd < 0) {
+    perror("TCPServer signalfd");
+  }
+
+  std::vector<pid_t> workers(prefork_workers, -1);
+  std::vector<time_t> spawn_times(prefork_workers, 0);
+  for (unsigned int worker = 0; worker < prefork_workers; worker++) {
+    workers[worker] = spawn_prefork_worker(listener_fds, worker);
+    spawn_times[worker] = time(nullptr);
+  }
+
+  while (child_fd >= 0) {
+    struct pollfd pfds[2] = {{stop_fd, POLLIN, 0}, {child_fd, POLLIN, 0}};
+    if (poll(pfds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("TCPServer poll");
+      break;
+    }
+    if (pfds[0].revents & POLLIN) {
+      break;
+    }
+
+    // several exits can share one SIGCHLD, waitpid finds them all
+    struct signalfd_siginfo info[16];
+    while (read(child_fd, info, sizeof(info)) > 0) {
+    }
+    pid_t finished;
+    while ((finished = waitpid(-1, nullptr, WNOHANG)) > 0) {
+      unsigned int worker = 0;
+      while (worker < prefork_workers && workers[worker] != finished) {
+        worker++;
+      }
+      if (worker == prefork_workers) {
+        continue;
+      }
+
+      if (debug_mode) {
+        fprintf(stderr, "Worker %u (pid %d) exited... respawning\n", worker,
+                finished);
+      }
+      // back off if a worker keeps dying right after it starts
+      if (time(nullptr) - spawn_times[worker] < 1) {
+        sleep(1);
+      }
+      workers[worker] = spawn_prefork_worker(listener_fds, worker);
+      spawn_times[worker] = time(nullptr);
+    }
+  }
+
+  // idle workers leave accept() at once, busy ones finish their client
+  unsigned long in_flight = drain_state->busy_workers;
+  unsigned long alive = 0;
+  for (pid_t pid : workers) {
+    if (pid > 0) {
+      kill(pid, SIGTERM);
+      alive++;
+    }
+  }
+  auto deadline = drain_deadline();
+  while (alive > 0) {
+    pid_t finished = waitpid(-1, nullptr, WNOHANG);
+    if (finished > 0) {
+      std::replace(workers.begin(), workers.end(), finished, -1);
+      alive--;
+      continue;
+    }
+    if (finished < 0 && errno != EINTR) {
+      perror("TCPServer waitpid");
+      break;
+    }
+    if (std::chrono::steady_clock::now() >= deadline) {
+      break;
+    }
+    usleep(DRAIN_POLL_INTERVAL * 1000);
+  }
+
+  unsigned long aborted = 0;
+  if (alive > 0) {
+    aborted = std::min<unsigned long>(alive, drain_state->busy_workers);
+    for (pid_t pid : workers) {
+      if (pid > 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+      }
+    }
+  }
+  drain_state->in_flight += in_flight;
+  drain_state->aborted += aborted;
+
+  if (child_fd >= 0) {
+    close(child_fd);
+  }
+  sigprocmask(SIG_UNBLOCK, &sigchld, nullptr);
+}
+
+pid_t Server::spawn_prefork_worker(const std::vector<int>& listener_fds,
+                                   unsigned int worker) {
+  pid_t server = getpid();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("TCPServer fork");
+    return pid;
+  }
+  if (pid > 0) {
+    if (debug_mode) {
+      fprintf(stderr, "Started worker %u with pid %d\n", worker, pid);
+    }
+    return pid;
+  }
+
+  // SIGTERM stops accepting, the current client is finished first
+  handle_sigterm(stop_worker_on_sigterm, false);
+  sigset_t sigchld;
+  sigemptyset(&sigchld);
+  sigaddset(&sigchld, SIGCHLD);
+  sigprocmask(SIG_UNBLOCK, &sigchld, nullptr);
+  // die along with the server process
+  if (prctl(PR_SET_PDEATHSIG, SIGTERM) < 0) {
+    perror("TCPServer prctl");
+  }
+  if (getppid() != server) {
+    exit(EXIT_FAILURE);
+  }
+
+  // workers are spread over the acceptor shards
+  unsigned int shard = worker % listener_fds.size();
+  for (unsigned int i = 0; i < listener_fds.size(); i++) {
+    if (i != shard) {
+      close(listener_fds[i]);
+    }
+  }
+  client_handler.listener_fds = {listener_fds[shard]};
+  run_prefork_worker(listener_fds[shard], shard);
+  exit(EXIT_SUCCESS);
+}
+
+// accept and serve one client at a time
+void Server::run_prefork_worker(int sock_fd, unsigned int shard) {
+  // SIGTERM is only let in while waiting for a client, so it can neither
+  // interrupt a client nor slip in between the check and the wait
+  sigset_t sigterm, waiting;
+  sigemptyset(&sigterm);
+  sigaddset(&sigterm, SIGTERM);
+  sigprocmask(SIG_BLOCK, &sigterm, &waiting);
+  sigdelset(&waiting, SIGTERM);
+  // workers race for each connection, the losers go back to waiting
+  int flags = fcntl(sock_fd, F_GETFL);
+  if (flags < 0 || fcntl(sock_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    perror("TCPServer fcntl");
+    return;
+  }
+
+  while (!worker_stopping) {
+    struct pollfd pfds[2] = {{sock_fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+    if (ppoll(pfds, 2, nullptr, &waiting) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("TCPServer ppoll");
+      return;
+    }
+    if (pfds[1].revents & POLLIN) {
+      return;
+    }
+
+    struct sockaddr_in6 client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    int client_sock_fd =
+        ::accept(sock_fd, (struct sockaddr*)&client_addr, &client_addr_len);
+    if (client_sock_fd < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+          errno == ECONNABORTED) {
+        continue;
+      }
+      perror("TCPServer accept");
+      return;
+    }
+    shard_accepts[shard].count.fetch_add(1, std::memory_order_relaxed);
+    client_handler.metrics.accepted();
+
+    unsigned int slot = client_handler.next_handler(
+        client_handler.handlers.size(), client_addr);
+    drain_state->busy_workers++;
+    client_handler.active_clients++;
+    client_handler.run_client(client_sock_fd, client_addr, slot);
+    drain_state->busy_workers--;
+  }
+}
+
+bool Server::handle_timeout(unsigned int& timeout_count) {
+  if (debug_mode) {
+    fprintf(stderr, "TCPServer timeout\n");
+  }
+
+  timeout_count++;
+  // call timeout handler
+  if (timeout_handler != nullptr) {
+    if (debug_mode) {
+      fprintf(stderr, "Calling timeout handler\n");
+    }
+    timeout_handler();
+  }
+  if (max_timeouts > 0 && timeout_count >= max_timeouts) {
+    if (debug_mode) {
+      fprintf(stderr, "Max timeouts reached\n");
+    }
+    return false;
+  }
+  return true;
+}
+
+Metrics Server::get_metrics() const {
+  return client_handler.metrics.snapshot();
+}
+
+HandlerLatency Server::get_latency(unsigned int slot) const {
+  return client_handler.metrics.latency(slot);
+}
+
+std::vector<unsigned long> Server::get_shard_accept_counts() const {
+  std::vector<unsigned long> counts;
+  for (unsigned int shard = 0; shard < num_shard_counters; shard++) {
+    counts.push_back(shard_accepts[shard].count.load());
+  }
+  return counts;
+}
+
+DrainReport Server::drain(unsigned int timeout_ms) {
+  DrainReport report = {0, 0, false};
+  if (server_pid < 0) {
+    return report;
+  }
+
+  drain_state->timeout_ms = timeout_ms;
+  notify_stop(stop_fd);
+  if (use_thread) {
+    server_thread.join();
+  } else {
+    auto give_up = std::chrono::steady_clock::now() +
+                   std::chrono::milliseconds(timeout_ms) +
+                   std::chrono::milliseconds(DRAIN_GRACE_PERIOD);
+    while (true) {
+      pid_t finished = waitpid(server_pid, nullptr, WNOHANG);
+      if (finished < 0 && errno == EINTR) {
+        continue;
+      }
+      if (finished != 0) {
+        if (finished < 0) {
+          perror("TCPServer waitpid");
+        }
+        break;
+      }
+      if (std::chrono::steady_clock::now() >= give_up) {
+        if (debug_mode) {
+          fprintf(stderr, "Server did not drain in time... killing it\n");
+        }
+        kill(server_pid, SIGKILL);
+        if (waitpid(server_pid, nullptr, 0) < 0) {
+          perror("TCPServer waitpid");
+        }
+        break;
+      }
+      usleep(DRAIN_POLL_INTERVAL * 1000);
+    }
+  }
+
+  report.in_flight = drain_state->in_flight;
+  report.aborted = drain_state->aborted;
+  report.handed_off = drain_state->handed_off;
+  close(stop_fd);
+  stop_fd = -1;
+  server_pid = -1;
+  return report;
+}
+
+void Server::stop(bool force) {
+  if (server_pid < 0) {
+    return;
+  }
+
+  if (!force || use_thread) {
+    drain(0);
+    return;
+  }
+
+  if (kill(server_pid, SIGKILL) < 0) {
+    perror("TCPServer kill");
+  }
+  if (waitpid(server_pid, nullptr, 0) < 0) {
+    perror("TCPServer waitpid");
+  }
+  close(stop_fd);
+  stop_fd = -1;
+  server_pid = -1;
+}
+
+// block SIGCHLD and read it from a signalfd, so finished clients are only
+// looked for once some have exited
+void Server::ClientHandler::watch_children() {
+  sigset_t sigchld;
+  sigemptyset(&sigchld);
+  sigaddset(&sigchld, SIGCHLD);
+  if (sigprocmask(SIG_BLOCK, &sigchld, nullptr) < 0) {
+    perror("TCPClientHandler sigprocmask");
+    return;
+  }
+  child_fd = signalfd(-1, &sigchld, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (child_fd < 0) {
+    perror("TCPClientHandler signalfd");
+    sigprocmask(SIG_UNBLOCK, &sigchld, nullptr);
+  }
+}
+
+void Server::ClientHandler::unwatch_children() {
+  if (child_fd < 0) {
+    return;
+  }
+  close(child_fd);
+  child_fd = -1;
+  sigset_t sigchld;
+  sigemptyset(&sigchld);
+  sigaddset(&sigchld, SIGCHLD);
+  sigprocmask(SIG_UNBLOCK, &sigchld, nullptr);
+}
+
+// reap all clients that have finished
+void Server::ClientHandler::reap_clients() {
+  if (clients.empty()) {
+    return;
+  }
+
+  if (child_fd >= 0) {
+    // several exits can share one SIGCHLD, so the pids it carries are only
+    // a hint and waitpid below finds the rest
+    struct signalfd_siginfo info[16];
+    ssize_t n_read = read(child_fd, info, sizeof(info));
+    if (n_read < 0 && errno == EAGAIN) {
+      // no client exited since the last reap
+      return;
+    }
+    while (n_read == sizeof(info)) {
+      n_read = read(child_fd, info, sizeof(info));
+    }
+  }
+
+  if (debug_mode) {
+    fprintf(stderr, "Reaping clients\n");
+  }
+
+  int reap_count = 0;
+  pid_t finished;
+  while (!clients.empty() && (finished = waitpid(-1, nullptr, WNOHANG))) {
+    if (finished < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("TCPServer waitpid");
+      break;
+    }
+    auto client = clients.find(finished);
+    if (client != clients.end()) {
+      release_handler(client->second);
+      clients.erase(client);
+      reap_count++;
+    }
+  }
+
+  if (debug_mode) {
+    fprintf(stderr, "Reaped %d clients\n", reap_count);
+  }
+
+  if (debug_mode) {
+    fprintf(stderr, "%lu connected clients remaining\n", clients.size());
+  }
+}
+
+// wait for all clients to finish
+void Server::ClientHandler::join_clients() {
+  if (debug_mode) {
+    fprintf(stderr, "Joining clients\n");
+  }
+
+  for (auto& client : clients) {
+    if (waitpid(client.first, nullptr, 0) < 0) {
+      perror("TCPServer waitpid");
+    }
+    release_handler(client.second);
+  }
   clients.clear();
 }
 
+unsigned long Server::ClientHandler::active_count() {
+  if (event_loop) {
+    std::lock_guard<std::mutex> guard(lock);
+    return connections.size();
+  }
+  if (use_thread || io_context != nullptr) {
+    return active_clients;
+  }
+  reap_clients();
+  return clients.size();
+}
+
+unsigned long Server::ClientHandler::drain_clients(
+    std::chrono::steady_clock::time_point deadline) {
+  unsigned long left;
+  while ((left = active_count()) > 0 &&
+         std::chrono::steady_clock::now() < deadline) {
+    // forked clients wake us as soon as they exit
+    struct pollfd pfd = {child_fd, POLLIN, 0};
+    poll(&pfd, 1, DRAIN_POLL_INTERVAL);
+  }
+  if (left == 0) {
+    return 0;
+  }
+
+  if (debug_mode) {
+    fprintf(stderr, "Drain timed out... cutting off %lu clients\n", left);
+  }
+  if (event_loop || io_context != nullptr) {
+    // the loops destroy what is left when they stop
+    return left;
+  }
+  if (!use_thread) {
+    kill_clients();
+    return left;
+  }
+
+  // handlers blocked on their socket see it close and return
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    aborting = true;
+    for (int client_sock_fd : client_fds) {
+      shutdown(client_sock_fd, SHUT_RDWR);
+    }
+  }
+  auto give_up = std::chrono::steady_clock::now() +
+                 std::chrono::milliseconds(DRAIN_GRACE_PERIOD);
+  while (active_clients > 0 && std::chrono::steady_clock::now() < give_up) {
+    usleep(DRAIN_POLL_INTERVAL * 1000);
+  }
+  return left;
+}
+
 // tell all clients to terminate
 void Server::ClientHandler::terminate_clients() {
   if (debug_mode) {
     fprintf(stderr, "Terminating clients\n");
   }
 
-  for (unsigned int i = 0; i < clients.size(); i++) {
-    if (kill(clients[i], SIGTERM) < 0) {
+  for (auto& client : clients) {
+    if (kill(client.first, SIGTERM) < 0) {
       perror("TCPServer kill");
     }
   }
@@ -393,8 +1555,8 @@ void Server::ClientHandler::kill_clients() {
     fprintf(stderr, "Killing clients\n");
   }
 
-  for (unsigned int i = 0; i < clients.size(); i++) {
-    if (kill(clients[i], SIGKILL) < 0) {
+  for (auto& client : clients) {
+    if (kill(client.first, SIGKILL) < 0) {
       perror("TCPServer kill");
     }
   }
@@ -402,58 +1564,179 @@ void Server::ClientHandler::kill_clients() {
   join_clients();
 }
 
-Server::ClientHandler::~ClientHandler() { kill_clients(); }
+Server::ClientHandler::~ClientHandler() {
+  kill_clients();
+  // workers still running here belong to a server thread that never stopped
+  for (auto& worker : workers) {
+    worker.detach();
+  }
+  if (slot_sessions != nullptr && workers.empty()) {
+    munmap(slot_sessions, num_slots * sizeof(*slot_sessions));
+  }
+  for (auto& client : waiting) {
+    close(client.sock_fd);
+  }
+  if (admit_fd >= 0 && workers.empty()) {
+    close(admit_fd);
+  }
+}
 
-void Server::ClientHandler::accept(int server_sock_fd) {
-  reap_clients();
+int Server::ClientHandler::map_sessions(size_t num_slots) {
+  if (slot_sessions != nullptr) {
+    munmap(slot_sessions, this->num_slots * sizeof(*slot_sessions));
+    slot_sessions = nullptr;
+    this->num_slots = 0;
+  }
+  // one slot at least, mmap refuses empty mappings
+  num_slots = std::max<size_t>(num_slots, 1);
+  void* sessions = mmap(nullptr, num_slots * sizeof(*slot_sessions),
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                        -1, 0);
+  if (sessions == MAP_FAILED) {
+    return -1;
+  }
+  slot_sessions = new (sessions) std::atomic<unsigned long>[num_slots]();
+  this->num_slots = num_slots;
+  return 0;
+}
+
+// jump consistent hash (Lamping and Veach), only 1/n of the peers move
+// when a server restarts with one more handler
+static unsigned int jump_hash(uint64_t key, size_t num_buckets) {
+  int64_t bucket = -1, next = 0;
+  while (next < (int64_t)num_buckets) {
+    bucket = next;
+    key = key * 2862933555777941757ULL + 1;
+    next = (bucket + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1));
+  }
+  return bucket;
+}
+
+// FNV-1a of the peer address (the port changes with every connection)
+static uint64_t peer_key(const struct sockaddr_in6& client_addr) {
+  uint64_t key = 14695981039346656037ULL;
+  for (uint8_t byte : client_addr.sin6_addr.s6_addr) {
+    key = (key ^ byte) * 1099511628211ULL;
+  }
+  return key;
+}
+
+// pick the slot of the handler for the next client
+unsigned int Server::ClientHandler::next_handler(
+    size_t num_handlers, const struct sockaddr_in6& client_addr) {
   if (debug_mode) {
     fprintf(stderr, "mode: %d, current_handler: %d\n", mode, current_handler);
   }
-  ClientHandlerFunction handler;
+  unsigned int slot;
   switch (mode) {
     case RoundRobin:
-      handler = handlers[current_handler];
-      current_handler = (current_handler + 1) % handlers.size();
+      slot = current_handler % num_handlers;
+      current_handler = (slot + 1) % num_handlers;
       break;
     case Random:
-      handler = handlers[rand() % handlers.size()];
+      slot = rand() % num_handlers;
+      break;
+    case LeastConnections: {
+      // start after the last pick, so ties go round robin
+      slot = current_handler % num_handlers;
+      unsigned long fewest = slot_sessions[slot].load();
+      for (unsigned int i = 1; i < num_handlers && fewest > 0; i++) {
+        unsigned int other = (current_handler + i) % num_handlers;
+        unsigned long sessions = slot_sessions[other].load();
+        if (sessions < fewest) {
+          slot = other;
+          fewest = sessions;
+        }
+      }
+      current_handler = (slot + 1) % num_handlers;
+      break;
+    }
+    case PeerHash:
+      slot = jump_hash(peer_key(client_addr), num_handlers);
       break;
     default:
       fprintf(stderr, "Invalid mode\n");
       throw std::runtime_error("Invalid mode");
   }
+  slot_sessions[slot]++;
+  return slot;
+}
+
+void Server::ClientHandler::release_handler(unsigned int slot) {
+  slot_sessions[slot]--;
+}
 
+unsigned int Server::ClientHandler::accept(int server_sock_fd) {
   struct sockaddr_in6 client_addr;
   socklen_t client_addr_len = sizeof(client_addr);
   int client_sock_fd = ::accept(server_sock_fd, (struct sockaddr*)&client_addr,
                                 &client_addr_len);
   if (client_sock_fd < 0) {
-    perror("TCPClientHandler accept");
-    return;
+    // another acceptor (or the server we replaced) got there first
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      perror("TCPClientHandler accept");
+    }
+    return 0;
   }
+  metrics.accepted();
 
-  if (clients.size() >= max_clients) {
-    if (debug_mode) {
-      fprintf(stderr, "Max clients reached... dropping connection\n");
-    }
-    close(client_sock_fd);
+  std::lock_guard<std::mutex> guard(lock);
+  // clients already waiting go first
+  if (!waiting.empty()) {
+    admit_waiting();
+  }
+  if (!waiting.empty() || full()) {
+    enqueue(client_sock_fd, client_addr);
+    return 1;
+  }
+  start_client(client_sock_fd, client_addr);
+  return 1;
+}
+
+bool Server::ClientHandler::full() {
+  if (io_context != nullptr || use_thread) {
+    return active_clients >= max_clients;
+  }
+  // exits are reaped as SIGCHLD comes in, only a full server checks now
+  if (child_fd < 0 || clients.size() >= max_clients) {
+    reap_clients();
+  }
+  return clients.size() >= max_clients;
+}
+
+void Server::ClientHandler::start_client(
+    int client_sock_fd, const struct sockaddr_in6& client_addr) {
+  if (io_context != nullptr) {
+    active_clients++;
+    io_context->spawn(
+        run_coroutine(client_sock_fd, client_addr,
+                      next_handler(coroutine_handlers.size(), client_addr)));
     return;
   }
+
+  unsigned int slot = next_handler(handlers.size(), client_addr);
   if (!use_thread) {
     auto pid = fork();
     if (pid < 0) {
       perror("TCPClientHandler fork");
+      release_handler(slot);
       close(client_sock_fd);
       return;
     }
     if (pid == 0) {
-      // child process
+      // child process, a drain kills it at the deadline instead
+      signal(SIGTERM, SIG_DFL);
+      unwatch_children();
       if (debug_mode) {
         fprintf(stderr, "Got new connection... creating TCPClient\n");
       }
-      close(server_sock_fd);
+      for (int sock_fd : listener_fds) {
+        close(sock_fd);
+      }
 
+      set_socket_timeouts(client_sock_fd);
       Client* client = new Client(client_sock_fd, client_addr);
+      metrics.opened();
 
       if (debug_mode) {
         fprintf(stderr, "Handling connection from %s\n", client->peer_ip());
@@ -463,7 +1746,10 @@ void Server::ClientHandler::accept(int server_sock_fd) {
         fprintf(stderr, "Calling handler\n");
       }
 
-      handler(client, extra_data);
+      auto start = std::chrono::steady_clock::now();
+      handlers[slot](client, extra_data);
+      metrics.handled(std::chrono::steady_clock::now() - start);
+      metrics.closed(*client, slot);
       delete client;
       exit(EXIT_SUCCESS);
     }
@@ -471,29 +1757,488 @@ void Server::ClientHandler::accept(int server_sock_fd) {
     if (debug_mode) {
       fprintf(stderr, "Adding child pid: %d\n", pid);
     }
-    clients.push_back(pid);
+    clients[pid] = slot;
   } else {
-    std::thread handler_thread([handler, client_sock_fd, client_addr, this]() {
-      if (debug_mode) {
-        fprintf(stderr, "Got new connection... creating TCPClient\n");
+    active_clients++;
+    if (num_workers > 0) {
+      // queue can hold max_clients, so this only fails on a logic error
+      if (!pending_clients->try_push({client_sock_fd, client_addr, slot})) {
+        fprintf(stderr, "TCPClientHandler worker queue full\n");
+        release_handler(slot);
+        close(client_sock_fd);
+        active_clients--;
+        return;
       }
+      sem_post(&pending_count);
+    } else {
+      std::thread handler_thread([slot, client_sock_fd, client_addr, this]() {
+        run_client(client_sock_fd, client_addr, slot);
+      });
+      handler_thread.detach();
+    }
+  }
+}
 
-      Client* client = new Client(client_sock_fd, client_addr);
+void Server::ClientHandler::open_admission() {
+  if (queue_size == 0 || admit_fd >= 0) {
+    return;
+  }
+  // kept until the handler goes away, detached threads may still post
+  admit_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (admit_fd < 0) {
+    perror("TCPClientHandler eventfd");
+  }
+}
 
+void Server::ClientHandler::notify_admission() {
+  if (admit_fd >= 0) {
+    uint64_t one = 1;
+    ssize_t n = write(admit_fd, &one, sizeof(one));
+    (void)n;
+  }
+}
+
+void Server::ClientHandler::enqueue(int client_sock_fd,
+                                    const struct sockaddr_in6& client_addr) {
+  if (waiting.size() >= queue_size) {
+    if (queue_policy == Fifo || waiting.empty()) {
       if (debug_mode) {
-        fprintf(stderr, "Handling connection from %s\n", client->peer_ip());
+        fprintf(stderr, "Max clients reached... dropping connection\n");
       }
+      metrics.dropped();
+      close(client_sock_fd);
+      return;
+    }
+    // the oldest client has waited longest, so it gives way
+    if (debug_mode) {
+      fprintf(stderr, "Admission queue full... dropping oldest client\n");
+    }
+    metrics.dropped();
+    close(waiting.front().sock_fd);
+    waiting.pop_front();
+  }
+  if (debug_mode) {
+    fprintf(stderr, "Max clients reached... queueing connection\n");
+  }
+  metrics.queued();
+  waiting.push_back(
+      {client_sock_fd, client_addr, std::chrono::steady_clock::now()});
+}
 
+void Server::ClientHandler::admit_waiting() {
+  auto now = std::chrono::steady_clock::now();
+  if (queue_timeout > 0) {
+    auto oldest = now - std::chrono::milliseconds(queue_timeout);
+    while (!waiting.empty() && waiting.front().since <= oldest) {
       if (debug_mode) {
-        fprintf(stderr, "Calling handler\n");
+        fprintf(stderr, "Closing client that waited too long\n");
       }
+      metrics.expired();
+      close(waiting.front().sock_fd);
+      waiting.pop_front();
+    }
+  }
+  while (!waiting.empty() && !full()) {
+    WaitingClient client;
+    if (queue_policy == Lifo) {
+      client = waiting.back();
+      waiting.pop_back();
+    } else {
+      client = waiting.front();
+      waiting.pop_front();
+    }
+    metrics.admitted(now - client.since);
+    start_client(client.sock_fd, client.addr);
+  }
+}
 
-      handler(client, extra_data);
+int Server::ClientHandler::admission_wait() {
+  if (waiting.empty() || queue_timeout == 0) {
+    return -1;
+  }
+  auto deadline =
+      waiting.front().since + std::chrono::milliseconds(queue_timeout);
+  auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+      deadline - std::chrono::steady_clock::now());
+  // round up, waking early would only poll again
+  return std::max<long>(left.count() + 1, 0);
+}
 
-      delete client;
-    });
-    handler_thread.detach();
+unsigned long Server::ClientHandler::close_waiting() {
+  unsigned long closed = waiting.size();
+  for (auto& client : waiting) {
+    metrics.dropped();
+    close(client.sock_fd);
+  }
+  waiting.clear();
+  return closed;
+}
+
+void Server::ClientHandler::run_client(int client_sock_fd,
+                                       const struct sockaddr_in6& client_addr,
+                                       unsigned int slot) {
+  if (debug_mode) {
+    fprintf(stderr, "Got new connection... creating TCPClient\n");
+  }
+
+  set_socket_timeouts(client_sock_fd);
+  Client* client = new Client(client_sock_fd, client_addr);
+  metrics.opened();
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    client_fds.insert(client_sock_fd);
+    // the drain already timed out
+    if (aborting) {
+      shutdown(client_sock_fd, SHUT_RDWR);
+    }
+  }
+
+  if (debug_mode) {
+    fprintf(stderr, "Handling connection from %s\n", client->peer_ip());
+  }
+
+  if (debug_mode) {
+    fprintf(stderr, "Calling handler\n");
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  handlers[slot](client, extra_data);
+  metrics.handled(std::chrono::steady_clock::now() - start);
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    client_fds.erase(client_sock_fd);
+  }
+  release_handler(slot);
+  metrics.closed(*client, slot);
+  delete client;
+  active_clients--;
+  notify_admission();
+}
+
+void Server::ClientHandler::set_socket_timeouts(int client_sock_fd) {
+  struct timeval tv;
+  if (read_timeout > 0) {
+    tv = {read_timeout / 1000, (read_timeout % 1000) * 1000};
+    if (setsockopt(client_sock_fd, SOL_SOCKET, SO_RCVTIMEO, &tv,
+                   sizeof(tv)) < 0) {
+      perror("TCPClientHandler setsockopt");
+    }
+  }
+  if (write_timeout > 0) {
+    tv = {write_timeout / 1000, (write_timeout % 1000) * 1000};
+    if (setsockopt(client_sock_fd, SOL_SOCKET, SO_SNDTIMEO, &tv,
+                   sizeof(tv)) < 0) {
+      perror("TCPClientHandler setsockopt");
+    }
+  }
+}
+
+void Server::ClientHandler::start_workers() {
+  if (!use_thread || num_workers == 0 || !workers.empty()) {
+    return;
+  }
+
+  if (debug_mode) {
+    fprintf(stderr, "Starting %u worker threads\n", num_workers);
+  }
+
+  // room for every admitted client plus one stop marker per worker
+  pending_clients.reset(
+      new MPMCQueue<PendingClient>(max_clients + num_workers));
+  if (sem_init(&pending_count, 0, 0) < 0) {
+    perror("TCPClientHandler sem_init");
+    exit(EXIT_FAILURE);
+  }
+  for (unsigned int i = 0; i < num_workers; i++) {
+    workers.emplace_back([this]() { worker_loop(); });
+  }
+}
+
+// finish the queued clients and wait for the workers to exit
+void Server::ClientHandler::stop_workers() {
+  if (workers.empty()) {
+    return;
+  }
+
+  if (debug_mode) {
+    fprintf(stderr, "Stopping %lu worker threads\n", workers.size());
+  }
+
+  for (unsigned int i = 0; i < workers.size(); i++) {
+    while (!pending_clients->try_push({-1, {}, 0})) {
+      std::this_thread::yield();
+    }
+    sem_post(&pending_count);
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  workers.clear();
+  sem_destroy(&pending_count);
+  pending_clients.reset();
+}
+
+void Server::ClientHandler::worker_loop() {
+  while (true) {
+    if (sem_wait(&pending_count) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("TCPClientHandler sem_wait");
+      return;
+    }
+
+    // a producer may still be publishing the slot we were signalled for
+    PendingClient pending;
+    while (!pending_clients->try_pop(pending)) {
+      std::this_thread::yield();
+    }
+
+    if (pending.sock_fd < 0) {
+      return;
+    }
+    run_client(pending.sock_fd, pending.addr, pending.slot);
+  }
+}
+
+// start serving a connection accepted by the loop (socket is non-blocking)
+void Server::ClientHandler::add_connection(
+    EventLoop& loop, int client_sock_fd,
+    const struct sockaddr_in6* client_addr) {
+  struct sockaddr_in6 peer_addr;
+  if (client_addr == nullptr) {
+    socklen_t peer_addr_len = sizeof(peer_addr);
+    if (getpeername(client_sock_fd, (struct sockaddr*)&peer_addr,
+                    &peer_addr_len) < 0) {
+      perror("TCPClientHandler getpeername");
+      close(client_sock_fd);
+      return;
+    }
+    client_addr = &peer_addr;
+  }
+  metrics.accepted();
+
+  std::unique_lock<std::mutex> guard(lock);
+  if (connections.size() >= max_clients) {
+    if (debug_mode) {
+      fprintf(stderr, "Max clients reached... dropping connection\n");
+    }
+    metrics.dropped();
+    close(client_sock_fd);
+    return;
+  }
+
+  if (debug_mode) {
+    fprintf(stderr, "Got new connection... creating TCPClient\n");
+  }
+
+  // map nodes are stable, only the owning loop touches the connection
+  auto& connection = connections[client_sock_fd];
+  connection.client.reset(new Client(client_sock_fd, *client_addr));
+  // a blocking send() would stall every connection on the loop
+  connection.client->set_overflow_policy(Client::Queue);
+  connection.slot = next_handler(event_handlers.size(), *client_addr);
+  connection.handler = &event_handlers[connection.slot];
+  connection.loop = &loop;
+  connection.idle_timer = 0;
+  connection.closing = false;
+  guard.unlock();
+
+  if (debug_mode) {
+    fprintf(stderr, "Handling connection from %s\n",
+            connection.client->peer_ip());
+  }
+
+  if (loop.add(client_sock_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP,
+               [this, &loop, client_sock_fd](uint32_t events) {
+                 dispatch(loop, client_sock_fd, events);
+               }) < 0) {
+    perror("TCPClientHandler epoll_ctl");
+    guard.lock();
+    release_handler(connections[client_sock_fd].slot);
+    connections.erase(client_sock_fd);
+    return;
+  }
+  metrics.opened();
+
+  auto start = std::chrono::steady_clock::now();
+  bool keep_open =
+      (*connection.handler)(connection.client.get(), Connected, extra_data);
+  metrics.handled(std::chrono::steady_clock::now() - start);
+  if (!keep_open) {
+    finish_connection(loop, client_sock_fd, connection);
+    return;
+  }
+  arm_idle_timer(loop, client_sock_fd, connection);
+}
+
+// (re)start the connection's idle deadline, O(1) on the loop's timer wheel
+void Server::ClientHandler::arm_idle_timer(EventLoop& loop, int client_sock_fd,
+                                           Connection& connection) {
+  if (idle_timeout == 0) {
+    return;
+  }
+  loop.cancel_timer(connection.idle_timer);
+  connection.idle_timer =
+      loop.add_timer(idle_timeout, [this, &loop, client_sock_fd]() {
+        if (debug_mode) {
+          fprintf(stderr, "Connection %d idle... closing\n", client_sock_fd);
+        }
+        close_connection(loop, client_sock_fd);
+      });
+}
+
+// serve one client on the calling IoContext thread
+Task<void> Server::ClientHandler::run_coroutine(
+    int client_sock_fd, struct sockaddr_in6 client_addr, unsigned int slot) {
+  int flags = fcntl(client_sock_fd, F_GETFL);
+  if (flags < 0 || fcntl(client_sock_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    perror("TCPClientHandler fcntl");
+  }
+
+  if (debug_mode) {
+    fprintf(stderr, "Got new connection... creating TCPAsyncClient\n");
+  }
+
+  {
+    AsyncClient client(client_sock_fd, client_addr);
+    client.set_timeouts(read_timeout, write_timeout);
+    metrics.opened();
+    if (debug_mode) {
+      fprintf(stderr, "Handling connection from %s\n", client.peer_ip());
+    }
+    // includes the time spent suspended
+    auto start = std::chrono::steady_clock::now();
+    try {
+      co_await coroutine_handlers[slot](&client, extra_data);
+    } catch (std::exception& e) {
+      fprintf(stderr, "TCPClientHandler coroutine: %s\n", e.what());
+    }
+    metrics.handled(std::chrono::steady_clock::now() - start);
+    metrics.closed(client.get_client(), slot);
+  }
+  release_handler(slot);
+  active_clients--;
+  notify_admission();
+}
+
+// pass readiness events on to the connection's handler
+void Server::ClientHandler::dispatch(EventLoop& loop, int client_sock_fd,
+                                     uint32_t events) {
+  std::unique_lock<std::mutex> guard(lock);
+  auto it = connections.find(client_sock_fd);
+  if (it == connections.end()) {
+    return;
+  }
+  auto& connection = it->second;
+  guard.unlock();
+
+  uint32_t client_events = 0;
+  if (events & (EPOLLIN | EPOLLPRI)) {
+    client_events |= Readable;
+  }
+  bool flushed = true;
+  if (events & EPOLLOUT) {
+    client_events |= Writable;
+    // the send queue goes out before the handler adds to it
+    if (connection.client->queued() > 0) {
+      flushed = connection.client->flush() >= 0;
+    }
+  }
+  // the peer is gone, nothing queued can reach it any more
+  bool hangup = events & (EPOLLHUP | EPOLLERR);
+
+  // the handler is done, only the send queue is left
+  if (connection.closing) {
+    if (hangup || !flushed || connection.client->queued() == 0) {
+      close_connection(loop, client_sock_fd);
+    }
+    return;
+  }
+
+  // the peer stopped sending, but may still read the reply
+  bool half_closed = events & EPOLLRDHUP;
+  if (hangup || half_closed) {
+    // let the handler drain whatever is left before closing
+    client_events |= Readable | Hangup;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  bool keep_open =
+      (*connection.handler)(connection.client.get(), client_events, extra_data);
+  metrics.handled(std::chrono::steady_clock::now() - start);
+  if (hangup) {
+    close_connection(loop, client_sock_fd);
+    return;
+  }
+  if (!keep_open || half_closed) {
+    finish_connection(loop, client_sock_fd, connection);
+    return;
+  }
+  arm_idle_timer(loop, client_sock_fd, connection);
+}
+
+void Server::ClientHandler::finish_connection(EventLoop& loop,
+                                              int client_sock_fd,
+                                              Connection& connection) {
+  if (connection.client->queued() == 0) {
+    close_connection(loop, client_sock_fd);
+    return;
+  }
+  // EPOLLOUT stays armed, dispatch closes it once the queue is flushed
+  connection.closing = true;
+  arm_idle_timer(loop, client_sock_fd, connection);
+}
+
+void Server::ClientHandler::close_connection(EventLoop& loop,
+                                             int client_sock_fd) {
+  if (debug_mode) {
+    fprintf(stderr, "Closing connection %d\n", client_sock_fd);
+  }
+  if (loop.remove(client_sock_fd) < 0) {
+    perror("TCPClientHandler epoll_ctl");
+  }
+  // client destructor closes the socket
+  std::lock_guard<std::mutex> guard(lock);
+  auto it = connections.find(client_sock_fd);
+  if (it != connections.end()) {
+    loop.cancel_timer(it->second.idle_timer);
+    metrics.closed(*it->second.client, it->second.slot);
+    release_handler(it->second.slot);
+    connections.erase(it);
+  }
+}
+
+unsigned long Server::ClientHandler::close_connections(EventLoop& loop) {
+  std::lock_guard<std::mutex> guard(lock);
+  unsigned long closed = 0;
+  for (auto it = connections.begin(); it != connections.end();) {
+    if (it->second.loop != &loop) {
+      it++;
+      continue;
+    }
+    if (debug_mode) {
+      fprintf(stderr, "Closing connection %d\n", it->first);
+    }
+    loop.remove(it->first);
+    metrics.closed(*it->second.client, it->second.slot);
+    release_handler(it->second.slot);
+    it = connections.erase(it);
+    closed++;
+  }
+  return closed;
+}
+
+unsigned long Server::ClientHandler::count_connections(EventLoop& loop) {
+  std::lock_guard<std::mutex> guard(lock);
+  unsigned long open = 0;
+  for (auto& entry : connections) {
+    if (entry.second.loop == &loop) {
+      open++;
+    }
   }
+  return open;
 }
 
 }  // namespace tcp
\ No newline at end of file
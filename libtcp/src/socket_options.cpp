@@ -0,0 +1,82 @@
+#include "tcp/socket_options.hpp"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+namespace tcp {
+
+SocketOptions SocketOptions::low_latency() {
+  SocketOptions options;
+  options.no_delay = true;
+  options.fast_open = 256;
+  options.busy_poll = 50;
+  return options;
+}
+
+SocketOptions SocketOptions::bulk_throughput() {
+  SocketOptions options;
+  options.send_buffer = 4 << 20;
+  options.receive_buffer = 4 << 20;
+  options.keep_alive = true;
+  options.keep_idle = 60;
+  options.keep_interval = 10;
+  options.keep_count = 6;
+  return options;
+}
+
+// remembers the first failure but keeps going, one option the kernel
+// refuses should not cost the rest
+static void set_int(int sock_fd, int level, int name, int value, int& error) {
+  if (setsockopt(sock_fd, level, name, &value, sizeof(value)) < 0 &&
+      error == 0) {
+    error = errno;
+  }
+}
+
+int SocketOptions::apply(int sock_fd, bool listener) const {
+  int error = 0;
+  if (no_delay) {
+    set_int(sock_fd, IPPROTO_TCP, TCP_NODELAY, 1, error);
+  }
+  if (send_buffer > 0) {
+    set_int(sock_fd, SOL_SOCKET, SO_SNDBUF, send_buffer, error);
+  }
+  if (receive_buffer > 0) {
+    set_int(sock_fd, SOL_SOCKET, SO_RCVBUF, receive_buffer, error);
+  }
+  if (busy_poll > 0) {
+    set_int(sock_fd, SOL_SOCKET, SO_BUSY_POLL, busy_poll, error);
+  }
+  if (keep_alive) {
+    set_int(sock_fd, SOL_SOCKET, SO_KEEPALIVE, 1, error);
+    if (keep_idle > 0) {
+      set_int(sock_fd, IPPROTO_TCP, TCP_KEEPIDLE, keep_idle, error);
+    }
+    if (keep_interval > 0) {
+      set_int(sock_fd, IPPROTO_TCP, TCP_KEEPINTVL, keep_interval, error);
+    }
+    if (keep_count > 0) {
+      set_int(sock_fd, IPPROTO_TCP, TCP_KEEPCNT, keep_count, error);
+    }
+  }
+  if (listener) {
+    if (defer_accept > 0) {
+      set_int(sock_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, defer_accept, error);
+    }
+    if (fast_open > 0) {
+      set_int(sock_fd, IPPROTO_TCP, TCP_FASTOPEN, fast_open, error);
+    }
+  } else if (fast_open > 0) {
+    set_int(sock_fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1, error);
+  }
+
+  if (error != 0) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+}  // namespace tcp
@@ -0,0 +1,205 @@
+#include "tcp/timer_wheel.hpp"
+
+#include <limits.h>
+
+#include <utility>
+
+namespace tcp {
+
+TimerWheel::TimerWheel()
+    : start(Clock::now()),
+      now_tick(0),
+      timers(),
+      free_list(NONE),
+      num_active(0),
+      slots(),
+      occupied() {
+  for (auto& level : slots) {
+    for (auto& slot : level) {
+      slot = NONE;
+    }
+  }
+}
+
+TimerWheel::TimerId TimerWheel::add(uint64_t delay_ms, Callback callback) {
+  uint32_t index;
+  if (free_list != NONE) {
+    index = free_list;
+    free_list = timers[index].next;
+  } else {
+    index = timers.size();
+    timers.push_back({nullptr, 0, NONE, NONE, 1, 0, 0, false});
+  }
+
+  Timer& timer = timers[index];
+  timer.callback = std::move(callback);
+  // elapsed_ms() truncates, round up so the timer never fires early (and
+  // never before the next tick, advance() may be running this one)
+  timer.expires = elapsed_ms() + delay_ms + 1;
+  if (timer.expires <= now_tick) {
+    timer.expires = now_tick + 1;
+  }
+  timer.active = true;
+  num_active++;
+  link(index);
+  return ((uint64_t)timer.generation << 32) | index;
+}
+
+bool TimerWheel::cancel(TimerId id) {
+  uint32_t index = id & UINT32_MAX;
+  if (index >= timers.size() || !timers[index].active ||
+      timers[index].generation != (id >> 32)) {
+    return false;
+  }
+  unlink(index);
+  release(index);
+  return true;
+}
+
+size_t TimerWheel::advance() {
+  uint64_t target = elapsed_ms();
+  size_t ran = 0;
+  while (num_active > 0) {
+    // jump straight to the next tick that has work
+    uint64_t tick = next_tick();
+    if (tick > target) {
+      break;
+    }
+    now_tick = tick;
+
+    // every wrap of a level pulls the next slot of the level above down
+    if ((now_tick & (SLOTS - 1)) == 0) {
+      for (unsigned int level = 1; level < LEVELS; level++) {
+        cascade(level);
+        if (((now_tick >> (level * SLOT_BITS)) & (SLOTS - 1)) != 0) {
+          break;
+        }
+      }
+    }
+
+    uint32_t& slot = slots[0][now_tick & (SLOTS - 1)];
+    while (slot != NONE) {
+      uint32_t index = slot;
+      unlink(index);
+      Callback callback = std::move(timers[index].callback);
+      release(index);
+      callback();
+      ran++;
+    }
+  }
+  if (now_tick < target) {
+    now_tick = target;
+  }
+  return ran;
+}
+
+int TimerWheel::next_timeout_ms() const {
+  if (num_active == 0) {
+    return -1;
+  }
+  uint64_t tick = next_tick();
+  uint64_t now = elapsed_ms();
+  if (tick <= now) {
+    return 0;
+  }
+  return tick - now < INT_MAX ? tick - now : INT_MAX;
+}
+
+uint64_t TimerWheel::elapsed_ms() const {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() -
+                                                               start)
+      .count();
+}
+
+// earliest tick that runs a timer (level 0) or cascades a slot (above)
+uint64_t TimerWheel::next_tick() const {
+  uint64_t next = UINT64_MAX;
+  for (unsigned int level = 0; level < LEVELS; level++) {
+    if (occupied[level] == 0) {
+      continue;
+    }
+    unsigned int shift = level * SLOT_BITS;
+    unsigned int current = (now_tick >> shift) & (SLOTS - 1);
+    uint64_t later =
+        current == SLOTS - 1 ? 0 : occupied[level] & (~0ULL << (current + 1));
+    // slots at or before the current one belong to the next rotation
+    unsigned int distance =
+        later != 0 ? __builtin_ctzll(later) - current
+                   : __builtin_ctzll(occupied[level]) + SLOTS - current;
+    uint64_t tick = ((now_tick >> shift) + distance) << shift;
+    if (tick < next) {
+      next = tick;
+    }
+  }
+  return next;
+}
+
+// place the timer by how far away it is, relative to now_tick
+void TimerWheel::link(uint32_t index) {
+  Timer& timer = timers[index];
+  // due timers (delta 0) land in the slot advance() is about to run
+  uint64_t delta = timer.expires > now_tick ? timer.expires - now_tick : 0;
+  uint64_t horizon = 1ULL << (LEVELS * SLOT_BITS);
+  if (delta >= horizon) {
+    // beyond the top level, park it at the far end until it cascades
+    delta = horizon - 1;
+  }
+  uint64_t expires = now_tick + delta;
+  unsigned int level = 0;
+  while (level < LEVELS - 1 && delta >= (1ULL << ((level + 1) * SLOT_BITS))) {
+    level++;
+  }
+
+  unsigned int slot = (expires >> (level * SLOT_BITS)) & (SLOTS - 1);
+  timer.level = level;
+  timer.slot = slot;
+  timer.prev = NONE;
+  timer.next = slots[level][slot];
+  if (timer.next != NONE) {
+    timers[timer.next].prev = index;
+  }
+  slots[level][slot] = index;
+  occupied[level] |= 1ULL << slot;
+}
+
+void TimerWheel::unlink(uint32_t index) {
+  Timer& timer = timers[index];
+  uint32_t& head = slots[timer.level][timer.slot];
+  if (timer.prev != NONE) {
+    timers[timer.prev].next = timer.next;
+  } else {
+    head = timer.next;
+  }
+  if (timer.next != NONE) {
+    timers[timer.next].prev = timer.prev;
+  }
+  if (head == NONE) {
+    occupied[timer.level] &= ~(1ULL << timer.slot);
+  }
+}
+
+void TimerWheel::release(uint32_t index) {
+  Timer& timer = timers[index];
+  timer.callback = nullptr;
+  timer.active = false;
+  timer.generation++;
+  timer.next = free_list;
+  free_list = index;
+  num_active--;
+}
+
+// re-place every timer in the current slot of level (they are all closer
+// than one of its slots now)
+void TimerWheel::cascade(unsigned int level) {
+  unsigned int slot = (now_tick >> (level * SLOT_BITS)) & (SLOTS - 1);
+  uint32_t index = slots[level][slot];
+  slots[level][slot] = NONE;
+  occupied[level] &= ~(1ULL << slot);
+  while (index != NONE) {
+    uint32_t next = timers[index].next;
+    link(index);
+    index = next;
+  }
+}
+
+}  // namespace tcp
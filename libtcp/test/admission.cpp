@@ -0,0 +1,142 @@
+#include <string.h>
+#include <unistd.h>
+
+#include <iostream>
+
+#include "tcp/client.hpp"
+#include "tcp/error.hpp"
+#include "tcp/server.hpp"
+
+using namespace tcp;
+
+int failures = 0;
+
+void expect(bool ok, const char* what) {
+  if (!ok) {
+    std::cerr << "Failed: " << what << std::endl;
+    failures++;
+  }
+}
+
+bool start(Server& server) {
+  try {
+    server.start();
+  } catch (ConfigurationError& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    failures++;
+    return false;
+  }
+  usleep(200000);
+  return true;
+}
+
+void echo_line(Client* client, client_data_ptr_t) {
+  char line[64];
+  size_t len = client->readline(line, sizeof(line));
+  client->writen(line, len);
+}
+
+// send a line and return the echo (empty once the server closed us)
+std::string echo(Client& client, const char* text) {
+  char line[64];
+  strcpy(line, text);
+  client.writen(line, strlen(line));
+  memset(line, 0, sizeof(line));
+  client.readline(line, sizeof(line));
+  return line;
+}
+
+void check_fifo() {
+  Server server;
+  server.set_port(8110)
+      .use_threads()
+      .set_max_clients(1)
+      .set_admission_queue(2, 2000)
+      .add_handler(echo_line);
+  if (!start(server)) {
+    return;
+  }
+
+  Client first("127.0.0.1", 8110);
+  usleep(50000);
+  Client second("127.0.0.1", 8110);
+  usleep(50000);
+  expect(echo(first, "one\n") == "one\n", "first client is served");
+  usleep(50000);
+  expect(echo(second, "two\n") == "two\n", "waiting client gets the slot");
+
+  Metrics metrics = server.get_metrics();
+  expect(metrics.queued == 1 && metrics.drops == 0 && metrics.queue_ns > 0,
+         "queue time is counted");
+  server.stop();
+}
+
+void check_timeout() {
+  Server server;
+  server.set_port(8111)
+      .use_threads()
+      .set_max_clients(1)
+      .set_admission_queue(1, 100)
+      .add_handler(echo_line);
+  if (!start(server)) {
+    return;
+  }
+
+  Client busy("127.0.0.1", 8111);
+  usleep(50000);
+  Client late("127.0.0.1", 8111);
+  usleep(300000);
+  expect(echo(late, "late\n").empty(), "client is closed at the deadline");
+  expect(server.get_metrics().queue_timeouts == 1, "timeouts are counted");
+  server.stop();
+}
+
+void check_lifo() {
+  Server server;
+  server.set_port(8112)
+      .set_max_clients(1)
+      .set_admission_queue(1, 0, Server::ClientHandler::Lifo)
+      .add_handler(echo_line);
+  if (!start(server)) {
+    return;
+  }
+
+  Client first("127.0.0.1", 8112);
+  usleep(50000);
+  Client oldest("127.0.0.1", 8112);
+  usleep(50000);
+  Client newest("127.0.0.1", 8112);
+  usleep(50000);
+  expect(echo(oldest, "old\n").empty(), "full queue drops the oldest");
+  expect(echo(first, "one\n") == "one\n", "first client is served");
+  expect(echo(newest, "new\n") == "new\n", "forked slot goes to the newest");
+
+  Metrics metrics = server.get_metrics();
+  expect(metrics.queued == 2 && metrics.drops == 1, "lifo drops are counted");
+  server.stop();
+}
+
+int main() {
+  check_fifo();
+  check_timeout();
+  check_lifo();
+
+  Server server;
+  bool rejected = false;
+  try {
+    server.set_port(8113)
+        .use_event_loop()
+        .set_admission_queue(1, 0)
+        .add_event_handler(
+            [](Client*, uint32_t, client_data_ptr_t) { return false; })
+        .start();
+  } catch (ConfigurationError& e) {
+    rejected = true;
+  }
+  expect(rejected, "event loop has no admission queue");
+
+  if (failures == 0) {
+    std::cout << "Admission test passed!" << std::endl;
+  }
+  return failures == 0 ? 0 : 1;
+}
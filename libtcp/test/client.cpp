@@ -0,0 +1,329 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "dns/resolver.hpp"
+#include "tcp/client.hpp"
+#include "tcp/error.hpp"
+#include "tcp/server.hpp"
+
+using namespace tcp;
+
+static int failures = 0;
+
+void expect(const std::string& name, const std::string& expected,
+            const std::string& received) {
+  if (expected != received) {
+    std::cerr << name << " failed" << std::endl;
+    std::cerr << "Expected: '" << expected << "'" << std::endl;
+    std::cerr << "Received: '" << received << "'" << std::endl;
+    failures++;
+  }
+}
+
+// send a fixed stream split at awkward places
+void stream_handler(Client* client, client_data_ptr_t) {
+  char first[] = "first", space[] = " ", line[] = "line\nsec";
+  struct iovec iov[] = {{first, 5}, {space, 1}, {line, 8}};
+  client->writev(iov, 3);
+  usleep(10000);
+
+  const char* chunks[] = {"ond line\nGET / HTTP/1.0\r", "\nHost: x\r\n\r",
+                          "\n0123456789", "tail"};
+  for (auto chunk : chunks) {
+    client->writen((void*)chunk, strlen(chunk));
+    usleep(10000);
+  }
+}
+
+// relay the stream server through splice
+void relay_handler(Client* client, client_data_ptr_t) {
+  Client upstream("127.0.0.1", 8082);
+  client->splice_from(upstream);
+}
+
+// send part of a file through sendfile
+void file_handler(Client* client, client_data_ptr_t extra_data) {
+  int fd = *(int*)extra_data;
+  client->send_file(fd, 6, 8);
+}
+
+// count the bytes of the stream and add them up
+void sum_handler(Client* client, client_data_ptr_t) {
+  char buf[4096];
+  unsigned long count = 0, sum = 0;
+  ssize_t n;
+  while ((n = client->read(buf, sizeof(buf))) > 0) {
+    for (ssize_t i = 0; i < n; i++) {
+      sum += (unsigned char)buf[i];
+    }
+    count += n;
+  }
+  std::string reply = std::to_string(count) + " " + std::to_string(sum);
+  client->writen(reply.data(), reply.size());
+}
+
+void check_zerocopy() {
+  Server server;
+  try {
+    server.set_port(8114).use_threads().add_handler(sum_handler).start();
+  } catch (ConfigurationError& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    failures++;
+    return;
+  }
+  usleep(200000);
+
+  std::string big(1 << 20, '\0'), tail = "tail";
+  unsigned long sum = 0;
+  for (size_t i = 0; i < big.size(); i++) {
+    big[i] = 'a' + i % 26;
+    sum += (unsigned char)big[i];
+  }
+  sum = 2 * sum + 't' + 'a' + 'i' + 'l';
+
+  {
+    Client client("127.0.0.1", 8114);
+    expect("set_zerocopy", "0", std::to_string(client.set_zerocopy(1024)));
+    client.writen(big.data(), big.size());
+    // the kernel copies over loopback and says so
+    expect("zerocopy over loopback", "0",
+           std::to_string(client.uses_zerocopy()));
+    client.set_zerocopy(1024);
+    struct iovec iov[] = {{big.data(), big.size()}, {tail.data(), 4}};
+    client.writev(iov, 2);
+    shutdown(client.get_fd(), SHUT_WR);
+
+    std::string reply;
+    client.read_until(reply, "never");
+    expect("zerocopy writes",
+           std::to_string(2 * big.size() + 4) + " " + std::to_string(sum),
+           reply);
+  }
+  server.stop();
+}
+
+void check_stream(const std::string& name, int port) {
+  Client client("127.0.0.1", port);
+
+  char line[64];
+  client.readline(line, sizeof(line));
+  expect(name + " readline", "first line\n", line);
+  client.readline(line, sizeof(line));
+  expect(name + " readline across reads", "second line\n", line);
+
+  std::string request;
+  client.read_until(request, "\r\n\r\n");
+  expect(name + " read_until", "GET / HTTP/1.0\r\nHost: x\r\n\r\n",
+         request);
+
+  char digits[11] = {};
+  client.read_exact(digits, 10);
+  expect(name + " read_exact", "0123456789", digits);
+
+  std::string rest;
+  client.read_until(rest, "never", 2);
+  expect(name + " read_until maxlen", "ta", rest);
+  client.read_until(rest, "never");
+  expect(name + " read_until EOF", "tail", rest);
+  expect(name + " EOF", "0", std::to_string(client.read(line, sizeof(line))));
+}
+
+// listener on ip:port that never accepts, once the connection this opens
+// fills its backlog further handshakes hang
+int stalled_listener(const char* ip, int port, int& filler) {
+  struct sockaddr_in6 addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin6_family = AF_INET6;
+  addr.sin6_port = htons(port);
+  inet_pton(AF_INET6, ip, &addr.sin6_addr);
+
+  int one = 1;
+  int fd = socket(AF_INET6, SOCK_STREAM, 0);
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (!IN6_IS_ADDR_V4MAPPED(&addr.sin6_addr)) {
+    // leave the IPv4 side of the port to someone else
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one));
+  }
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 0)) {
+    perror("stalled_listener");
+  }
+  filler = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  connect(filler, (struct sockaddr*)&addr, sizeof(addr));
+  usleep(50000);
+  return fd;
+}
+
+// connect with a deadline, returns the errno (0 on success)
+int timed_connect(const char* server, int port, long timeout_ms,
+                  std::string& peer, long& elapsed_ms) {
+  auto start = std::chrono::steady_clock::now();
+  int error = 0;
+  try {
+    Client client(server, port, std::chrono::milliseconds(timeout_ms));
+    peer = client.peer_ip();
+  } catch (ConnectionError& e) {
+    error = e.code();
+  }
+  elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now() - start)
+                   .count();
+  return error;
+}
+
+void check_connect() {
+  std::string peer;
+  long elapsed_ms;
+  expect("connect refused", std::to_string(ECONNREFUSED),
+         std::to_string(timed_connect("127.0.0.1", 8090, 1000, peer,
+                                      elapsed_ms)));
+
+  int filler;
+  int stalled = stalled_listener("::ffff:127.0.0.1", 8091, filler);
+  expect("connect timeout", std::to_string(ETIMEDOUT),
+         std::to_string(
+             timed_connect("127.0.0.1", 8091, 300, peer, elapsed_ms)));
+  expect("connect gives up at the deadline", "1",
+         std::to_string(elapsed_ms >= 300 && elapsed_ms < 1000));
+  close(filler);
+  close(stalled);
+
+  // IPv6 is preferred but stalls, IPv4 gets its turn after the attempt delay
+  char hosts_path[] = "/tmp/tcp_client_hosts_XXXXXX";
+  int hosts_fd = mkstemp(hosts_path);
+  std::string hosts = "::1 dual.test\n127.0.0.1 dual.test\n";
+  if (hosts_fd < 0 || write(hosts_fd, hosts.data(), hosts.size()) < 0) {
+    perror("mkstemp");
+    failures++;
+    return;
+  }
+  close(hosts_fd);
+  dns::Resolver::get_default().set_hosts_file(hosts_path);
+
+  stalled = stalled_listener("::1", 8092, filler);
+  int v4 = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt(v4, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(8092);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(v4, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(v4, 8)) {
+    perror("listen");
+  }
+  expect("happy eyeballs", "0",
+         std::to_string(
+             timed_connect("dual.test", 8092, 2000, peer, elapsed_ms)));
+  expect("happy eyeballs peer", "::ffff:127.0.0.1", peer);
+  expect("happy eyeballs falls back quickly", "1",
+         std::to_string(elapsed_ms < 1000));
+  close(v4);
+  close(filler);
+  close(stalled);
+  unlink(hosts_path);
+  dns::Resolver::get_default().set_hosts_file("/etc/hosts");
+}
+
+int cork_state(Client& client) {
+  int value = -1;
+  socklen_t len = sizeof(value);
+  getsockopt(client.get_fd(), IPPROTO_TCP, TCP_CORK, &value, &len);
+  return value;
+}
+
+// small writes held back by the cork reach the server whole once uncorked
+void check_cork() {
+  Server server;
+  try {
+    server.set_port(8123).use_threads().add_handler(sum_handler).start();
+  } catch (ConfigurationError& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    failures++;
+    return;
+  }
+  usleep(200000);
+
+  {
+    Client client("127.0.0.1", 8123);
+    // never corked, so there is nothing to flush
+    expect("uncork uncorked", "0", std::to_string(client.uncork()));
+    expect("uncorked state", "0", std::to_string(cork_state(client)));
+
+    expect("cork", "0", std::to_string(client.cork()));
+    expect("corked state", "1", std::to_string(cork_state(client)));
+    unsigned long count = 0, sum = 0;
+    for (int i = 0; i < 100; i++) {
+      std::string piece = "piece " + std::to_string(i) + "\n";
+      client.writen(piece.data(), piece.size());
+      count += piece.size();
+      for (char c : piece) {
+        sum += (unsigned char)c;
+      }
+    }
+    expect("uncork", "0", std::to_string(client.uncork()));
+    expect("uncorked again", "0", std::to_string(cork_state(client)));
+    shutdown(client.get_fd(), SHUT_WR);
+
+    std::string reply;
+    client.read_until(reply, "never");
+    expect("corked writes",
+           std::to_string(count) + " " + std::to_string(sum), reply);
+  }
+  server.stop();
+}
+
+int main() {
+  char path[] = "/tmp/tcp_client_test_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0 || write(fd, "hello sendfile!", 15) != 15) {
+    perror("mkstemp");
+    return 1;
+  }
+  unlink(path);
+
+  Server stream_server, relay_server, file_server;
+  try {
+    stream_server.set_port(8082)
+        .use_threads()
+        .add_handler(stream_handler)
+        .start();
+    relay_server.set_port(8083)
+        .use_threads()
+        .add_handler(relay_handler)
+        .start();
+    file_server.set_port(8084)
+        .use_threads()
+        .add_handler(file_handler)
+        .add_handler_extra_data(&fd)
+        .start();
+  } catch (ConfigurationError& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+  usleep(200000);
+
+  check_stream("direct", 8082);
+  check_stream("spliced", 8083);
+
+  Client client("127.0.0.1", 8084);
+  std::string contents;
+  client.read_until(contents, "never");
+  expect("send_file", "sendfile", contents);
+
+  check_connect();
+  check_zerocopy();
+  check_cork();
+
+  if (failures == 0) {
+    std::cout << "Client test passed!" << std::endl;
+  }
+  return failures == 0 ? 0 : 1;
+}
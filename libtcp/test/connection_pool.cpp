@@ -0,0 +1,113 @@
+#include "tcp/connection_pool.hpp"
+
+#include <string.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <vector>
+
+#include "tcp/client.hpp"
+#include "tcp/error.hpp"
+#include "tcp/server.hpp"
+
+using namespace tcp;
+
+int failures = 0;
+
+void expect(bool ok, const char* what) {
+  if (!ok) {
+    std::cerr << "Failed: " << what << std::endl;
+    failures++;
+  }
+}
+
+// echo lines until the client says bye
+void echo_handler(Client* client, client_data_ptr_t) {
+  char line[64];
+  while (client->readline(line, sizeof(line)) > 0) {
+    if (strcmp(line, "bye\n") == 0) {
+      return;
+    }
+    client->writen(line, strlen(line));
+  }
+}
+
+bool echo(PooledClient& client) {
+  char msg[] = "ping\n";
+  char reply[64];
+  client->writen(msg, strlen(msg));
+  return client->readline(reply, sizeof(reply)) > 0 && strcmp(msg, reply) == 0;
+}
+
+int main() {
+  Server server;
+  try {
+    server.set_port(8088)
+        .add_handler(echo_handler)
+        .set_max_clients(8)
+        .start();
+  } catch (ConfigurationError& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+  // give the server a moment to bind
+  usleep(200000);
+
+  ConnectionPool pool;
+  pool.set_max_idle(2);
+
+  int first_fd;
+  {
+    PooledClient client = pool.acquire("127.0.0.1", 8088);
+    expect(!client.reused(), "first checkout opens a connection");
+    expect(echo(client), "echo on a new connection");
+    first_fd = client->get_fd();
+    client.release();
+  }
+  expect(pool.idle_count() == 1, "released connection is idle");
+
+  {
+    PooledClient client = pool.acquire("127.0.0.1", 8088);
+    expect(client.reused(), "second checkout reuses the connection");
+    expect(client->get_fd() == first_fd, "same socket is handed out");
+    expect(echo(client), "echo on a reused connection");
+    client.release();
+  }
+
+  {
+    // the server hangs up while the connection sits idle
+    PooledClient client = pool.acquire("127.0.0.1", 8088);
+    char bye[] = "bye\n";
+    client->writen(bye, strlen(bye));
+    client.release();
+    usleep(100000);
+  }
+  {
+    PooledClient client = pool.acquire("127.0.0.1", 8088);
+    expect(!client.reused(), "closed connection fails the health check");
+    expect(echo(client), "echo after a stale connection");
+  }
+  expect(pool.idle_count() == 0, "connections not released are closed");
+
+  {
+    std::vector<PooledClient> clients;
+    for (int i = 0; i < 3; i++) {
+      clients.push_back(pool.acquire("localhost", 8088));
+    }
+    for (auto& client : clients) {
+      expect(echo(client), "echo on concurrent connections");
+      client.release();
+    }
+  }
+  expect(pool.idle_count() == 2, "idle connections are capped per host");
+  expect(pool.get_hits() == 2, "hit count");
+
+  pool.clear();
+  expect(pool.idle_count() == 0, "clear closes idle connections");
+  server.stop();
+
+  if (failures == 0) {
+    std::cout << "Connection pool test passed!" << std::endl;
+  }
+  return failures == 0 ? 0 : 1;
+}
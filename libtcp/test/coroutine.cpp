@@ -0,0 +1,166 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tcp/client.hpp"
+#include "tcp/coroutine.hpp"
+#include "tcp/error.hpp"
+#include "tcp/server.hpp"
+
+using namespace tcp;
+
+#define NUM_CLIENTS 50
+
+// echo every line back after a pause that must not stall other clients
+Task<void> echo_handler(AsyncClient* client, client_data_ptr_t) {
+  std::string line;
+  while (co_await client->read_until(line, "\n") > 0) {
+    co_await sleep_for(std::chrono::milliseconds(100));
+    if (co_await client->write(line.data(), line.size()) < 0) {
+      co_return;
+    }
+    line.clear();
+  }
+}
+
+std::atomic<int> passed(0);
+std::atomic<int> refused(0);
+
+Task<void> echo_client(unsigned int port, int id) {
+  auto client = co_await connect("127.0.0.1", port);
+  if (!client) {
+    perror("connect");
+    co_return;
+  }
+  std::string msg = "hello " + std::to_string(id) + "\n";
+  std::string reply;
+  co_await client->write(msg.data(), msg.size());
+  co_await client->read_until(reply, "\n");
+  if (reply == msg) {
+    passed++;
+  } else {
+    std::cerr << "Expected: " << msg << "Received: " << reply << std::endl;
+  }
+}
+
+Task<void> refused_client(unsigned int port) {
+  auto client = co_await connect("::1", port);
+  if (!client && errno == ECONNREFUSED) {
+    refused++;
+  }
+}
+
+// frames alive, a frame holds its own copy of the token
+std::atomic<int> frames(0);
+
+struct FrameToken {
+  FrameToken() { frames++; }
+  FrameToken(const FrameToken&) { frames++; }
+  ~FrameToken() { frames--; }
+};
+
+Task<void> sleeping_task(FrameToken) {
+  co_await sleep_for(std::chrono::seconds(10));
+}
+
+// tasks spawned while the context stops are run or destroyed, never lost
+bool check_spawn_while_stopping() {
+  {
+    IoContext context(2);
+    std::vector<std::thread> spawners;
+    for (int i = 0; i < 4; i++) {
+      spawners.emplace_back([&context]() {
+        for (int j = 0; j < 1000; j++) {
+          context.spawn(sleeping_task(FrameToken()));
+        }
+      });
+    }
+    usleep(1000);
+    context.stop();
+    for (std::thread& spawner : spawners) {
+      spawner.join();
+    }
+  }
+  if (frames != 0) {
+    std::cerr << frames << " spawned frames leaked on stop" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+int main() {
+  Server server;
+  try {
+    server.set_port(8086)
+        .set_backlog(NUM_CLIENTS)
+        .use_coroutines(2)
+        .add_coroutine_handler(echo_handler)
+        .set_max_clients(NUM_CLIENTS)
+        .start();
+  } catch (ConfigurationError& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+  // give the server a moment to bind
+  usleep(200000);
+
+  int failures = 0;
+  {
+    // blocking clients still work against coroutine handlers
+    Client client("127.0.0.1", 8086);
+    char msg[] = "Hello, coroutines!\n";
+    char reply[64];
+    client.writen(msg, strlen(msg));
+    client.readline(reply, sizeof(reply));
+    if (strcmp(msg, reply) != 0) {
+      std::cerr << "Expected: " << msg << "Received: " << reply << std::endl;
+      failures++;
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  {
+    IoContext context(2);
+    for (int id = 0; id < NUM_CLIENTS; id++) {
+      context.spawn(echo_client(8086, id));
+    }
+    context.spawn(refused_client(8087));
+    for (int i = 0; i < 50 && (passed < NUM_CLIENTS || refused < 1); i++) {
+      usleep(100000);
+    }
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  server.stop();
+
+  if (passed != NUM_CLIENTS) {
+    std::cerr << "Only " << passed << " of " << NUM_CLIENTS
+              << " coroutine clients got their echo" << std::endl;
+    failures++;
+  }
+  if (refused != 1) {
+    std::cerr << "Connect to a closed port did not fail" << std::endl;
+    failures++;
+  }
+  // one at a time the handler sleeps alone would take 5s
+  if (elapsed > std::chrono::seconds(2)) {
+    std::cerr << "Coroutine clients were not served concurrently"
+              << std::endl;
+    failures++;
+  }
+
+  if (!check_spawn_while_stopping()) {
+    failures++;
+  }
+
+  if (failures == 0) {
+    std::cout << "Coroutine test passed!" << std::endl;
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,114 @@
+#include <string.h>
+#include <unistd.h>
+
+#include <iostream>
+
+#include "tcp/client.hpp"
+#include "tcp/error.hpp"
+#include "tcp/server.hpp"
+
+using namespace tcp;
+
+int failures = 0;
+
+void expect(bool ok, const char* what) {
+  if (!ok) {
+    std::cerr << "Failed: " << what << std::endl;
+    failures++;
+  }
+}
+
+bool start(Server& server) {
+  try {
+    server.start();
+  } catch (ConfigurationError& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    failures++;
+    return false;
+  }
+  usleep(200000);
+  return true;
+}
+
+// holds its session until the client speaks
+void reply_a(Client* client, client_data_ptr_t) {
+  char line[64];
+  client->readline(line, sizeof(line));
+  char reply[] = "A\n";
+  client->writen(reply, strlen(reply));
+}
+
+void reply_b(Client* client, client_data_ptr_t) {
+  char reply[] = "B\n";
+  client->writen(reply, strlen(reply));
+}
+
+void reply_c(Client* client, client_data_ptr_t) {
+  char reply[] = "C\n";
+  client->writen(reply, strlen(reply));
+}
+
+// the reply of a client that does not hold its session
+std::string ask(int port) {
+  Client client("127.0.0.1", port);
+  char line[64] = {};
+  client.readline(line, sizeof(line));
+  // let the server see the session end
+  client.readline(line + strlen(line), sizeof(line) - strlen(line));
+  usleep(50000);
+  return line;
+}
+
+void check_least_connections() {
+  Server server;
+  server.set_port(8108)
+      .set_handler_mode(Server::ClientHandler::LeastConnections)
+      .add_handler(reply_a)
+      .add_handler(reply_b);
+  if (!start(server)) {
+    return;
+  }
+
+  // round robin would send the third client to the busy handler
+  Client busy("127.0.0.1", 8108);
+  usleep(50000);
+  expect(ask(8108) == "B\n", "second client goes to the idle handler");
+  expect(ask(8108) == "B\n", "busy handler is skipped");
+
+  char line[64] = "hello\n";
+  busy.writen(line, strlen(line));
+  memset(line, 0, sizeof(line));
+  busy.readline(line, sizeof(line));
+  expect(strcmp(line, "A\n") == 0, "first client keeps its handler");
+  server.stop();
+}
+
+void check_peer_hash() {
+  Server server;
+  server.set_port(8109)
+      .use_threads()
+      .set_handler_mode(Server::ClientHandler::PeerHash)
+      .add_handler(reply_b)
+      .add_handler(reply_c);
+  if (!start(server)) {
+    return;
+  }
+
+  std::string first = ask(8109);
+  bool same = true;
+  for (int i = 0; i < 4; i++) {
+    same = same && ask(8109) == first;
+  }
+  expect(!first.empty() && same, "a peer always gets the same handler");
+  server.stop();
+}
+
+int main() {
+  check_least_connections();
+  check_peer_hash();
+
+  if (failures == 0) {
+    std::cout << "Dispatch test passed!" << std::endl;
+  }
+  return failures == 0 ? 0 : 1;
+}
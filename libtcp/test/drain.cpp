@@ -0,0 +1,195 @@
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+
+#include "tcp/client.hpp"
+#include "tcp/error.hpp"
+#include "tcp/server.hpp"
+
+using namespace tcp;
+
+#define HANDOFF_PATH "/tmp/libtcp-drain-test.sock"
+
+int failures = 0;
+
+void expect(bool ok, const char* what) {
+  if (!ok) {
+    std::cerr << "Failed: " << what << std::endl;
+    failures++;
+  }
+}
+
+// still busy when the drain starts, done well before its deadline
+void slow_handler(Client* client, client_data_ptr_t) {
+  usleep(300000);
+  char reply[] = "done\n";
+  client->writen(reply, strlen(reply));
+}
+
+// waits for a line that never comes
+void stuck_handler(Client* client, client_data_ptr_t) {
+  char line[64];
+  client->readline(line, sizeof(line));
+}
+
+bool idle_handler(Client*, uint32_t, client_data_ptr_t) { return true; }
+
+bool start(Server& server) {
+  try {
+    server.start();
+  } catch (ConfigurationError& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    failures++;
+    return false;
+  }
+  usleep(200000);
+  return true;
+}
+
+void check_completed() {
+  Server server;
+  server.set_port(8100).add_handler(slow_handler);
+  if (!start(server)) {
+    return;
+  }
+
+  Client client("127.0.0.1", 8100);
+  usleep(50000);
+  DrainReport report = server.drain(2000);
+  expect(report.in_flight == 1 && report.completed() == 1,
+         "in-flight client finishes");
+  char line[64] = {};
+  client.readline(line, sizeof(line));
+  expect(strcmp(line, "done\n") == 0, "client gets its response");
+
+  bool refused = false;
+  try {
+    Client late("127.0.0.1", 8100, std::chrono::milliseconds(500));
+  } catch (ConnectionError& e) {
+    refused = true;
+  }
+  expect(refused, "drained server stops accepting");
+}
+
+void check_aborted_thread() {
+  Server server;
+  server.set_port(8101).use_threads().add_handler(stuck_handler);
+  if (!start(server)) {
+    return;
+  }
+
+  Client client("127.0.0.1", 8101);
+  usleep(50000);
+  DrainReport report = server.drain(200);
+  expect(report.in_flight == 1 && report.aborted == 1,
+         "stuck thread client is cut off");
+  char line[64];
+  expect(client.readline(line, sizeof(line)) == 0, "client sees the close");
+
+  // a stopped thread mode server can be configured again
+  bool running = false;
+  try {
+    server.set_port(8101);
+  } catch (ConfigurationError& e) {
+    running = true;
+  }
+  expect(!running, "thread mode server stops");
+}
+
+void check_aborted_event_loop() {
+  Server server;
+  server.set_port(8102).use_event_loop().add_event_handler(idle_handler);
+  if (!start(server)) {
+    return;
+  }
+
+  Client client("127.0.0.1", 8102);
+  usleep(50000);
+  DrainReport report = server.drain(100);
+  expect(report.in_flight == 1 && report.aborted == 1,
+         "idle connection is closed at the deadline");
+}
+
+void reply_a(Client* client, client_data_ptr_t) {
+  char reply[] = "A\n";
+  client->writen(reply, strlen(reply));
+}
+
+void reply_b(Client* client, client_data_ptr_t) {
+  char reply[] = "B\n";
+  client->writen(reply, strlen(reply));
+}
+
+void check_handoff() {
+  unlink(HANDOFF_PATH);
+  Server old_server, new_server;
+  old_server.set_port(8103).set_handoff_path(HANDOFF_PATH).add_handler(
+      reply_a);
+  new_server.set_port(8103).set_handoff_path(HANDOFF_PATH).add_handler(
+      reply_b);
+  if (!start(old_server)) {
+    return;
+  }
+
+  char line[64] = {};
+  Client first("127.0.0.1", 8103);
+  first.readline(line, sizeof(line));
+  expect(strcmp(line, "A\n") == 0, "first server serves");
+
+  if (!start(new_server)) {
+    return;
+  }
+  memset(line, 0, sizeof(line));
+  Client second("127.0.0.1", 8103);
+  second.readline(line, sizeof(line));
+  expect(strcmp(line, "B\n") == 0, "replacement serves the same port");
+
+  DrainReport report = old_server.drain(1000);
+  expect(report.handed_off, "listeners were handed off");
+  struct stat st;
+  expect(stat(HANDOFF_PATH, &st) == 0, "replacement keeps the handoff path");
+
+  new_server.stop();
+  expect(stat(HANDOFF_PATH, &st) < 0, "handoff path is removed on stop");
+}
+
+// idle workers wait for a client and for the stop together, so a stop is
+// never missed while they (or the master) go back to waiting
+void check_prefork() {
+  Server server;
+  server.set_port(8118).use_prefork(2).add_handler(reply_a);
+  for (int round = 0; round < 5; round++) {
+    if (!start(server)) {
+      return;
+    }
+    char line[64] = {};
+    {
+      Client client("127.0.0.1", 8118);
+      client.readline(line, sizeof(line));
+    }
+    expect(strcmp(line, "A\n") == 0, "prefork worker serves");
+
+    auto begin = std::chrono::steady_clock::now();
+    DrainReport report = server.drain(2000);
+    auto took = std::chrono::steady_clock::now() - begin;
+    expect(report.aborted == 0, "prefork workers finish their clients");
+    expect(took < std::chrono::milliseconds(500),
+           "idle prefork workers stop at once");
+  }
+}
+
+int main() {
+  check_completed();
+  check_aborted_thread();
+  check_aborted_event_loop();
+  check_handoff();
+  check_prefork();
+
+  if (failures == 0) {
+    std::cout << "Drain test passed!" << std::endl;
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,136 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <vector>
+
+#include "tcp/client.hpp"
+#include "tcp/error.hpp"
+#include "tcp/server.hpp"
+
+using namespace tcp;
+
+// echo everything back until the peer goes away
+bool echo_handler(Client* client, uint32_t events, client_data_ptr_t) {
+  if (!(events & Readable)) {
+    return true;
+  }
+  char buffer[256];
+  while (true) {
+    ssize_t n = client->read(buffer, sizeof(buffer));
+    if (n < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    if (n == 0) {
+      return false;
+    }
+    if (client->writen(buffer, n) < 0) {
+      return false;
+    }
+  }
+}
+
+// far more than the socket buffers take at once
+#define REPLY_SIZE (8 << 20)
+
+// read the request, answer once the peer has finished sending
+bool reply_handler(Client* client, uint32_t events, client_data_ptr_t) {
+  char buffer[256];
+  while (client->read(buffer, sizeof(buffer)) > 0) {
+  }
+  if (events & Hangup) {
+    std::vector<char> reply(REPLY_SIZE, 'r');
+    client->send(reply.data(), reply.size());
+  }
+  return true;
+}
+
+// a peer that half-closes still gets its whole reply, returns the failure
+// count
+int check_half_close(unsigned int port, bool io_uring) {
+  Server server;
+  try {
+    server.set_port(port).use_event_loop().add_event_handler(reply_handler);
+    if (io_uring) {
+      server.use_io_uring();
+    }
+    server.start();
+  } catch (ConfigurationError& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+  usleep(200000);
+
+  Client client("127.0.0.1", port);
+  char request[] = "request";
+  client.writen(request, strlen(request));
+  shutdown(client.get_fd(), SHUT_WR);
+  // the reply is queued before anything reads it
+  usleep(200000);
+  size_t received = 0;
+  char buffer[65536];
+  ssize_t n;
+  while ((n = client.read(buffer, sizeof(buffer))) > 0) {
+    received += n;
+  }
+  server.stop();
+  if (received != REPLY_SIZE) {
+    std::cerr << "Half-closed peer got " << received << " of " << REPLY_SIZE
+              << " bytes" << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+// run echo clients against an event loop server, returns the failure count
+int check_server(unsigned int port, bool io_uring) {
+  Server server;
+  try {
+    server.set_port(port)
+        .use_event_loop()
+        .add_event_handler(echo_handler)
+        .set_max_clients(16);
+    if (io_uring) {
+      server.use_io_uring();
+    }
+    server.start();
+  } catch (ConfigurationError& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+  // give the server a moment to bind
+  usleep(200000);
+
+  int failures = 0;
+  {
+    Client first("127.0.0.1", port);
+    Client second("::1", port);
+    for (auto client : {&first, &second}) {
+      char msg[] = "Hello, event loop!\n";
+      char reply[64];
+      client->writen(msg, strlen(msg));
+      client->readline(reply, sizeof(reply));
+      if (strcmp(msg, reply) != 0) {
+        std::cerr << "Expected: " << msg << "Received: " << reply << std::endl;
+        failures++;
+      }
+    }
+  }
+  server.stop();
+  return failures;
+}
+
+int main() {
+  int failures = check_server(8081, false);
+  // falls back to epoll where io_uring is not available
+  failures += check_server(8085, true);
+  failures += check_half_close(8116, false);
+  failures += check_half_close(8117, true);
+
+  if (failures == 0) {
+    std::cout << "Event loop test passed!" << std::endl;
+  }
+  return failures == 0 ? 0 : 1;
+}
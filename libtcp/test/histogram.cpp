@@ -0,0 +1,77 @@
+#include "tcp/histogram.hpp"
+
+#include <iostream>
+
+using namespace tcp;
+
+int failures = 0;
+
+void expect(bool ok, const char* what) {
+  if (!ok) {
+    std::cerr << "Failed: " << what << std::endl;
+    failures++;
+  }
+}
+
+void check_buckets() {
+  bool exact = true;
+  for (unsigned long value = 0; value < 16; value++) {
+    exact = exact && Histogram::bucket_limit(Histogram::bucket_of(value)) ==
+                         value;
+  }
+  expect(exact, "small values get buckets of their own");
+
+  // every value lands in a bucket whose limit is at most 1/8 above it
+  bool bounded = true;
+  unsigned int last = 0;
+  for (unsigned long value = 1; value < 1UL << 40; value = value * 3 / 2 + 1) {
+    unsigned int bucket = Histogram::bucket_of(value);
+    unsigned long limit = Histogram::bucket_limit(bucket);
+    bounded = bounded && bucket >= last && limit >= value &&
+              limit - value <= value / Histogram::SUB_BUCKETS;
+    last = bucket;
+  }
+  expect(bounded, "buckets are ordered and tight");
+
+  expect(Histogram::bucket_of(1000) == Histogram::bucket_of(1023) &&
+             Histogram::bucket_of(1024) == Histogram::bucket_of(1024 + 127) &&
+             Histogram::bucket_of(1024 + 127) + 1 ==
+                 Histogram::bucket_of(1024 + 128),
+         "bucket edges");
+  expect(Histogram::bucket_of(~0UL) == Histogram::BUCKETS - 1,
+         "huge values go in the last bucket");
+}
+
+void check_percentiles() {
+  Histogram first{}, second{};
+  for (unsigned long value = 1; value <= 1000; value++) {
+    (value % 2 == 0 ? first : second).record(value);
+  }
+
+  HistogramSnapshot empty;
+  expect(empty.count() == 0 && empty.percentile(0.5) == 0,
+         "empty histogram");
+
+  HistogramSnapshot snapshot;
+  snapshot.add(first);
+  snapshot.add(second);
+  Percentiles percentiles = snapshot.percentiles();
+  expect(percentiles.count == 1000, "shards are summed");
+  expect(percentiles.p50 >= 500 && percentiles.p50 <= 500 + 500 / 8,
+         "median");
+  expect(percentiles.p99 >= 990 && percentiles.p99 <= 990 + 990 / 8,
+         "99th percentile");
+  expect(percentiles.p999 >= 999 && percentiles.max >= 1000 &&
+             percentiles.max <= 1000 + 1000 / 8,
+         "tail");
+}
+
+int main() {
+  check_buckets();
+  check_percentiles();
+
+  if (failures == 0) {
+    std::cout << "Histogram test passed!" << std::endl;
+  }
+  return failures == 0 ? 0 : 1;
+}
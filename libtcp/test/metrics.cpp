@@ -0,0 +1,173 @@
+#include "tcp/metrics.hpp"
+
+#include <string.h>
+#include <unistd.h>
+
+#include <iostream>
+
+#include "tcp/client.hpp"
+#include "tcp/error.hpp"
+#include "tcp/server.hpp"
+
+using namespace tcp;
+
+#define METRICS_NAME "/libtcp-metrics-test"
+
+int failures = 0;
+
+void expect(bool ok, const char* what) {
+  if (!ok) {
+    std::cerr << "Failed: " << what << std::endl;
+    failures++;
+  }
+}
+
+bool start(Server& server) {
+  try {
+    server.start();
+  } catch (ConfigurationError& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    failures++;
+    return false;
+  }
+  usleep(200000);
+  return true;
+}
+
+void echo_line(Client* client, client_data_ptr_t) {
+  char line[64];
+  size_t len = client->readline(line, sizeof(line));
+  client->writen(line, len);
+}
+
+// send a line and wait for the echo and the close
+void talk(int port) {
+  Client client("127.0.0.1", port);
+  char line[64] = "hello metrics\n";
+  client.writen(line, strlen(line));
+  client.readline(line, sizeof(line));
+  client.readline(line, sizeof(line));
+}
+
+void check_fork() {
+  Server server;
+  server.set_port(8105).set_metrics_name(METRICS_NAME).add_handler(echo_line);
+  if (!start(server)) {
+    return;
+  }
+
+  talk(8105);
+  talk(8105);
+  usleep(100000);
+  Metrics metrics = server.get_metrics();
+  expect(metrics.accepts == 2 && metrics.closed == 2 && metrics.active == 0,
+         "forked clients are counted");
+  expect(metrics.bytes_in == 2 * 14 && metrics.bytes_out == 2 * 14,
+         "payload bytes are counted");
+  expect(metrics.handler_calls == 2 && metrics.handler_ns > 0,
+         "handler time is counted");
+
+  Metrics published = {};
+  expect(MetricsRegistry::read(METRICS_NAME, published) == 0 &&
+             published.accepts == 2,
+         "named segment can be read");
+  server.stop();
+}
+
+void check_drops() {
+  Server server;
+  server.set_port(8106).use_threads().set_max_clients(1).add_handler(
+      echo_line);
+  if (!start(server)) {
+    return;
+  }
+
+  Client first("127.0.0.1", 8106);
+  usleep(50000);
+  Client second("127.0.0.1", 8106);
+  char line[64];
+  expect(second.readline(line, sizeof(line)) == 0, "second client dropped");
+  Metrics metrics = server.get_metrics();
+  expect(metrics.accepts == 2 && metrics.drops == 1 && metrics.active == 1,
+         "drops at max clients are counted");
+  server.stop();
+}
+
+bool greet(Client* client, uint32_t events, client_data_ptr_t) {
+  if (events & Connected) {
+    char line[] = "hi\n";
+    client->writen(line, strlen(line));
+    return false;
+  }
+  return true;
+}
+
+void check_event_loop() {
+  Server server;
+  server.set_port(8107).use_event_loop().add_event_handler(greet);
+  if (!start(server)) {
+    return;
+  }
+
+  {
+    Client client("127.0.0.1", 8107);
+    char line[64];
+    client.readline(line, sizeof(line));
+  }
+  usleep(50000);
+  Metrics metrics = server.get_metrics();
+  expect(metrics.accepts == 1 && metrics.closed == 1 && metrics.active == 0 &&
+             metrics.handler_calls == 1 && metrics.bytes_out == 3,
+         "event loop connections are counted");
+  server.stop();
+}
+
+void check_latency() {
+  Server server;
+  server.set_port(8115).add_handler(echo_line).add_handler(
+      [&server](Client* client) {
+        ScopedTimer timer(server.get_registry(), "reply");
+        usleep(20000);
+        echo_line(client, nullptr);
+      });
+  if (!start(server)) {
+    return;
+  }
+
+  // round robin sends one client to each handler
+  talk(8115);
+  talk(8115);
+  usleep(100000);
+  HandlerLatency fast = server.get_latency(0);
+  HandlerLatency slow = server.get_latency(1);
+  expect(fast.lifetime_ns.count == 1 && fast.first_byte_ns.count == 1 &&
+             fast.bytes_per_sec.count == 1 && fast.bytes_per_sec.p50 > 0,
+         "sessions are recorded per handler");
+  expect(slow.lifetime_ns.count == 1 &&
+             slow.first_byte_ns.p50 >= 20000000 &&
+             slow.lifetime_ns.max >= slow.first_byte_ns.max,
+         "slow handler shows in its latency");
+  expect(server.get_latency(2).lifetime_ns.count == 0, "unknown handler");
+
+  Percentiles reply = server.get_registry().phase_latency("reply");
+  expect(reply.count == 1 && reply.p50 >= 20000000,
+         "phase is timed across processes");
+  expect(server.get_registry().phase_latency("lookup").count == 0,
+         "untimed phase");
+  server.stop();
+}
+
+int main() {
+  check_fork();
+  Metrics metrics;
+  expect(MetricsRegistry::read(METRICS_NAME, metrics) < 0,
+         "named segment is removed with the server");
+  check_drops();
+  check_event_loop();
+  check_latency();
+
+  if (failures == 0) {
+    std::cout << "Metrics test passed!" << std::endl;
+  }
+  return failures == 0 ? 0 : 1;
+}
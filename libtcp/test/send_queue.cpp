@@ -0,0 +1,296 @@
+#include "tcp/send_queue.hpp"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "tcp/client.hpp"
+#include "tcp/error.hpp"
+#include "tcp/server.hpp"
+
+using namespace tcp;
+
+#define MESSAGE_SIZE 1024
+#define SMALL_BUFFER 4096
+
+int failures = 0;
+
+void expect(bool ok, const char* what) {
+  if (!ok) {
+    std::cerr << "Failed: " << what << std::endl;
+    failures++;
+  }
+}
+
+// loopback listener whose accepted peer reads only when the test says so
+int listen_on(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(fd, 5) < 0) {
+    perror("listen");
+    exit(EXIT_FAILURE);
+  }
+  return fd;
+}
+
+int accept_peer(int listen_fd) {
+  int fd = accept(listen_fd, nullptr, nullptr);
+  int size = SMALL_BUFFER;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  return fd;
+}
+
+// message i is MESSAGE_SIZE copies of the byte i
+void make_message(char* message, size_t i) {
+  memset(message, (char)i, MESSAGE_SIZE);
+}
+
+// read count messages from fd, false if any byte is out of place
+bool receive_messages(int fd, size_t count, bool slowly = false) {
+  char message[MESSAGE_SIZE];
+  for (size_t i = 0; i < count; i++) {
+    size_t n = 0;
+    while (n < MESSAGE_SIZE) {
+      ssize_t n_read = read(fd, message + n, MESSAGE_SIZE - n);
+      if (n_read <= 0) {
+        return false;
+      }
+      n += n_read;
+    }
+    for (char c : message) {
+      if (c != (char)i) {
+        return false;
+      }
+    }
+    if (slowly) {
+      usleep(100);
+    }
+  }
+  return true;
+}
+
+void check_drop(int listen_fd) {
+  Client client("127.0.0.1", 8096);
+  int peer_fd = accept_peer(listen_fd);
+  int size = SMALL_BUFFER;
+  setsockopt(client.get_fd(), SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+  int full = 0, drained = 0;
+  client.set_send_queue(64 * 1024, 16 * 1024, Client::Drop);
+  client.set_send_callbacks([&full]() { full++; }, [&drained]() { drained++; });
+
+  char message[MESSAGE_SIZE];
+  size_t sent = 0;
+  ssize_t n;
+  while (true) {
+    make_message(message, sent);
+    if ((n = client.send(message, sizeof(message))) < 0) {
+      break;
+    }
+    sent++;
+  }
+  expect(errno == ENOBUFS, "overflowing send fails with ENOBUFS");
+  expect(client.queued() <= 64 * 1024, "queue stays under the watermark");
+  expect(!client.writable() && full == 1, "full queue is reported");
+
+  // the peer catches up while the queue is flushed
+  std::thread reader([&]() {
+    expect(receive_messages(peer_fd, sent), "queued messages arrive in order");
+  });
+  while (client.queued() > 0) {
+    struct pollfd pfd = {client.get_fd(), POLLOUT, 0};
+    poll(&pfd, 1, -1);
+    client.flush();
+  }
+  reader.join();
+  expect(client.writable() && drained == 1, "drained queue is reported");
+  close(peer_fd);
+}
+
+void check_disconnect(int listen_fd) {
+  Client client("127.0.0.1", 8096);
+  int peer_fd = accept_peer(listen_fd);
+
+  client.set_send_queue(16 * 1024, 4 * 1024, Client::Disconnect);
+  char message[MESSAGE_SIZE] = {};
+  while (client.send(message, sizeof(message)) > 0) {
+  }
+  expect(errno == ECONNRESET, "overflowing send disconnects");
+  expect(client.send(message, sizeof(message)) < 0 && errno == EPIPE,
+         "send after disconnect fails");
+
+  ssize_t n;
+  while ((n = read(peer_fd, message, sizeof(message))) > 0) {
+  }
+  expect(n == 0, "peer sees the connection close");
+  close(peer_fd);
+}
+
+void check_block(int listen_fd) {
+  Client client("127.0.0.1", 8096);
+  int peer_fd = accept_peer(listen_fd);
+
+  size_t count = 2048;
+  std::thread reader([&]() {
+    expect(receive_messages(peer_fd, count, true),
+           "blocked messages arrive in order");
+  });
+
+  client.set_send_queue(32 * 1024, 8 * 1024);
+  char message[MESSAGE_SIZE];
+  size_t largest = 0;
+  bool ok = true;
+  for (size_t i = 0; i < count; i++) {
+    make_message(message, i);
+    ok = ok && client.send(message, sizeof(message)) == MESSAGE_SIZE;
+    largest = std::max(largest, client.queued());
+  }
+  expect(ok, "blocking send accepts every message");
+  expect(largest <= 32 * 1024, "blocking send keeps the queue bounded");
+  while (client.queued() > 0) {
+    struct pollfd pfd = {client.get_fd(), POLLOUT, 0};
+    poll(&pfd, 1, -1);
+    client.flush();
+  }
+  reader.join();
+  close(peer_fd);
+}
+
+void check_queue(int listen_fd) {
+  Client client("127.0.0.1", 8096);
+  int peer_fd = accept_peer(listen_fd);
+  int size = SMALL_BUFFER;
+  setsockopt(client.get_fd(), SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+  int full = 0;
+  client.set_send_queue(16 * 1024, 4 * 1024, Client::Queue);
+  client.set_send_callbacks([&full]() { full++; }, nullptr);
+  size_t count = 256;
+  char message[MESSAGE_SIZE];
+  bool ok = true;
+  for (size_t i = 0; i < count; i++) {
+    make_message(message, i);
+    ok = ok && client.send(message, sizeof(message)) == MESSAGE_SIZE;
+  }
+  expect(ok, "queueing send accepts every message");
+  expect(client.queued() > 16 * 1024, "queue grows past the watermark");
+  expect(!client.writable() && full == 1, "full queue is reported");
+
+  std::thread reader([&]() {
+    expect(receive_messages(peer_fd, count), "queued messages arrive");
+  });
+  while (client.queued() > 0) {
+    struct pollfd pfd = {client.get_fd(), POLLOUT, 0};
+    poll(&pfd, 1, -1);
+    client.flush();
+  }
+  reader.join();
+  close(peer_fd);
+}
+
+#define BULK_MESSAGES 4096
+
+// queue a few MB at once, the server flushes them as the socket drains
+bool bulk_handler(Client* client, uint32_t events, client_data_ptr_t) {
+  if (events & Connected) {
+    client->set_send_queue(8 << 20, 1 << 20, Client::Drop);
+    char message[MESSAGE_SIZE];
+    for (size_t i = 0; i < BULK_MESSAGES; i++) {
+      make_message(message, i);
+      if (client->send(message, sizeof(message)) < 0) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void check_event_loop() {
+  Server server;
+  try {
+    server.set_port(8097).use_event_loop().add_event_handler(bulk_handler);
+    server.start();
+  } catch (ConfigurationError& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    failures++;
+    return;
+  }
+  usleep(200000);
+
+  Client client("127.0.0.1", 8097);
+  expect(receive_messages(client.get_fd(), BULK_MESSAGES),
+         "event loop flushes the send queue");
+  server.stop();
+}
+
+#define FLOOD_MESSAGES 2048
+
+// more than the default high watermark, queued without touching the policy
+bool flood_handler(Client* client, uint32_t events, client_data_ptr_t) {
+  if (events & Connected) {
+    int size = SMALL_BUFFER;
+    setsockopt(client->get_fd(), SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    char message[MESSAGE_SIZE];
+    for (size_t i = 0; i < FLOOD_MESSAGES; i++) {
+      make_message(message, i);
+      if (client->send(message, sizeof(message)) < 0) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// a client that does not read must not hold up the loop for the others
+void check_event_loop_never_blocks() {
+  Server server;
+  try {
+    server.set_port(8119).use_event_loop().add_event_handler(flood_handler);
+    server.start();
+  } catch (ConfigurationError& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    failures++;
+    return;
+  }
+  usleep(200000);
+
+  Client stalled("127.0.0.1", 8119);
+  usleep(100000);
+  Client reading("127.0.0.1", 8119);
+  struct pollfd pfd = {reading.get_fd(), POLLIN, 0};
+  expect(poll(&pfd, 1, 2000) == 1,
+         "other clients are served while one does not read");
+  expect(receive_messages(reading.get_fd(), FLOOD_MESSAGES),
+         "queued messages reach the reading client");
+  server.stop();
+}
+
+int main() {
+  int listen_fd = listen_on(8096);
+  check_drop(listen_fd);
+  check_disconnect(listen_fd);
+  check_block(listen_fd);
+  check_queue(listen_fd);
+  close(listen_fd);
+  check_event_loop();
+  check_event_loop_never_blocks();
+
+  if (failures == 0) {
+    std::cout << "Send queue test passed!" << std::endl;
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -1,11 +1,172 @@
 #include "tcp/server.hpp"
 
+#include <unistd.h>
+
 #include <iostream>
+#include <string>
+#include <vector>
 
 #include "tcp/error.hpp"
 
 using namespace tcp;
 
+// handler with its own state, numbers the connections it greets
+class Greeter {
+ private:
+  std::string greeting;
+  int count;
+
+ public:
+  explicit Greeter(const std::string& greeting)
+      : greeting(greeting), count(0) {}
+
+  bool operator()(Client* client, uint32_t events) {
+    if (events & Connected) {
+      std::string line = greeting + " " + std::to_string(++count) + "\n";
+      client->writen((void*)line.data(), line.size());
+    }
+    return true;
+  }
+};
+
+int check_stateful_handler() {
+  Server server;
+  try {
+    server.set_port(8089)
+        .use_event_loop()
+        .add_event_handler(Greeter("hello"))
+        .start();
+  } catch (ConfigurationError& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+  usleep(200000);
+
+  int failures = 0;
+  for (int i = 1; i <= 2; i++) {
+    Client client("127.0.0.1", 8089);
+    char line[64];
+    client.readline(line, sizeof(line));
+    std::string expected = "hello " + std::to_string(i) + "\n";
+    if (expected != line) {
+      std::cerr << "Expected: " << expected << "Received: " << line
+                << std::endl;
+      failures++;
+    }
+  }
+  server.stop();
+  return failures;
+}
+
+// one client at a time only works if finished ones are reaped
+int check_reaping() {
+  Server server;
+  try {
+    server.set_port(8104)
+        .set_max_clients(1)
+        .add_handler([](Client* client) {
+          char line[] = "hi\n";
+          client->writen(line, sizeof(line) - 1);
+        })
+        .start();
+  } catch (ConfigurationError& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+  usleep(200000);
+
+  int failures = 0;
+  for (int i = 0; i < 20; i++) {
+    Client client("127.0.0.1", 8104);
+    char line[64];
+    if (client.readline(line, sizeof(line)) == 0) {
+      std::cerr << "Connection " << i << " was dropped" << std::endl;
+      failures++;
+    }
+    // wait for the handler process to exit
+    client.readline(line, sizeof(line));
+    usleep(20000);
+  }
+  server.stop();
+  return failures;
+}
+
+// capturing lambda without the extra data argument
+int check_capturing_handler() {
+  Server server;
+  std::string message = "Hello, lambda!\n";
+  try {
+    server.set_port(8120)
+        .add_handler([message](Client* client) {
+          client->writen((void*)message.data(), message.size());
+        })
+        .start();
+  } catch (ConfigurationError& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+  usleep(200000);
+
+  int failures = 0;
+  Client client("127.0.0.1", 8120);
+  char line[64] = {};
+  client.readline(line, sizeof(line));
+  if (message != line) {
+    std::cerr << "Expected: " << message << "Received: " << line << std::endl;
+    failures++;
+  }
+  server.stop();
+  return failures;
+}
+
+// every connection is counted by the SO_REUSEPORT shard that accepted it
+int check_acceptor_shards() {
+  const unsigned long connections = 40;
+  Server server;
+  try {
+    server.set_port(8122)
+        .set_acceptor_shards(4)
+        .use_threads()
+        .set_max_clients(connections)
+        .add_handler([](Client* client) {
+          char line[] = "hi\n";
+          client->writen(line, sizeof(line) - 1);
+        })
+        .start();
+  } catch (ConfigurationError& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+  usleep(200000);
+
+  for (unsigned long i = 0; i < connections; i++) {
+    Client client("127.0.0.1", 8122);
+    char line[64];
+    client.readline(line, sizeof(line));
+  }
+
+  int failures = 0;
+  std::vector<unsigned long> counts = server.get_shard_accept_counts();
+  unsigned long total = 0, busy = 0;
+  for (unsigned long count : counts) {
+    total += count;
+    busy += count > 0 ? 1 : 0;
+  }
+  if (counts.size() != 4 || total != connections) {
+    std::cerr << "Expected " << connections << " accepts over 4 shards, got "
+              << total << " over " << counts.size() << std::endl;
+    failures++;
+  }
+  // the kernel hashes the source ports, 40 of them all landing on one
+  // shard is vanishingly unlikely
+  if (busy < 2) {
+    std::cerr << "Expected the accepts spread over the shards" << std::endl;
+    failures++;
+  }
+  server.stop();
+  return failures;
+}
+
 int main() {
   Server server;
   try {
@@ -21,5 +182,9 @@ int main() {
   }
   server.stop();
 
-  return 0;
-}
\ No newline at end of file
+  int failures = check_capturing_handler();
+  failures += check_stateful_handler();
+  failures += check_reaping();
+  failures += check_acceptor_shards();
+  return failures == 0 ? 0 : 1;
+}
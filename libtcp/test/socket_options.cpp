@@ -0,0 +1,123 @@
+#include "tcp/socket_options.hpp"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <iostream>
+
+#include "tcp/client.hpp"
+#include "tcp/error.hpp"
+#include "tcp/server.hpp"
+
+using namespace tcp;
+
+int failures = 0;
+
+void expect(bool ok, const char* what) {
+  if (!ok) {
+    std::cerr << "Failed: " << what << std::endl;
+    failures++;
+  }
+}
+
+int get_int(int sock_fd, int level, int name) {
+  int value = -1;
+  socklen_t len = sizeof(value);
+  getsockopt(sock_fd, level, name, &value, &len);
+  return value;
+}
+
+// report the options the accepted socket inherited from the listener
+void report_handler(Client* client, client_data_ptr_t) {
+  char report[64];
+  int len = snprintf(report, sizeof(report), "%d %d\n",
+                     get_int(client->get_fd(), IPPROTO_TCP, TCP_NODELAY),
+                     get_int(client->get_fd(), SOL_SOCKET, SO_BUSY_POLL));
+  client->writen(report, len);
+}
+
+void check_server() {
+  Server server;
+  try {
+    server.set_port(8098)
+        .set_socket_options(SocketOptions::low_latency())
+        .add_handler(report_handler);
+    server.start();
+  } catch (ConfigurationError& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    failures++;
+    return;
+  }
+  usleep(200000);
+
+  bool running = true;
+  try {
+    server.set_socket_options(SocketOptions());
+  } catch (ConfigurationError& e) {
+    running = false;
+  }
+  expect(!running, "options are fixed while the server runs");
+
+  Client client("127.0.0.1", 8098);
+  char report[64] = {};
+  client.readline(report, sizeof(report));
+  expect(strcmp(report, "1 50\n") == 0, "accepted sockets inherit options");
+  server.stop();
+}
+
+void check_client() {
+  Server server;
+  try {
+    server.set_port(8099).add_handler(report_handler);
+    server.start();
+  } catch (ConfigurationError& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    failures++;
+    return;
+  }
+  usleep(200000);
+
+  Client plain("127.0.0.1", 8099);
+  Client bulk("127.0.0.1", 8099, SocketOptions::bulk_throughput());
+  int fd = bulk.get_fd();
+  expect(get_int(plain.get_fd(), SOL_SOCKET, SO_KEEPALIVE) == 0,
+         "default profile changes nothing");
+  expect(get_int(fd, SOL_SOCKET, SO_KEEPALIVE) == 1 &&
+             get_int(fd, IPPROTO_TCP, TCP_KEEPIDLE) == 60 &&
+             get_int(fd, IPPROTO_TCP, TCP_KEEPCNT) == 6,
+         "keepalive is set");
+  // capped by net.core.rmem_max, but never below the default
+  expect(get_int(fd, SOL_SOCKET, SO_RCVBUF) >=
+             get_int(plain.get_fd(), SOL_SOCKET, SO_RCVBUF),
+         "receive buffer is grown");
+  server.stop();
+}
+
+int main() {
+  SocketOptions none;
+  int fd = socket(AF_INET6, SOCK_STREAM, 0);
+  expect(none.apply(fd) == 0 &&
+             get_int(fd, IPPROTO_TCP, TCP_NODELAY) == 0,
+         "empty profile");
+  SocketOptions bad;
+  bad.keep_alive = true;
+  // at most 127 probes
+  bad.keep_count = 1000;
+  bad.no_delay = true;
+  expect(bad.apply(fd) < 0, "rejected option is reported");
+  expect(get_int(fd, IPPROTO_TCP, TCP_NODELAY) == 1,
+         "other options are still set");
+  close(fd);
+
+  check_server();
+  check_client();
+
+  if (failures == 0) {
+    std::cout << "Socket options test passed!" << std::endl;
+  }
+  return failures == 0 ? 0 : 1;
+}
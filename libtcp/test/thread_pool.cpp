@@ -0,0 +1,145 @@
+#include <dirent.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tcp/client.hpp"
+#include "tcp/error.hpp"
+#include "tcp/server.hpp"
+
+using namespace tcp;
+
+#define WORKERS 4
+#define MAX_CLIENTS 3
+#define CLIENTS 6
+
+// handlers running right now, the most seen at once, and finished ones
+std::atomic<int> running(0);
+std::atomic<int> peak(0);
+std::atomic<int> started(0);
+std::atomic<int> finished(0);
+
+// echo a line slowly enough for the clients to overlap
+void slow_echo(Client* client) {
+  started++;
+  int now = ++running;
+  int seen = peak.load();
+  while (now > seen && !peak.compare_exchange_weak(seen, now)) {
+  }
+  char line[64];
+  size_t len = client->readline(line, sizeof(line));
+  usleep(100000);
+  client->writen(line, len);
+  running--;
+  finished++;
+}
+
+// threads of this process, the pool's workers among them
+int count_threads() {
+  DIR* dir = opendir("/proc/self/task");
+  if (dir == nullptr) {
+    return -1;
+  }
+  int count = 0;
+  while (struct dirent* entry = readdir(dir)) {
+    if (entry->d_name[0] != '.') {
+      count++;
+    }
+  }
+  closedir(dir);
+  return count;
+}
+
+// clients at once, a dropped one is closed instead of echoed
+int check_concurrent_clients() {
+  std::atomic<int> served(0);
+  std::vector<std::thread> clients;
+  for (int i = 0; i < CLIENTS; i++) {
+    clients.emplace_back([&served, i]() {
+      try {
+        Client client("127.0.0.1", 8121);
+        std::string message = "client " + std::to_string(i) + "\n";
+        client.writen((void*)message.data(), message.size());
+        // a dropped client gets reset, where readline would exit
+        char line[64];
+        ssize_t len = client.read(line, sizeof(line));
+        if (len > 0 && message == std::string(line, len)) {
+          served++;
+        }
+      } catch (ConnectionError& e) {
+      }
+    });
+  }
+  for (std::thread& client : clients) {
+    client.join();
+  }
+
+  int failures = 0;
+  if (served < 2 || peak < 2) {
+    std::cerr << "Expected clients served concurrently, served: " << served
+              << " at most " << peak << " at once" << std::endl;
+    failures++;
+  }
+  if (peak > MAX_CLIENTS) {
+    std::cerr << "Expected at most " << MAX_CLIENTS
+              << " handlers at once, saw: " << peak << std::endl;
+    failures++;
+  }
+  return failures;
+}
+
+// stop() lets the handler that is running finish and joins the workers
+int check_stop(Server& server, int threads_before) {
+  Client client("127.0.0.1", 8121);
+  char line[] = "last\n";
+  client.writen(line, sizeof(line) - 1);
+  usleep(50000);
+  server.stop();
+
+  int failures = 0;
+  if (running != 0 || started != finished) {
+    std::cerr << "Expected no handlers after stop, running: " << running
+              << std::endl;
+    failures++;
+  }
+  int threads_after = count_threads();
+  if (threads_after != threads_before) {
+    std::cerr << "Expected " << threads_before
+              << " threads after stop, found: " << threads_after << std::endl;
+    failures++;
+  }
+  return failures;
+}
+
+int main() {
+  // the pool runs in this process, and the handler stop() cuts short
+  // writes to a shut down socket
+  signal(SIGPIPE, SIG_IGN);
+  int threads_before = count_threads();
+  Server server;
+  try {
+    server.set_port(8121)
+        .use_thread_pool(WORKERS)
+        .set_max_clients(MAX_CLIENTS)
+        .add_handler(slow_echo)
+        .start();
+  } catch (ConfigurationError& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+  usleep(200000);
+
+  int failures = check_concurrent_clients();
+  failures += check_stop(server, threads_before);
+
+  if (failures == 0) {
+    std::cout << "Thread pool test passed!" << std::endl;
+  }
+  return failures == 0 ? 0 : 1;
+}
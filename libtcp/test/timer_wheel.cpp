@@ -0,0 +1,198 @@
+#include "tcp/timer_wheel.hpp"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "tcp/client.hpp"
+#include "tcp/coroutine.hpp"
+#include "tcp/error.hpp"
+#include "tcp/server.hpp"
+
+using namespace tcp;
+
+#define NUM_TIMERS 500
+
+int failures = 0;
+
+void expect(bool ok, const char* what) {
+  if (!ok) {
+    std::cerr << "Failed: " << what << std::endl;
+    failures++;
+  }
+}
+
+void check_wheel() {
+  TimerWheel wheel;
+  auto start = std::chrono::steady_clock::now();
+  std::mt19937 random(7);
+
+  std::vector<long> due(NUM_TIMERS), fired(NUM_TIMERS, -1);
+  std::vector<TimerWheel::TimerId> ids(NUM_TIMERS);
+  for (int i = 0; i < NUM_TIMERS; i++) {
+    // spans the first two levels of the wheel
+    due[i] = random() % 400;
+    ids[i] = wheel.add(due[i], [&, i]() {
+      fired[i] = std::chrono::duration_cast<std::chrono::milliseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+    });
+  }
+  for (int i = 0; i < NUM_TIMERS; i += 5) {
+    expect(wheel.cancel(ids[i]), "cancel a pending timer");
+  }
+  expect(!wheel.cancel(ids[0]), "cancel twice");
+
+  // timers added while the wheel runs
+  bool nested = false;
+  wheel.add(50, [&]() { wheel.add(10, [&]() { nested = true; }); });
+
+  while (!wheel.empty()) {
+    int timeout_ms = wheel.next_timeout_ms();
+    usleep(timeout_ms * 1000);
+    wheel.advance();
+  }
+
+  int early = 0, late = 0, wrong = 0;
+  for (int i = 0; i < NUM_TIMERS; i++) {
+    if (i % 5 == 0) {
+      wrong += fired[i] >= 0;
+    } else if (fired[i] < due[i]) {
+      early++;
+    } else if (fired[i] > due[i] + 50) {
+      late++;
+    }
+  }
+  expect(wrong == 0, "cancelled timers never run");
+  expect(early == 0, "no timer runs early");
+  expect(late == 0, "timers run within 50ms of their deadline");
+  expect(nested, "timer added by a timer");
+  expect(!wheel.cancel(ids[1]), "cancel after running");
+  expect(wheel.next_timeout_ms() == -1, "no timeout without timers");
+}
+
+// timers added part way through a millisecond still wait their full delay
+void check_never_early() {
+  TimerWheel wheel;
+  std::mt19937 random(11);
+  int early = 0;
+  for (int i = 0; i < 100; i++) {
+    usleep(random() % 1000);
+    uint64_t delay_ms = 1 + random() % 3;
+    auto added = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::duration waited{};
+    wheel.add(delay_ms,
+              [&]() { waited = std::chrono::steady_clock::now() - added; });
+    while (!wheel.empty()) {
+      wheel.advance();
+    }
+    early += waited < std::chrono::milliseconds(delay_ms);
+  }
+  expect(early == 0, "no timer runs before its delay has passed");
+}
+
+// echo everything back until the peer goes away
+bool echo_handler(Client* client, uint32_t events, client_data_ptr_t) {
+  char buffer[256];
+  ssize_t n;
+  while (events & Readable && (n = client->read(buffer, sizeof(buffer))) > 0) {
+    client->writen(buffer, n);
+  }
+  return true;
+}
+
+// say so when no line arrives in time
+void blocking_handler(Client* client, client_data_ptr_t) {
+  char line[64];
+  if (client->read(line, sizeof(line)) < 0 && errno == EAGAIN) {
+    client->writen((void*)"timeout\n", 8);
+  }
+}
+
+Task<void> coroutine_handler(AsyncClient* client, client_data_ptr_t) {
+  std::string line;
+  if (co_await client->read_until(line, "\n") < 0 && errno == ETIMEDOUT) {
+    co_await client->write("timeout\n", 8);
+  }
+}
+
+void check_idle_timeout() {
+  Server server;
+  try {
+    server.set_port(8093)
+        .use_event_loop()
+        .add_event_handler(echo_handler)
+        .set_idle_timeout(200)
+        .start();
+  } catch (ConfigurationError& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    failures++;
+    return;
+  }
+  usleep(200000);
+
+  Client active("127.0.0.1", 8093);
+  Client idle("127.0.0.1", 8093);
+  char msg[] = "ping\n";
+  char reply[64];
+  for (int i = 0; i < 5; i++) {
+    active.writen(msg, strlen(msg));
+    active.readline(reply, sizeof(reply));
+    usleep(100000);
+  }
+  expect(active.writen(msg, strlen(msg)) > 0 &&
+             active.readline(reply, sizeof(reply)) > 0,
+         "busy connection stays open");
+  expect(idle.read(reply, sizeof(reply)) == 0, "idle connection is closed");
+  server.stop();
+}
+
+void check_read_timeout(unsigned int port, bool coroutines) {
+  Server server;
+  try {
+    server.set_port(port).set_read_timeout(200);
+    if (coroutines) {
+      server.use_coroutines(1).add_coroutine_handler(coroutine_handler);
+    } else {
+      server.use_threads().add_handler(blocking_handler);
+    }
+    server.start();
+  } catch (ConfigurationError& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    failures++;
+    return;
+  }
+  usleep(200000);
+
+  auto start = std::chrono::steady_clock::now();
+  Client client("127.0.0.1", port);
+  char reply[64] = {};
+  client.readline(reply, sizeof(reply));
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  expect(strcmp(reply, "timeout\n") == 0, coroutines
+                                              ? "coroutine read times out"
+                                              : "blocking read times out");
+  expect(elapsed >= std::chrono::milliseconds(200) &&
+             elapsed < std::chrono::seconds(1),
+         "read timeout is honoured");
+  server.stop();
+}
+
+int main() {
+  check_wheel();
+  check_never_early();
+  check_idle_timeout();
+  check_read_timeout(8094, false);
+  check_read_timeout(8095, true);
+
+  if (failures == 0) {
+    std::cout << "Timer wheel test passed!" << std::endl;
+  }
+  return failures == 0 ? 0 : 1;
+}
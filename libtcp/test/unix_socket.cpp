@@ -0,0 +1,158 @@
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <iostream>
+
+#include "tcp/client.hpp"
+#include "tcp/coroutine.hpp"
+#include "tcp/error.hpp"
+#include "tcp/server.hpp"
+
+using namespace tcp;
+
+#define SOCKET_PATH "/tmp/libtcp-unix-test.sock"
+
+int failures = 0;
+
+void expect(bool ok, const char* what) {
+  if (!ok) {
+    std::cerr << "Failed: " << what << std::endl;
+    failures++;
+  }
+}
+
+bool start(Server& server) {
+  try {
+    server.start();
+  } catch (ConfigurationError& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    failures++;
+    return false;
+  }
+  usleep(200000);
+  return true;
+}
+
+// echo a line with the peer address in front
+void echo_peer(Client* client, client_data_ptr_t) {
+  char line[64];
+  size_t len = client->readline(line, sizeof(line));
+  std::string reply = std::string(client->peer_ip()) + " " +
+                      std::string(line, len);
+  client->writen(reply.data(), reply.size());
+}
+
+std::string echo(const char* path) {
+  Client client(path, 0);
+  char line[64] = "hello\n";
+  client.writen(line, strlen(line));
+  memset(line, 0, sizeof(line));
+  client.readline(line, sizeof(line));
+  return line;
+}
+
+std::atomic<bool> async_echoed(false);
+
+Task<void> async_client() {
+  auto client = co_await connect(SOCKET_PATH, 0);
+  if (!client) {
+    perror("connect");
+    co_return;
+  }
+  std::string msg = "hello\n", reply;
+  co_await client->write(msg.data(), msg.size());
+  co_await client->read_until(reply, "\n");
+  async_echoed = reply == "unix hello\n";
+}
+
+void check_modes() {
+  Server fork_server, thread_server;
+  fork_server.set_ip_addr(SOCKET_PATH).add_handler(echo_peer);
+  thread_server.set_ip_addr(SOCKET_PATH).use_threads().add_handler(echo_peer);
+
+  if (!start(fork_server)) {
+    return;
+  }
+  expect(echo(SOCKET_PATH) == "unix hello\n", "fork mode serves the path");
+  fork_server.stop();
+  struct stat st;
+  expect(stat(SOCKET_PATH, &st) < 0, "path is removed on stop");
+
+  if (!start(thread_server)) {
+    return;
+  }
+  expect(echo(SOCKET_PATH) == "unix hello\n", "thread mode serves the path");
+  {
+    IoContext context(1);
+    context.spawn(async_client());
+    for (int i = 0; i < 20 && !async_echoed; i++) {
+      usleep(50000);
+    }
+  }
+  expect(async_echoed, "coroutine clients connect to the path");
+  thread_server.stop();
+}
+
+// a socket file nobody listens on any more
+void check_stale_path() {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, SOCKET_PATH);
+  unlink(SOCKET_PATH);
+  bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+  close(fd);
+
+  Server server;
+  server.set_ip_addr(SOCKET_PATH).add_handler(echo_peer);
+  if (!start(server)) {
+    return;
+  }
+  expect(echo(SOCKET_PATH) == "unix hello\n", "stale socket file is replaced");
+
+  // but a live one is not (the second server process exits)
+  Server second;
+  second.set_ip_addr(SOCKET_PATH).add_handler(echo_peer);
+  start(second);
+  expect(echo(SOCKET_PATH) == "unix hello\n", "running server keeps its path");
+  second.stop();
+  server.stop();
+}
+
+void check_errors() {
+  bool refused = false;
+  try {
+    Client client("/tmp/libtcp-unix-test-missing.sock", 0,
+                  std::chrono::milliseconds(100));
+  } catch (ConnectionError& e) {
+    refused = true;
+  }
+  expect(refused, "missing path fails to connect");
+
+  Server server;
+  bool rejected = false;
+  try {
+    server.set_ip_addr(SOCKET_PATH).set_acceptor_shards(2).add_handler(
+        echo_peer);
+    server.start();
+  } catch (ConfigurationError& e) {
+    rejected = true;
+  }
+  expect(rejected, "acceptor shards need TCP");
+}
+
+int main() {
+  check_modes();
+  check_stale_path();
+  check_errors();
+
+  if (failures == 0) {
+    std::cout << "Unix socket test passed!" << std::endl;
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -3,6 +3,8 @@
 
 #include <arpa/inet.h>
 
+#include <chrono>
+
 namespace udp {
 
 class Client {
@@ -11,6 +13,14 @@ class Client {
   int sockfd;
   char peer_ip_addr[INET6_ADDRSTRLEN];
   bool connected_to_ephemeral_port = false;
+  // payload moved so far, reported to the server's metrics
+  unsigned long bytes_in = 0;
+  unsigned long bytes_out = 0;
+  // when the client was set up, and when its first byte was written (the
+  // epoch until then)
+  std::chrono::steady_clock::time_point opened =
+      std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point first_write;
 
  public:
   // connect to server
@@ -27,11 +37,18 @@ class Client {
   // ip address of the peer
   const char* peer_ip() const { return peer_ip_addr; }
 
+  // session timing, read by the server's latency histograms
+  std::chrono::steady_clock::time_point opened_at() const { return opened; }
+  std::chrono::steady_clock::time_point first_write_at() const {
+    return first_write;
+  }
+
  private:
   // connect back to client
   Client(const struct sockaddr_in6& client_addr);
   void connect_to_ephemeral_port(const struct sockaddr_in6& server_addr);
 
+  friend class MetricsRegistry;
   friend class Server;
 };
 
@@ -0,0 +1,84 @@
+#ifndef _UDP_METRICS_HPP_
+#define _UDP_METRICS_HPP_
+
+#include <atomic>
+#include <chrono>
+
+#include "tcp/metrics_segment.hpp"
+#include "udp/client.hpp"
+
+namespace udp {
+
+// the shared memory segment and latency histograms are libtcp's
+using tcp::HandlerLatency;
+using tcp::Histogram;
+using tcp::HistogramSnapshot;
+using tcp::Percentiles;
+using tcp::ScopedTimer;
+
+// totals of a server's counters at one point in time
+struct Metrics {
+  // sessions started by a first packet, and the ones refused at
+  // max_clients
+  unsigned long accepts;
+  unsigned long drops;
+  // sessions being served right now
+  unsigned long active;
+  // sessions served to the end
+  unsigned long closed;
+  // payload of closed sessions, first packet included
+  unsigned long bytes_in;
+  unsigned long bytes_out;
+  // handler invocations and the wall time spent in them
+  unsigned long handler_calls;
+  unsigned long handler_ns;
+};
+
+// lock-free server counters, one shard of them per cpu in a
+// MetricsSegment along with the latency histograms
+class MetricsRegistry : public tcp::MetricsSegment {
+ public:
+  struct alignas(64) Shard {
+    std::atomic<unsigned long> accepts;
+    std::atomic<unsigned long> drops;
+    // opened - closed per shard, only the sum is meaningful
+    std::atomic<unsigned long> active;
+    std::atomic<unsigned long> closed;
+    std::atomic<unsigned long> bytes_in;
+    std::atomic<unsigned long> bytes_out;
+    std::atomic<unsigned long> handler_calls;
+    std::atomic<unsigned long> handler_ns;
+  };
+
+ private:
+  Shard& local() const { return *(Shard*)shard(local_shard()); }
+
+ public:
+  // zeroed counters, one shard per cpu, in anonymous shared memory or in
+  // the POSIX shared memory segment name (shm_open, e.g. "/myserver"), with
+  // histograms for num_slots handlers
+  // returns -1 with errno set on error
+  int create(const char* name = nullptr, unsigned int num_slots = 1);
+  // map the named segment of a running server read only
+  int attach(const char* name);
+
+  Metrics snapshot() const;
+
+  // recording, relaxed atomics on the caller's shard
+  void accepted() const;
+  void dropped() const;
+  void opened() const;
+  // counts the payload of the client (and the first packet, which the
+  // server read) and records its session in the histograms of its handler
+  // slot
+  void closed(const Client& client, unsigned long first_packet,
+              unsigned int slot) const;
+  void handled(std::chrono::steady_clock::duration time) const;
+
+  // read a named segment once, returns -1 with errno set on error
+  static int read(const char* name, Metrics& metrics);
+};
+
+}  // namespace udp
+
+#endif
@@ -1,28 +1,44 @@
 #ifndef _UDP_SERVER_HPP_
 #define _UDP_SERVER_HPP_
 
+#include <functional>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
 #include "udp/client.hpp"
+#include "udp/metrics.hpp"
 
 namespace udp {
 
 typedef void* client_data_ptr_t;
 
-typedef void (*ClientHandlerFunction)(Client*, const char*, size_t,
-                                      client_data_ptr_t);
-typedef void (*TimeoutFunction)();
+// plain functions, stateful lambdas and functors all work as handlers
+typedef std::function<void(Client*, const char*, size_t, client_data_ptr_t)>
+    ClientHandlerFunction;
+typedef std::function<void()> TimeoutFunction;
 
 class Server {
  public:
   class ClientHandler {
    public:
-    enum handle_mode { RoundRobin, Random };
+    // LeastConnections picks the handler with the fewest active sessions
+    // (ties go round robin), PeerHash always gives a client IP the same
+    // handler
+    enum handle_mode { RoundRobin, Random, LeastConnections, PeerHash };
 
    private:
     // operational data
     unsigned int current_handler;
-    std::vector<pid_t> clients;
+    // client processes and their handler slots, reaped when child_fd
+    // reports SIGCHLD
+    std::unordered_map<pid_t, unsigned int> clients;
+    int child_fd;
+    // active sessions per handler slot
+    std::vector<unsigned long> slot_sessions;
+    // counters of the current run (shared with the session processes)
+    MetricsRegistry metrics;
 
     // configuration data
     unsigned int max_clients;
@@ -35,6 +51,9 @@ class Server {
     ClientHandler()
         : current_handler(0),
           clients(),
+          child_fd(-1),
+          slot_sessions(),
+          metrics(),
           max_clients(5),
           handlers(),
           mode(RoundRobin),
@@ -44,7 +63,7 @@ class Server {
     ~ClientHandler();
     void set_max_clients(unsigned int max) { max_clients = max; }
     void add_handler(ClientHandlerFunction handler) {
-      handlers.push_back(handler);
+      handlers.push_back(std::move(handler));
     }
     void set_mode(handle_mode mode) { this->mode = mode; }
     void debug(bool mode) { debug_mode = mode; }
@@ -54,6 +73,12 @@ class Server {
     void set_extra_data(client_data_ptr_t data) { extra_data = data; }
 
     void accept(int server_sock_fd);
+    // pick the handler slot for a new client and count it as a session
+    unsigned int next_handler(const struct sockaddr_in6& client_addr);
+    void release_handler(unsigned int slot) { slot_sessions[slot]--; }
+    // take SIGCHLD through child_fd
+    void watch_children();
+    void unwatch_children();
     void reap_clients();
     void join_clients();
     void terminate_clients();
@@ -75,6 +100,7 @@ class Server {
   unsigned int timeout;
   unsigned int max_timeouts;
   bool debug_mode;
+  std::string metrics_name;
   TimeoutFunction timeout_handler;
 
  public:
@@ -88,6 +114,7 @@ class Server {
         timeout(1),
         max_timeouts(0),
         debug_mode(false),
+        metrics_name(),
         timeout_handler(nullptr) {}
   ~Server();
 
@@ -100,21 +127,50 @@ class Server {
   Server& set_timeout_handler(TimeoutFunction handler);
 
   // client handler configuration
+  // handlers may leave out the trailing extra data argument
   Server& add_handler(ClientHandlerFunction handler);
+  template <typename Handler>
+  Server& add_handler(Handler handler);
   Server& set_handler_mode(ClientHandler::handle_mode mode);
   Server& set_max_clients(unsigned int max_clients);
   Server& add_handler_extra_data(void* data);
   Server& set_initial_packet_buffer_size(size_t size);
+  // also publish the counters in the POSIX shared memory segment name
+  // (e.g. "/myserver"), so MetricsRegistry::read() can watch the server
+  // from another process
+  Server& set_metrics_name(const char* name);
 
   // server operation
   pid_t start();
   void exec();
   void stop(bool force = false);
 
+  // counters of the running (or last) server, summed over all shards
+  Metrics get_metrics() const;
+  // session latency of the handler added slot-th
+  HandlerLatency get_latency(unsigned int slot) const;
+  // for ScopedTimer in handlers, valid while the server runs
+  const MetricsRegistry& get_registry() const {
+    return client_handler.metrics;
+  }
+
  private:
   void run_server();
 };
 
+template <typename Handler>
+Server& Server::add_handler(Handler handler) {
+  if constexpr (std::is_invocable_v<Handler&, Client*, const char*, size_t>) {
+    return add_handler(ClientHandlerFunction(
+        [handler = std::move(handler)](Client* client, const char* packet,
+                                       size_t len, client_data_ptr_t) mutable {
+          handler(client, packet, len);
+        }));
+  } else {
+    return add_handler(ClientHandlerFunction(std::move(handler)));
+  }
+}
+
 }  // namespace udp
 
 #endif
\ No newline at end of file
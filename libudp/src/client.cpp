@@ -1,6 +1,5 @@
 #include "udp/client.hpp"
 
-#include <ctype.h>
 #include <errno.h>
 #include <netdb.h>
 #include <stdio.h>
@@ -10,6 +9,10 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <vector>
+
+#include "dns/resolver.hpp"
+
 namespace udp {
 
 Client::Client(const struct sockaddr_in6 &client_addr) {
@@ -38,61 +41,17 @@ Client::Client(const char *server, int port_no) {
     exit(EXIT_FAILURE);
   }
 
-  bool is_ipv6 = false;
-  for (auto p = server; *p; p++) {
-    if (*p == ':') {
-      is_ipv6 = true;
-      break;
-    }
-  }
-
-  // check for any alphabetic characters in the server address
-  bool is_hostname = false;
-  if (!is_ipv6) {
-    for (auto p = server; *p; p++) {
-      if (isalpha(*p)) {
-        is_hostname = true;
-        break;
-      }
-    }
-  }
-
-  // get the address info if a hostname was provided
-  if (is_hostname) {
-    struct addrinfo hints;
-    struct addrinfo *result;
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_INET6;
-    hints.ai_socktype = SOCK_DGRAM;
-    hints.ai_flags = 0;
-    hints.ai_protocol = 0;
-
-    int s = getaddrinfo(server, nullptr, &hints, &result);
-    if (s != 0) {
-      fprintf(stderr, "UDPClient getaddrinfo: %s\n", gai_strerror(s));
-      exit(EXIT_FAILURE);
-    }
-    // set the peer ip address to the first address in the list
-    if (result->ai_family == AF_INET6) {
-      if (inet_ntop(AF_INET6,
-                    &((struct sockaddr_in6 *)result->ai_addr)->sin6_addr,
-                    peer_ip_addr, sizeof(peer_ip_addr)) == NULL) {
-        perror("UDPClient inet_ntop");
-      }
-    } else {
-      fprintf(stderr, "UDPClient: unsupported address family\n");
-      exit(EXIT_FAILURE);
-    }
-    freeaddrinfo(result);
+  // literals, the hosts file and cached answers resolve without any I/O
+  std::vector<struct in6_addr> addresses;
+  int s = dns::Resolver::get_default().resolve(server, addresses);
+  if (s != 0) {
+    fprintf(stderr, "UDPClient resolve: %s\n", gai_strerror(s));
+    exit(EXIT_FAILURE);
   }
-  // ip address was provided
-  else {  // convert to v6 if it is v4
-    if (!is_ipv6) {
-      snprintf(peer_ip_addr, INET6_ADDRSTRLEN, "::ffff:%s", server);
-    } else {
-      strncpy(peer_ip_addr, server, INET6_ADDRSTRLEN);
-      peer_ip_addr[INET6_ADDRSTRLEN - 1] = '\0';
-    }
+  // datagrams go to the first address
+  if (inet_ntop(AF_INET6, &addresses[0], peer_ip_addr,
+                sizeof(peer_ip_addr)) == NULL) {
+    perror("UDPClient inet_ntop");
   }
 
   sockfd = socket(AF_INET6, SOCK_DGRAM, 0);
@@ -104,10 +63,7 @@ Client::Client(const char *server, int port_no) {
   memset(&server_addr, 0, sizeof(server_addr));
   server_addr.sin6_family = AF_INET6;
   server_addr.sin6_port = htons(port_no);
-  if (inet_pton(AF_INET6, peer_ip_addr, &server_addr.sin6_addr) < 0) {
-    perror("UDPClient inet_pton");
-    exit(EXIT_FAILURE);
-  }
+  server_addr.sin6_addr = addresses[0];
 }
 
 Client::~Client() {
@@ -142,6 +98,12 @@ ssize_t Client::write(void *msgbuf, size_t maxlen) {
   } else {
     n_written = ::write(sockfd, msgbuf, maxlen);
   }
+  if (n_written > 0) {
+    if (bytes_out == 0) {
+      first_write = std::chrono::steady_clock::now();
+    }
+    bytes_out += n_written;
+  }
   return n_written;
 }
 
@@ -161,6 +123,9 @@ ssize_t Client::read(void *msgbuf, size_t maxlen) {
   } else {
     n_read = ::read(sockfd, msgbuf, maxlen);
   }
+  if (n_read > 0) {
+    bytes_in += n_read;
+  }
   return n_read;
 }
 
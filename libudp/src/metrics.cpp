@@ -0,0 +1,90 @@
+#include "udp/metrics.hpp"
+
+#include <new>
+
+namespace udp {
+
+int MetricsRegistry::create(const char* name, unsigned int num_slots) {
+  if (MetricsSegment::create(name, sizeof(Shard), num_slots) < 0) {
+    return -1;
+  }
+  new (shard(0)) Shard[shard_count()]();
+  return 0;
+}
+
+int MetricsRegistry::attach(const char* name) {
+  return MetricsSegment::attach(name, sizeof(Shard));
+}
+
+Metrics MetricsRegistry::snapshot() const {
+  Metrics metrics = {};
+  for (unsigned int i = 0; i < shard_count(); i++) {
+    const Shard& shard = *(const Shard*)this->shard(i);
+    metrics.accepts += shard.accepts.load(std::memory_order_relaxed);
+    metrics.drops += shard.drops.load(std::memory_order_relaxed);
+    metrics.active += shard.active.load(std::memory_order_relaxed);
+    metrics.closed += shard.closed.load(std::memory_order_relaxed);
+    metrics.bytes_in += shard.bytes_in.load(std::memory_order_relaxed);
+    metrics.bytes_out += shard.bytes_out.load(std::memory_order_relaxed);
+    metrics.handler_calls +=
+        shard.handler_calls.load(std::memory_order_relaxed);
+    metrics.handler_ns += shard.handler_ns.load(std::memory_order_relaxed);
+  }
+  return metrics;
+}
+
+void MetricsRegistry::accepted() const {
+  local().accepts.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MetricsRegistry::dropped() const {
+  local().drops.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MetricsRegistry::opened() const {
+  local().active.fetch_add(1, std::memory_order_relaxed);
+}
+
+static unsigned long nanoseconds(std::chrono::steady_clock::duration time) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(time).count();
+}
+
+void MetricsRegistry::closed(const Client& client, unsigned long first_packet,
+                             unsigned int slot) const {
+  unsigned int index = local_shard();
+  Shard& shard = *(Shard*)this->shard(index);
+  shard.bytes_in.fetch_add(client.bytes_in + first_packet,
+                           std::memory_order_relaxed);
+  shard.bytes_out.fetch_add(client.bytes_out, std::memory_order_relaxed);
+  unsigned long lifetime =
+      nanoseconds(std::chrono::steady_clock::now() - client.opened);
+  if (client.bytes_out > 0) {
+    record_session(index, slot, lifetime,
+                   nanoseconds(client.first_write - client.opened),
+                   client.bytes_out * 1e9 / (lifetime + 1));
+  } else {
+    record_session(index, slot, lifetime, -1, -1);
+  }
+  // wraps below zero on a shard other than the one it was opened on
+  shard.active.fetch_sub(1, std::memory_order_relaxed);
+  shard.closed.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MetricsRegistry::handled(std::chrono::steady_clock::duration time) const {
+  Shard& shard = local();
+  shard.handler_calls.fetch_add(1, std::memory_order_relaxed);
+  shard.handler_ns.fetch_add(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(time).count(),
+      std::memory_order_relaxed);
+}
+
+int MetricsRegistry::read(const char* name, Metrics& metrics) {
+  MetricsRegistry registry;
+  if (registry.attach(name) < 0) {
+    return -1;
+  }
+  metrics = registry.snapshot();
+  return 0;
+}
+
+}  // namespace udp
@@ -5,11 +5,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/select.h>
+#include <sys/signalfd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <chrono>
 #include <stdexcept>
 
 #include "udp/error.hpp"
@@ -77,7 +80,7 @@ Server& Server::set_timeout_handler(TimeoutFunction handler) {
     throw ConfigurationError(
         "Cannot set timeout handler while server is running");
   }
-  this->timeout_handler = handler;
+  this->timeout_handler = std::move(handler);
   return *this;
 }
 
@@ -85,7 +88,7 @@ Server& Server::add_handler(ClientHandlerFunction handler) {
   if (server_pid >= 0) {
     throw ConfigurationError("Cannot add handler while server is running");
   }
-  client_handler.add_handler(handler);
+  client_handler.add_handler(std::move(handler));
   return *this;
 }
 
@@ -122,6 +125,17 @@ Server& Server::set_initial_packet_buffer_size(size_t size) {
   return *this;
 }
 
+Server& Server::set_metrics_name(const char* name) {
+  if (server_pid >= 0) {
+    throw ConfigurationError("Cannot set metrics name while server is running");
+  }
+  if (*name != '/' || strchr(name + 1, '/') != nullptr) {
+    throw ConfigurationError("Metrics name must be a single /name");
+  }
+  metrics_name = name;
+  return *this;
+}
+
 pid_t Server::start() {
   // verify configuration
   if (server_pid >= 0) {
@@ -137,6 +151,13 @@ pid_t Server::start() {
     throw ConfigurationError("Max clients not set");
   }
 
+  if (client_handler.metrics.create(
+          metrics_name.empty() ? nullptr : metrics_name.c_str(),
+          client_handler.handlers.size()) < 0) {
+    perror("UDPServer metrics");
+    return -1;
+  }
+
   server_pid = fork();
 
   if (server_pid < 0) {
@@ -206,56 +227,67 @@ void Server::run_server() {
     fprintf(stderr, "UDPServer started on port %d\n", port_no);
   }
 
+  client_handler.slot_sessions.assign(client_handler.handlers.size(), 0);
+  client_handler.watch_children();
+  int child_fd = client_handler.child_fd;
   while (true) {
-    client_handler.reap_clients();
+    // finished clients are reaped as they exit, not before every packet
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(server_sock_fd, &read_fds);
+    if (child_fd >= 0) {
+      FD_SET(child_fd, &read_fds);
+    }
 
-    if (timeout > 0) {
-      fd_set read_fds;
-      FD_ZERO(&read_fds);
-      FD_SET(server_sock_fd, &read_fds);
+    struct timeval tv;
+    tv.tv_sec = timeout;
+    tv.tv_usec = 0;
 
-      struct timeval tv;
-      tv.tv_sec = timeout;
-      tv.tv_usec = 0;
+    if (debug_mode && timeout > 0) {
+      fprintf(stderr, "Waiting for up to %ds for a new connection\n",
+              timeout);
+    }
 
-      if (debug_mode) {
-        fprintf(stderr, "Waiting for up to %ds for a new connection\n",
-                timeout);
+    int ret = select(std::max(server_sock_fd, child_fd) + 1, &read_fds, NULL,
+                     NULL, timeout > 0 ? &tv : NULL);
+    if (ret < 0) {
+      perror("UDPServer select");
+      if (errno == EINTR) {
+        continue;
       }
+      // stop server on error
+      break;
+    }
 
-      int ret = select(server_sock_fd + 1, &read_fds, NULL, NULL, &tv);
-      if (ret < 0) {
-        perror("UDPServer select");
-        if (errno == EINTR) {
-          continue;
-        }
-        // stop server on error
-        break;
+    if (child_fd >= 0 && FD_ISSET(child_fd, &read_fds)) {
+      client_handler.reap_clients();
+    }
+
+    if (ret == 0) {
+      if (debug_mode) {
+        fprintf(stderr, "UDPServer timeout\n");
       }
 
-      if (ret == 0) {
+      timeout_count++;
+      // call timeout handler
+      if (timeout_handler != nullptr) {
         if (debug_mode) {
-          fprintf(stderr, "UDPServer timeout\n");
-        }
-
-        timeout_count++;
-        // call timeout handler
-        if (timeout_handler != nullptr) {
-          if (debug_mode) {
-            fprintf(stderr, "Calling timeout handler\n");
-          }
-          timeout_handler();
+          fprintf(stderr, "Calling timeout handler\n");
         }
-        if (max_timeouts > 0 && timeout_count >= max_timeouts) {
-          if (debug_mode) {
-            fprintf(stderr, "Max timeouts reached\n");
-          }
-          // stop server on max timeouts
-          break;
+        timeout_handler();
+      }
+      if (max_timeouts > 0 && timeout_count >= max_timeouts) {
+        if (debug_mode) {
+          fprintf(stderr, "Max timeouts reached\n");
         }
-        // continue waiting for connections
-        continue;
+        // stop server on max timeouts
+        break;
       }
+      // continue waiting for connections
+      continue;
+    }
+    if (!FD_ISSET(server_sock_fd, &read_fds)) {
+      continue;
     }
 
     // socket is ready to accept a new connection
@@ -272,6 +304,7 @@ void Server::run_server() {
   close(server_sock_fd);
 
   client_handler.join_clients();
+  client_handler.unwatch_children();
 }
 
 void Server::stop(bool force) {
@@ -296,26 +329,82 @@ void Server::stop(bool force) {
   server_pid = -1;
 }
 
-// reap all clients that have finished
-void Server::ClientHandler::reap_clients() {
-  if (debug_mode) {
-    fprintf(stderr, "Reaping clients\n");
+Metrics Server::get_metrics() const {
+  return client_handler.metrics.snapshot();
+}
+
+HandlerLatency Server::get_latency(unsigned int slot) const {
+  return client_handler.metrics.latency(slot);
+}
+
+// block SIGCHLD and read it from a signalfd, so finished clients are only
+// looked for once some have exited
+void Server::ClientHandler::watch_children() {
+  sigset_t sigchld;
+  sigemptyset(&sigchld);
+  sigaddset(&sigchld, SIGCHLD);
+  if (sigprocmask(SIG_BLOCK, &sigchld, nullptr) < 0) {
+    perror("UDPClientHandler sigprocmask");
+    return;
   }
+  child_fd = signalfd(-1, &sigchld, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (child_fd < 0) {
+    perror("UDPClientHandler signalfd");
+    sigprocmask(SIG_UNBLOCK, &sigchld, nullptr);
+  }
+}
 
+void Server::ClientHandler::unwatch_children() {
+  if (child_fd < 0) {
+    return;
+  }
+  close(child_fd);
+  child_fd = -1;
+  sigset_t sigchld;
+  sigemptyset(&sigchld);
+  sigaddset(&sigchld, SIGCHLD);
+  sigprocmask(SIG_UNBLOCK, &sigchld, nullptr);
+}
+
+// reap all clients that have finished
+void Server::ClientHandler::reap_clients() {
   if (clients.empty()) {
     return;
   }
 
+  if (child_fd >= 0) {
+    // several exits can share one SIGCHLD, waitpid below finds them all
+    struct signalfd_siginfo info[16];
+    ssize_t n_read = read(child_fd, info, sizeof(info));
+    if (n_read < 0 && errno == EAGAIN) {
+      // no client exited since the last reap
+      return;
+    }
+    while (n_read == sizeof(info)) {
+      n_read = read(child_fd, info, sizeof(info));
+    }
+  }
+
+  if (debug_mode) {
+    fprintf(stderr, "Reaping clients\n");
+  }
+
   int reap_count = 0;
   pid_t finished;
-  while (!clients.empty() && (finished = waitpid(0, nullptr, WNOHANG))) {
+  while (!clients.empty() && (finished = waitpid(-1, nullptr, WNOHANG))) {
     if (finished < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
       perror("UDPServer waitpid");
       break;
     }
-    clients.erase(std::remove(clients.begin(), clients.end(), finished),
-                  clients.end());
-    reap_count++;
+    auto client = clients.find(finished);
+    if (client != clients.end()) {
+      release_handler(client->second);
+      clients.erase(client);
+      reap_count++;
+    }
   }
 
   if (debug_mode) {
@@ -333,10 +422,11 @@ void Server::ClientHandler::join_clients() {
     fprintf(stderr, "Joining clients\n");
   }
 
-  for (unsigned int i = 0; i < clients.size(); i++) {
-    if (waitpid(clients[i], nullptr, 0) < 0) {
+  for (auto& client : clients) {
+    if (waitpid(client.first, nullptr, 0) < 0) {
       perror("UDPServer waitpid");
     }
+    release_handler(client.second);
   }
   clients.clear();
 }
@@ -347,8 +437,8 @@ void Server::ClientHandler::terminate_clients() {
     fprintf(stderr, "Terminating clients\n");
   }
 
-  for (unsigned int i = 0; i < clients.size(); i++) {
-    if (kill(clients[i], SIGTERM) < 0) {
+  for (auto& client : clients) {
+    if (kill(client.first, SIGTERM) < 0) {
       perror("UDPServer kill");
     }
   }
@@ -362,8 +452,8 @@ void Server::ClientHandler::kill_clients() {
     fprintf(stderr, "Killing clients\n");
   }
 
-  for (unsigned int i = 0; i < clients.size(); i++) {
-    if (kill(clients[i], SIGKILL) < 0) {
+  for (auto& client : clients) {
+    if (kill(client.first, SIGKILL) < 0) {
       perror("UDPServer kill");
     }
   }
@@ -373,24 +463,68 @@ void Server::ClientHandler::kill_clients() {
 
 Server::ClientHandler::~ClientHandler() { kill_clients(); }
 
-void Server::ClientHandler::accept(int server_sock_fd) {
-  reap_clients();
+// jump consistent hash (Lamping and Veach), only 1/n of the peers move
+// when a server restarts with one more handler
+static unsigned int jump_hash(uint64_t key, size_t num_buckets) {
+  int64_t bucket = -1, next = 0;
+  while (next < (int64_t)num_buckets) {
+    bucket = next;
+    key = key * 2862933555777941757ULL + 1;
+    next = (bucket + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1));
+  }
+  return bucket;
+}
+
+// FNV-1a of the peer address (the port changes with every session)
+static uint64_t peer_key(const struct sockaddr_in6& client_addr) {
+  uint64_t key = 14695981039346656037ULL;
+  for (uint8_t byte : client_addr.sin6_addr.s6_addr) {
+    key = (key ^ byte) * 1099511628211ULL;
+  }
+  return key;
+}
+
+unsigned int Server::ClientHandler::next_handler(
+    const struct sockaddr_in6& client_addr) {
   if (debug_mode) {
     fprintf(stderr, "mode: %d, current_handler: %d\n", mode, current_handler);
   }
-  ClientHandlerFunction handler;
+  unsigned int slot;
   switch (mode) {
     case RoundRobin:
-      handler = handlers[current_handler];
+      slot = current_handler;
       current_handler = (current_handler + 1) % handlers.size();
       break;
     case Random:
-      handler = handlers[rand() % handlers.size()];
+      slot = rand() % handlers.size();
+      break;
+    case LeastConnections:
+      // start after the last pick, so ties go round robin
+      slot = current_handler;
+      for (unsigned int i = 1; i < handlers.size(); i++) {
+        unsigned int other = (current_handler + i) % handlers.size();
+        if (slot_sessions[other] < slot_sessions[slot]) {
+          slot = other;
+        }
+      }
+      current_handler = (slot + 1) % handlers.size();
+      break;
+    case PeerHash:
+      slot = jump_hash(peer_key(client_addr), handlers.size());
       break;
     default:
       fprintf(stderr, "Invalid mode\n");
       throw std::runtime_error("Invalid mode");
   }
+  slot_sessions[slot]++;
+  return slot;
+}
+
+void Server::ClientHandler::accept(int server_sock_fd) {
+  // exits are reaped as SIGCHLD comes in, only a full server checks now
+  if (child_fd < 0 || clients.size() >= max_clients) {
+    reap_clients();
+  }
 
   struct sockaddr_in6 client_addr;
   socklen_t client_addr_len = sizeof(client_addr);
@@ -402,17 +536,23 @@ void Server::ClientHandler::accept(int server_sock_fd) {
     perror("UDPServer recvfrom");
     return;
   }
+  metrics.accepted();
 
   if (clients.size() >= max_clients) {
     if (debug_mode) {
       fprintf(stderr, "Max clients reached... dropping connection\n");
     }
+    metrics.dropped();
     return;
   }
 
+  // handlers are fixed while the server runs, so no copy is needed
+  unsigned int slot = next_handler(client_addr);
+  const ClientHandlerFunction* handler = &handlers[slot];
   auto pid = fork();
   if (pid < 0) {
     perror("UDPClientHandler fork");
+    release_handler(slot);
     return;
   }
   if (pid == 0) {
@@ -421,8 +561,10 @@ void Server::ClientHandler::accept(int server_sock_fd) {
       fprintf(stderr, "Got new connection... creating UDPClient\n");
     }
     close(server_sock_fd);
+    unwatch_children();
 
     Client* client = new Client(client_addr);
+    metrics.opened();
 
     if (debug_mode) {
       fprintf(stderr, "Handling connection from %s\n", client->peer_ip());
@@ -432,7 +574,10 @@ void Server::ClientHandler::accept(int server_sock_fd) {
       fprintf(stderr, "Calling handler\n");
     }
 
-    handler(client, first_packet, len, extra_data);
+    auto start = std::chrono::steady_clock::now();
+    (*handler)(client, first_packet, len, extra_data);
+    metrics.handled(std::chrono::steady_clock::now() - start);
+    metrics.closed(*client, len, slot);
     delete client;
     delete[] first_packet;
     exit(EXIT_SUCCESS);
@@ -440,7 +585,7 @@ void Server::ClientHandler::accept(int server_sock_fd) {
   if (debug_mode) {
     fprintf(stderr, "Adding child pid: %d\n", pid);
   }
-  clients.push_back(pid);
+  clients[pid] = slot;
 }
 
 }  // namespace udp
\ No newline at end of file
@@ -18,6 +18,10 @@ echo "Testing MP1: Concurrent"
 (cd MP1/test && ./concurrent.sh)
 mp1_passed=$((mp1_passed + $?))
 
+echo "Testing MP1: Load"
+(cd MP1/test && ./load.sh)
+mp1_passed=$((mp1_passed + $?))
+
 if [ $mp1_passed -eq 0 ]; then
     echo "MP1 tests passed!"
 else